@@ -0,0 +1,327 @@
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lazyml.hpp"
+
+using namespace lazyml;
+
+// Number of output neurons of every benchmarked network
+#define BENCH_OUTPUTS 10
+
+struct options {
+    std::vector<uint> widths = {16, 64, 256, 1024, 4096};
+    std::vector<uint> depths = {2, 4, 8};
+    std::vector<uint> batches = {1, 32, 256};
+
+    size_t samples = 1024;
+    // run() goes sample by sample, so it only gets a subset of the samples
+    size_t run_samples = 256;
+    uint iterations = 2;
+
+    // Networks with more parameters than this are skipped, 4096 wide and 8 deep doesn't fit most devices
+    size_t max_params = size_t(1) << 26;
+
+    // Index into the list printed by --list, best device by memory if not given
+    std::optional<size_t> device;
+    bool csv = false;
+    std::string output;
+    // Set every kernel argument before every launch instead of replaying launch plans
+    bool no_plans = false;
+    // Out-of-order queue with dependencies from an event graph, where the device supports it
+    bool out_of_order = false;
+};
+
+// One measured phase of one configuration
+struct result {
+    std::string phase;
+    uint width, depth, batch;
+    size_t params;
+    size_t samples;
+    double seconds;
+    // Host time spent issuing launches, and the part of it spent in enqueue calls
+    double dispatch_ms, enqueue_ms;
+    std::map<std::string, clwrapper::profiler::stats> kernels;
+};
+
+static std::vector<uint> parse_list(const std::string &str) {
+    std::vector<uint> list;
+    std::stringstream ss(str);
+    std::string item;
+    while(std::getline(ss, item, ',')) list.push_back(static_cast<uint>(std::stoul(item)));
+    return list;
+}
+
+static void usage() {
+    std::cerr <<
+        "usage: lazyml_bench [options]\n"
+        "  --widths a,b,...     layer widths (default 16,64,256,1024,4096)\n"
+        "  --depths a,b,...     number of layers including input and output (default 2,4,8)\n"
+        "  --batches a,b,...    training batch sizes (default 1,32,256)\n"
+        "  --samples n          synthetic samples (default 1024)\n"
+        "  --run-samples n      samples passed through run() (default 256)\n"
+        "  --iterations n       training epochs per measurement (default 2)\n"
+        "  --max-params n       skip networks with more parameters (default 2^26)\n"
+        "  --quick              small sweep for smoke testing\n"
+        "  --device i           device index from --list\n"
+        "  --list               list devices and exit\n"
+        "  --no-plans           set kernel arguments before every launch instead of replaying launch plans\n"
+        "  --out-of-order       run on an out-of-order queue if the device supports it\n"
+        "  --csv                CSV instead of JSON\n"
+        "  --output file        write results to file instead of stdout\n";
+}
+
+static options parse_options(int argc, char** argv) {
+    options opt;
+
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if(i + 1 >= argc) {
+                usage();
+                exit(-1);
+            }
+            return argv[++i];
+        };
+
+        if(arg == "--widths") opt.widths = parse_list(value());
+        else if(arg == "--depths") opt.depths = parse_list(value());
+        else if(arg == "--batches") opt.batches = parse_list(value());
+        else if(arg == "--samples") opt.samples = std::stoul(value());
+        else if(arg == "--run-samples") opt.run_samples = std::stoul(value());
+        else if(arg == "--iterations") opt.iterations = static_cast<uint>(std::stoul(value()));
+        else if(arg == "--max-params") opt.max_params = std::stoull(value());
+        else if(arg == "--device") opt.device = std::stoul(value());
+        else if(arg == "--csv") opt.csv = true;
+        else if(arg == "--no-plans") opt.no_plans = true;
+        else if(arg == "--out-of-order") opt.out_of_order = true;
+        else if(arg == "--output") opt.output = value();
+        else if(arg == "--quick") {
+            opt.widths = {16, 256};
+            opt.depths = {2, 4};
+            opt.batches = {32};
+            opt.samples = 256;
+            opt.run_samples = 32;
+            opt.iterations = 1;
+        } else if(arg == "--list") {
+            std::vector<cl::Device> devices = clwrapper::all_devices();
+            for(size_t d = 0; d < devices.size(); d++) {
+                std::cout << d << ": " << devices[d].getInfo<CL_DEVICE_NAME>() << "\n";
+            }
+            exit(0);
+        } else {
+            usage();
+            exit(arg == "--help" ? 0 : -1);
+        }
+    }
+
+    return opt;
+}
+
+static std::string json_escape(const std::string &str) {
+    std::string out;
+    for(char c : str) {
+        if(c == '"' || c == '\\') out += '\\';
+        if(static_cast<unsigned char>(c) >= 0x20) out += c;
+    }
+    return out;
+}
+
+static double ms(uint64_t ns) { return static_cast<double>(ns) / 1e6; }
+
+static void write_json(std::ostream &out, const std::string &device, const std::vector<result> &results) {
+    out << "{\n  \"device\": \"" << json_escape(device) << "\",\n";
+    out << "  \"float_bytes\": " << sizeof(VNN_FLOAT_TYPE) << ",\n";
+    out << "  \"results\": [\n";
+
+    for(size_t i = 0; i < results.size(); i++) {
+        const result &r = results[i];
+        out << "    {\"phase\": \"" << r.phase << "\""
+            << ", \"width\": " << r.width
+            << ", \"depth\": " << r.depth
+            << ", \"batch\": " << r.batch
+            << ", \"params\": " << r.params
+            << ", \"samples\": " << r.samples
+            << ", \"seconds\": " << r.seconds
+            << ", \"samples_per_sec\": " << r.samples / r.seconds
+            << ", \"dispatch_ms\": " << r.dispatch_ms
+            << ", \"enqueue_ms\": " << r.enqueue_ms
+            << ", \"kernels\": {";
+
+        size_t k = 0;
+        for(auto &[name, s] : r.kernels) {
+            out << (k++ ? ", " : "") << "\"" << json_escape(name) << "\": {"
+                << "\"count\": " << s.count
+                << ", \"execute_ms\": " << ms(s.execute)
+                << ", \"queued_ms\": " << ms(s.queued)
+                << ", \"submit_ms\": " << ms(s.submit)
+                << ", \"bytes\": " << s.bytes << "}";
+        }
+
+        out << "}}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+
+    out << "  ]\n}\n";
+}
+
+// One row per phase with an empty kernel column, followed by one row per kernel of that phase
+static void write_csv(std::ostream &out, const std::vector<result> &results) {
+    out << "phase,width,depth,batch,params,samples,seconds,samples_per_sec,dispatch_ms,enqueue_ms,kernel,count,execute_ms,queued_ms,submit_ms,bytes\n";
+
+    for(const result &r : results) {
+        std::stringstream prefix;
+        prefix << r.phase << "," << r.width << "," << r.depth << "," << r.batch << ","
+               << r.params << "," << r.samples << "," << r.seconds << "," << r.samples / r.seconds << ","
+               << r.dispatch_ms << "," << r.enqueue_ms << ",";
+
+        out << prefix.str() << ",,,,,\n";
+        for(auto &[name, s] : r.kernels) {
+            out << prefix.str() << name << "," << s.count << "," << ms(s.execute) << ","
+                << ms(s.queued) << "," << ms(s.submit) << "," << s.bytes << "\n";
+        }
+    }
+}
+
+// Uniform random inputs and one hot targets, the values don't matter for throughput
+static data::dataset<VNN_FLOAT_TYPE> synthetic_data(clwrapper::clcontext &con, size_t samples, uint width, std::mt19937 &rng) {
+    data::dataset<VNN_FLOAT_TYPE> data(con, samples, width, BENCH_OUTPUTS);
+
+    std::uniform_real_distribution<VNN_FLOAT_TYPE> value(0, 1);
+    std::uniform_int_distribution<uint> label(0, BENCH_OUTPUTS - 1);
+    for(size_t i = 0; i < samples; i++) {
+        for(VNN_FLOAT_TYPE &x : data.input(i)) x = value(rng);
+        data.target(i)[label(rng)] = 1;
+    }
+
+    data.write_to_device(true);
+    return data;
+}
+
+template<typename F>
+static result measure(clwrapper::clcontext &con, const std::string &phase, size_t samples, F f) {
+    clwrapper::profiler &prof = con.get_profiler();
+    prof.reset();
+
+    auto start = std::chrono::steady_clock::now();
+    f();
+    con._queue.finish();
+    auto end = std::chrono::steady_clock::now();
+
+    prof.resolve();
+
+    result r;
+    r.phase = phase;
+    r.samples = samples;
+    r.seconds = std::chrono::duration<double>(end - start).count();
+    r.dispatch_ms = ms(prof.dispatch_time().count());
+    r.enqueue_ms = ms(prof.host_time().count());
+    r.kernels = prof.by_name();
+    return r;
+}
+
+int main(int argc, char** argv) {
+    srand(time(nullptr));
+
+    options opt = parse_options(argc, argv);
+
+    cl::Device device;
+    if(opt.device) {
+        std::vector<cl::Device> devices = clwrapper::all_devices();
+        if(opt.device.value() >= devices.size()) {
+            std::cerr << "No device with index " << opt.device.value() << ", see --list\n";
+            return -1;
+        }
+        device = devices[opt.device.value()];
+    } else {
+        device = utils::value_or_panic(clwrapper::getBestDevice(), "Could not any find device");
+    }
+
+    std::string device_name = device.getInfo<CL_DEVICE_NAME>();
+    std::cerr << "Benchmarking on " << device_name << "\n";
+
+    // Statistics are read after every phase instead of being printed by the models
+    clwrapper::clcontext con(device, true, opt.out_of_order);
+    con.get_profiler().report_to(nullptr);
+    if(opt.out_of_order && !con.out_of_order()) std::cerr << "Device has no out-of-order queues, using an in-order one\n";
+
+    std::mt19937 rng(1234);
+    std::vector<result> results;
+
+    for(uint width : opt.widths) {
+        data::dataset<VNN_FLOAT_TYPE> data = synthetic_data(con, opt.samples, width, rng);
+
+        for(uint depth : opt.depths) {
+            if(depth < 2) continue;
+
+            std::vector<cl_uint> arch(depth, width);
+            arch.back() = BENCH_OUTPUTS;
+
+            size_t params = 0;
+            for(size_t l = 0; l + 1 < arch.size(); l++) params += size_t(arch[l]) * arch[l+1] + arch[l+1];
+            if(params > opt.max_params) {
+                std::cerr << "Skipping width " << width << " depth " << depth << ", " << params << " parameters\n";
+                continue;
+            }
+
+            std::cerr << "width " << width << " depth " << depth << "\n";
+
+            models::vnn nn {con, arch};
+            nn.use_launch_plans(!opt.no_plans);
+
+            size_t run_samples = std::min(opt.run_samples, opt.samples);
+            result r = measure(con, "run", run_samples, [&]() {
+                for(size_t i = 0; i < run_samples; i++) nn.run(data, i);
+            });
+            r.width = width; r.depth = depth; r.batch = 1; r.params = params;
+            results.push_back(r);
+
+            r = measure(con, "cost", opt.samples, [&]() { nn.cost(data); });
+            r.width = width; r.depth = depth; r.batch = VNN_MAX_BATCH_CHUNK; r.params = params;
+            results.push_back(r);
+
+            std::span<const VNN_FLOAT_TYPE> inputs(data.input(0).data(), opt.samples * width);
+            std::vector<VNN_FLOAT_TYPE> outputs;
+            r = measure(con, "run_batch", opt.samples, [&]() { nn.run_batch(inputs, outputs); });
+            r.width = width; r.depth = depth; r.batch = VNN_MAX_BATCH_CHUNK; r.params = params;
+            results.push_back(r);
+
+            // Batched inference with the int8 version of the network
+            models::qvnn quantized {con, nn, inputs.subspan(0, std::min<size_t>(opt.samples, 256) * width)};
+            r = measure(con, "run_int8", opt.samples, [&]() { quantized.run(inputs, outputs); });
+            r.width = width; r.depth = depth; r.batch = VNN_MAX_BATCH_CHUNK; r.params = params;
+            results.push_back(r);
+
+            for(uint batch : opt.batches) {
+                // Warm up, the first launches include allocating the batch buffers
+                nn.train(data, 1, 0.01, batch);
+
+                r = measure(con, "train", opt.samples * opt.iterations, [&]() {
+                    nn.train(data, opt.iterations, 0.01, batch);
+                });
+                r.width = width; r.depth = depth; r.batch = batch; r.params = params;
+                results.push_back(r);
+            }
+        }
+    }
+
+    std::ofstream file;
+    if(!opt.output.empty()) {
+        file.open(opt.output, std::ios::out | std::ios::trunc);
+        if(!file.is_open()) {
+            std::cerr << "Could not open " << opt.output << "\n";
+            return -1;
+        }
+    }
+    std::ostream &out = opt.output.empty() ? std::cout : file;
+
+    if(opt.csv) write_csv(out, results);
+    else write_json(out, device_name, results);
+}
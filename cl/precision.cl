@@ -0,0 +1,34 @@
+// Element types of the kernels, prepended to every program by the host, see precision.hpp.
+// REAL is the type of parameters and activations in global memory, ACCUM the type
+// everything is computed, accumulated and reduced in. REAL is only ever accessed
+// through LOAD/LOAD4/STORE, which lets half buffers be used without cl_khr_fp16.
+#if defined(REAL_HALF)
+    #define REAL half
+    #define ACCUM float
+    #define ACCUM4 float4
+    #define LOAD(p, i) vload_half((i), (p))
+    #define LOAD4(p) vload_half4(0, (p))
+    #define STORE(v, p, i) vstore_half((v), (i), (p))
+#elif defined(REAL_DOUBLE)
+    #pragma OPENCL EXTENSION cl_khr_fp64 : enable
+    #define REAL double
+    #define ACCUM double
+    #define ACCUM4 double4
+    #define LOAD(p, i) ((p)[i])
+    #define LOAD4(p) vload4(0, (p))
+    #define STORE(v, p, i) ((p)[i] = (v))
+#else
+    #define REAL float
+    #define ACCUM float
+    #define ACCUM4 float4
+    #define LOAD(p, i) ((p)[i])
+    #define LOAD4(p) vload4(0, (p))
+    #define STORE(v, p, i) ((p)[i] = (v))
+#endif
+
+// Smallest positive normal ACCUM, keeps logarithms finite
+#if defined(REAL_DOUBLE)
+    #define ACCUM_MIN DBL_MIN
+#else
+    #define ACCUM_MIN FLT_MIN
+#endif
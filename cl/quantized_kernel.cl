@@ -0,0 +1,172 @@
+// Integer inference kernels of models::qvnn. The program is built from
+// vanilla_nn_kernel.cl followed by this file, so activate() and the
+// ACTIVATION_* defines are those of the layer the program is built for.
+//
+// Weights are int8 with one scale per neuron, activations are uint8 with one
+// scale and zero point per layer:
+//     w = weight scale * qw
+//     a = layer scale * (qa - zero point)
+// so a row of A times a column of W is
+//     layer scale * weight scale * (sum qa*qw - zero point * sum qw)
+// where the sum of every weight column is computed once on the host.
+
+// Tile size of the integer GEMM kernels, in char4 along k and in outputs along the other dimensions
+#ifndef QGEMM_TS
+#define QGEMM_TS 16
+#endif
+
+// Devices with cl_khr_integer_dot_product compute the four products and their
+// sum in a single instruction, everything else widens to int first
+#ifdef __opencl_c_integer_dot_product_input_4x8bit
+int dot4(const uchar4 a, const char4 w) {
+    return dot(a, w);
+}
+#else
+int dot4(const uchar4 a, const char4 w) {
+    const int4 p = convert_int4(a) * convert_int4(w);
+    return p.x + p.y + p.z + p.w;
+}
+#endif
+
+uchar quantize_value(const ACCUM x, const ACCUM inv_scale, const int zero_point) {
+    return convert_uchar_sat(convert_int_sat_rte(x * inv_scale) + zero_point);
+}
+
+// Quantizes the [batch x cols] matrix X into rows of stride bytes of Q.
+// Global range is (cols, batch)
+void kernel quantize(
+    global uchar* Q,
+    const uint stride,
+    global const ACCUM* X,
+    const uint cols,
+    const uint batch,
+    const ACCUM inv_scale,
+    const int zero_point)
+{
+    const uint j = get_global_id(0);
+    const uint b = get_global_id(1);
+    if(j >= cols || b >= batch) return;
+
+    Q[b*stride + j] = quantize_value(X[b*cols + j], inv_scale, zero_point);
+}
+
+// Integer part of A * W for output (b, j) of the work item. QA is [batch x k4]
+// and QWT the transposed weights [cols x k4], both in char4 units, so every
+// tile is read along k. Padding at the end of a row is 0 in QWT, whatever the
+// padding of QA holds doesn't change the sum.
+// Every work item of the group has to call this, in range or not.
+int qgemm_tile(
+    global const char4* QWT,
+    global const uchar4* QA,
+    const uint k4,
+    const uint cols,
+    const uint batch,
+    local char4* Wt,
+    local uchar4* At)
+{
+    const uint lj = get_local_id(0);
+    const uint lb = get_local_id(1);
+    const uint j0 = get_group_id(0) * QGEMM_TS;
+    const uint b0 = get_group_id(1) * QGEMM_TS;
+
+    int acc = 0;
+    for(uint t = 0; t < k4; t += QGEMM_TS) {
+        // Work item (lj, lb) loads element t+lj of weight column j0+lb and of sample b0+lb
+        const uint k = t + lj;
+        Wt[lb*QGEMM_TS + lj] = (j0 + lb < cols && k < k4) ? QWT[(j0 + lb)*k4 + k] : (char4)(0);
+        At[lb*QGEMM_TS + lj] = (b0 + lb < batch && k < k4) ? QA[(b0 + lb)*k4 + k] : (uchar4)(0);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(uint kk = 0; kk < QGEMM_TS; kk++) {
+            acc += dot4(At[lb*QGEMM_TS + kk], Wt[lj*QGEMM_TS + kk]);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    return acc;
+}
+
+// Hidden layer: activate(dequantized A * W + B), requantized with the scale and zero
+// point of the next layer into rows of out_stride bytes of Qout.
+// scales[j] = layer scale * weight scale of neuron j, wsum[j] = sum of weight column j.
+// Global range is (cols, batch) rounded up to multiples of QGEMM_TS, local is (QGEMM_TS, QGEMM_TS)
+void kernel qgemm_forward(
+    global const char4* QWT,
+    global const int* wsum,
+    global const ACCUM* scales,
+    global const ACCUM* B,
+    global const uchar4* QA,
+    const uint k4,
+    const uint cols,
+    const uint batch,
+    const int zero_point,
+    global uchar* Qout,
+    const uint out_stride,
+    const ACCUM out_inv_scale,
+    const int out_zero_point)
+{
+    local char4 Wt[QGEMM_TS*QGEMM_TS];
+    local uchar4 At[QGEMM_TS*QGEMM_TS];
+
+    const int acc = qgemm_tile(QWT, QA, k4, cols, batch, Wt, At);
+
+    const uint j = get_global_id(0);
+    const uint b = get_global_id(1);
+    if(j >= cols || b >= batch) return;
+
+    const ACCUM z = (ACCUM)(acc - zero_point*wsum[j]) * scales[j] + B[j];
+    Qout[b*out_stride + j] = quantize_value(activate(z), out_inv_scale, out_zero_point);
+}
+
+// Output layer: same as qgemm_forward, but the [batch x cols] result stays in ACCUM
+void kernel qgemm_output(
+    global const char4* QWT,
+    global const int* wsum,
+    global const ACCUM* scales,
+    global const ACCUM* B,
+    global const uchar4* QA,
+    const uint k4,
+    const uint cols,
+    const uint batch,
+    const int zero_point,
+    global ACCUM* out)
+{
+    local char4 Wt[QGEMM_TS*QGEMM_TS];
+    local uchar4 At[QGEMM_TS*QGEMM_TS];
+
+    const int acc = qgemm_tile(QWT, QA, k4, cols, batch, Wt, At);
+
+    const uint j = get_global_id(0);
+    const uint b = get_global_id(1);
+    if(j >= cols || b >= batch) return;
+
+    const ACCUM z = (ACCUM)(acc - zero_point*wsum[j]) * scales[j] + B[j];
+    out[b*cols + j] = activate(z);
+}
+
+// softmax of vanilla_nn_kernel.cl for the ACCUM output of qgemm_output.
+// Global range is (batch)
+void kernel qsoftmax(
+    global ACCUM* A,
+    const uint cols,
+    const uint batch)
+{
+    const uint b = get_global_id(0);
+    if(b >= batch) return;
+
+    global ACCUM* a = A + b*cols;
+
+    ACCUM m = a[0];
+    for(uint j = 1; j < cols; j++) m = fmax(m, a[j]);
+
+    ACCUM sum = 0;
+    for(uint j = 0; j < cols; j++) {
+        a[j] = exp(a[j] - m);
+        sum += a[j];
+    }
+
+    const ACCUM inv = 1.0f / sum;
+    for(uint j = 0; j < cols; j++) a[j] *= inv;
+}
@@ -1,4 +1,6 @@
 
+// REAL, ACCUM, LOAD and STORE come from precision.cl
+
 ulong rand(ulong x) {
     x ^= (x << 21);
     x ^= (x >> 35);
@@ -24,19 +26,95 @@ void kernel rand_buffer(
     out[id] = x;
 }
 
-void kernel zero(global float* out, const uint n) {
+void kernel zero(global ACCUM* out, const uint n) {
     const int id = get_global_id(0);
-    if(id != 0) return;
+    if(id >= n) return;
 
-    for(uint i = 0; i < n; i++) out[i] = 0;
+    out[id] = 0;
 }
 
-void kernel copy(global float* dest, global float* src, const uint n) {
+void kernel copy(global ACCUM* dest, global ACCUM* src, const uint n) {
     const int id = get_global_id(0);
     if(id >= n) return;
 
     dest[id] = src[id];
 }
 
+// dest += src, sums the gradients of several devices
+void kernel add(global ACCUM* dest, global const ACCUM* src, const uint n) {
+    const int id = get_global_id(0);
+    if(id >= n) return;
+
+    dest[id] += src[id];
+}
+
+// Copy of ACCUM values into REAL storage, only needed when the two differ.
+// Offsets are in elements, like copy_u8.
+void kernel to_real(
+    global REAL* dest,
+    const uint dest_offset,
+    global const ACCUM* src,
+    const uint src_offset,
+    const uint n)
+{
+    const uint id = get_global_id(0);
+    if(id >= n) return;
+
+    STORE(src[src_offset + id], dest, dest_offset + id);
+}
+
+// Copy of compact byte data, widened to REAL and scaled on the way.
+// Offset is in elements of src, so no sub buffer with its alignment rules is needed.
+void kernel copy_u8(
+    global REAL* dest,
+    global const uchar* src,
+    const uint offset,
+    const uint n,
+    const ACCUM scale)
+{
+    const uint id = get_global_id(0);
+    if(id >= n) return;
+
+    STORE((ACCUM)src[offset + id] * scale, dest, id);
+}
 
+// Expands one byte class labels to one hot rows of dest, n = number of labels * classes
+void kernel one_hot(
+    global REAL* dest,
+    global const uchar* labels,
+    const uint offset,
+    const uint classes,
+    const uint n)
+{
+    const uint id = get_global_id(0);
+    if(id >= n) return;
+
+    STORE(labels[offset + id/classes] == id%classes ? 1.0f : 0.0f, dest, id);
+}
 
+// Sums row r of the row major [rows x n] matrix in into out[r].
+// Launched as a single work group per row, global range is (local size, rows).
+// The local size has to be a power of two, scratch holds 1 ACCUM per work item.
+void kernel reduce_sum(
+    global const ACCUM* in,
+    const uint n,
+    global ACCUM* out,
+    local ACCUM* scratch)
+{
+    const uint lid = get_local_id(0);
+    const uint lsz = get_local_size(0);
+    global const ACCUM* row = in + get_global_id(1)*n;
+
+    ACCUM value = 0;
+    for(uint i = lid; i < n; i += lsz) value += row[i];
+
+    scratch[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint s = lsz/2; s > 0; s >>= 1) {
+        if(lid < s) scratch[lid] += scratch[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(lid == 0) out[get_global_id(1)] = scratch[0];
+}
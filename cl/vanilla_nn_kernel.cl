@@ -1,135 +1,491 @@
 
-float relu(const float x) {
+// REAL, ACCUM, LOAD and STORE come from precision.cl
+
+ACCUM relu(const ACCUM x) {
     return (x > 0 ? x : 0);
 }
 
-float relu_prime(const float x) {
+ACCUM relu_prime(const ACCUM x) {
     return (x > 0 ? 1 : 0);
 }
 
-float sigmoid(const float x) {
-    return 1.0 / (1.0 + exp(-x));
+ACCUM sigmoid(const ACCUM x) {
+    return 1.0f / (1.0f + exp(-x));
 }
 
 // Note that the expected argument is sigmoid(x) and not x
-float sigmoid_lazy_prime(const float sigmoid_x) {
-    return sigmoid_x * (1.0 - sigmoid_x);
+ACCUM sigmoid_lazy_prime(const ACCUM sigmoid_x) {
+    return sigmoid_x * (1.0f - sigmoid_x);
 }
 
-void kernel backprop_delta_init(
-    global float* A,
-    global float* out,
-    const uint n)
-{
-    int id = get_global_id(0);
+// Activation of the layer the program is built for, see model/activation.hpp.
+// Every layer gets the kernels of the program built with its activation.
+#define ACTIVATION_SIGMOID 0
+#define ACTIVATION_RELU 1
+#define ACTIVATION_LEAKY_RELU 2
+#define ACTIVATION_TANH 3
+#define ACTIVATION_LINEAR 4
+#define ACTIVATION_SOFTMAX 5
 
-    if(id >= n) return;
+#ifndef ACTIVATION
+#define ACTIVATION ACTIVATION_SIGMOID
+#endif
 
-    out[id] = A[id] - out[id];
+#ifndef LEAKY_RELU_SLOPE
+#define LEAKY_RELU_SLOPE 0.01f
+#endif
+
+// Softmax needs the whole row, so gemm_forward leaves its outputs linear and
+// the softmax kernel normalizes them afterwards
+ACCUM activate(const ACCUM x) {
+#if ACTIVATION == ACTIVATION_SIGMOID
+    return sigmoid(x);
+#elif ACTIVATION == ACTIVATION_RELU
+    return relu(x);
+#elif ACTIVATION == ACTIVATION_LEAKY_RELU
+    return x > 0 ? x : LEAKY_RELU_SLOPE*x;
+#elif ACTIVATION == ACTIVATION_TANH
+    return tanh(x);
+#else
+    return x;
+#endif
 }
 
+// Like sigmoid_lazy_prime the expected argument is activate(x) and not x,
+// every supported activation has a derivative that can be computed from it
+ACCUM activate_lazy_prime(const ACCUM y) {
+#if ACTIVATION == ACTIVATION_SIGMOID
+    return sigmoid_lazy_prime(y);
+#elif ACTIVATION == ACTIVATION_RELU
+    return relu_prime(y);
+#elif ACTIVATION == ACTIVATION_LEAKY_RELU
+    return y > 0 ? 1.0f : LEAKY_RELU_SLOPE;
+#elif ACTIVATION == ACTIVATION_TANH
+    return 1.0f - y*y;
+#else
+    return 1.0f;
+#endif
+}
 
-// Update previous biases, weights and gA values which act as (aL - y) for the hidden layers
-void kernel backprop_step(
-    global float* W,
-    global float* gW,
-    global float* gB,
-    global float* A,
-    global float* prevA,
-    global float* gA,
-    global float* prevgA,
+// Tile parameters of the GEMM kernels, the host passes the values it was built with.
+// A work group computes a GEMM_TS x GEMM_TS block of the output and every
+// work item computes GEMM_WPT x GEMM_WPT entries of it.
+#ifndef GEMM_TS
+#define GEMM_TS 32
+#endif
+
+#ifndef GEMM_WPT
+#define GEMM_WPT 4
+#endif
+
+// Work items per dimension of a work group
+#define GEMM_RTS (GEMM_TS / GEMM_WPT)
+
+// Row length of the local tiles, padded to avoid bank conflicts
+#define GEMM_LTS (GEMM_TS + 1)
+
+// All activation matrices below are [batch x neurons], one row per sample.
+// W is [rows x cols] where rows = neurons in the previous layer and
+// cols = neurons in the current layer.
+
+// Loads the GEMM_TS x GEMM_TS tile starting at (r0, c0) of the row major
+// [rows x cols] matrix M into local memory, transposed if requested.
+// Entries outside of M are loaded as 0. The tile is always ACCUM, so half
+// storage is converted once per element here and never in the inner loop.
+void gemm_load_tile(
+    global const REAL* M,
+    const uint rows,
     const uint cols,
-    const uint rows)
+    const uint r0,
+    const uint c0,
+    local ACCUM* tile,
+    const int transpose)
 {
-    int id = get_global_id(0);
+    const int lid = get_local_id(1)*GEMM_RTS + get_local_id(0);
 
-    // Update gW and gB
-    if(id < cols) {
-        float aL = A[id];
+    for(int i = lid; i < GEMM_TS*GEMM_TS/4; i += GEMM_RTS*GEMM_RTS) {
+        const int r = i / (GEMM_TS/4);
+        const int c = (i % (GEMM_TS/4)) * 4;
 
-        // (aL - y)
-        float diff_ay = gA[id];
+        const uint gr = r0 + r;
+        const uint gc = c0 + c;
 
-        // aL * (1 - aL)
-        float activation_prime = sigmoid_lazy_prime(aL);
+        ACCUM4 v = (ACCUM4)(0.0f);
+        if(gr < rows) {
+            global const REAL* p = M + (size_t)gr*cols + gc;
 
-        float delta = 2.0 * diff_ay * activation_prime;
+            if(gc + 3 < cols) {
+                v = LOAD4(p);
+            } else {
+                if(gc < cols) v.s0 = LOAD(p, 0);
+                if(gc + 1 < cols) v.s1 = LOAD(p, 1);
+                if(gc + 2 < cols) v.s2 = LOAD(p, 2);
+            }
+        }
+
+        if(transpose) {
+            tile[(c+0)*GEMM_LTS + r] = v.s0;
+            tile[(c+1)*GEMM_LTS + r] = v.s1;
+            tile[(c+2)*GEMM_LTS + r] = v.s2;
+            tile[(c+3)*GEMM_LTS + r] = v.s3;
+        } else {
+            tile[r*GEMM_LTS + c+0] = v.s0;
+            tile[r*GEMM_LTS + c+1] = v.s1;
+            tile[r*GEMM_LTS + c+2] = v.s2;
+            tile[r*GEMM_LTS + c+3] = v.s3;
+        }
+    }
+}
+
+// Computes this work item's part of op(A) * op(B) into acc, where op(A) is
+// [M x K] and op(B) is [K x N]. A transposed matrix is read from its stored
+// [K x M] / [N x K] layout, so no transposed copies are ever made.
+// acc[i][j] is the output at row ty + i*GEMM_RTS and column tx + j*GEMM_RTS
+// of the work group's block.
+void gemm_accumulate(
+    global const REAL* A, const int a_trans,
+    global const REAL* B, const int b_trans,
+    const uint M, const uint N, const uint K,
+    local ACCUM* As,
+    local ACCUM* Bs,
+    ACCUM acc[GEMM_WPT][GEMM_WPT])
+{
+    const int tx = get_local_id(0);
+    const int ty = get_local_id(1);
 
-        gB[id] += delta;
+    const uint m0 = get_group_id(1)*GEMM_TS;
+    const uint n0 = get_group_id(0)*GEMM_TS;
 
-        // rows = rows in W
-        // cols = columns in W
-        for(int k = 0; k < rows; k++) {
-            float aLprev = prevA[k];
-            gW[k*cols + id] += aLprev * delta;
+    for(int i = 0; i < GEMM_WPT; i++)
+        for(int j = 0; j < GEMM_WPT; j++)
+            acc[i][j] = 0;
+
+    for(uint k0 = 0; k0 < K; k0 += GEMM_TS) {
+        // As is indexed [m][k], Bs is indexed [k][n]
+        if(a_trans) gemm_load_tile(A, K, M, k0, m0, As, 1);
+        else        gemm_load_tile(A, M, K, m0, k0, As, 0);
+
+        if(b_trans) gemm_load_tile(B, N, K, n0, k0, Bs, 1);
+        else        gemm_load_tile(B, K, N, k0, n0, Bs, 0);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(int k = 0; k < GEMM_TS; k++) {
+            // Register blocking, every value read from local memory is used GEMM_WPT times
+            ACCUM b_reg[GEMM_WPT];
+            for(int j = 0; j < GEMM_WPT; j++) b_reg[j] = Bs[k*GEMM_LTS + tx + j*GEMM_RTS];
+
+            for(int i = 0; i < GEMM_WPT; i++) {
+                const ACCUM a = As[(ty + i*GEMM_RTS)*GEMM_LTS + k];
+                for(int j = 0; j < GEMM_WPT; j++) acc[i][j] = mad(a, b_reg[j], acc[i][j]);
+            }
         }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+}
 
-    if(id >= rows) return;
+// out = activate(A * W + B)
+// A is [batch x rows], out is [batch x cols]
+// Global range is (ceil(cols/GEMM_TS)*GEMM_RTS, ceil(batch/GEMM_TS)*GEMM_RTS)
+__attribute__((reqd_work_group_size(GEMM_RTS, GEMM_RTS, 1)))
+void kernel gemm_forward(
+    global const REAL* W,
+    global const REAL* B,
+    global const REAL* A,
+    const uint rows,
+    const uint cols,
+    global REAL* out,
+    const uint batch)
+{
+    local ACCUM As[GEMM_TS*GEMM_LTS];
+    local ACCUM Bs[GEMM_TS*GEMM_LTS];
+    ACCUM acc[GEMM_WPT][GEMM_WPT];
+
+    gemm_accumulate(A, 0, W, 0, batch, cols, rows, As, Bs, acc);
 
-    // Update gA
-    for(int j = 0; j < cols; j++) {
-        float activation_prime = sigmoid_lazy_prime(A[j]);
-        float diff_ay = gA[j];
-        float delta = 2.0 * diff_ay * activation_prime;
+    for(int i = 0; i < GEMM_WPT; i++) {
+        const uint b = get_group_id(1)*GEMM_TS + get_local_id(1) + i*GEMM_RTS;
+        if(b >= batch) break;
 
-        prevgA[id] += W[id*cols + j] * delta;
+        for(int j = 0; j < GEMM_WPT; j++) {
+            const uint c = get_group_id(0)*GEMM_TS + get_local_id(0) + j*GEMM_RTS;
+            if(c >= cols) break;
+
+            STORE(activate(acc[i][j] + LOAD(B, c)), out, b*cols + c);
+        }
     }
 }
 
-void kernel apply_gradient(
-    global float* W,
-    global float* gW,
-    global float* B,
-    global float* gB,
+// Back propagates the deltas of a layer to the previous layer.
+// prevgA = (gA * W^T) (.) activate'(prevA)
+// Has to come from the program built with the activation of the previous layer
+// gA is [batch x cols], prevA and prevgA are [batch x rows]
+// Global range is (ceil(rows/GEMM_TS)*GEMM_RTS, ceil(batch/GEMM_TS)*GEMM_RTS)
+__attribute__((reqd_work_group_size(GEMM_RTS, GEMM_RTS, 1)))
+void kernel gemm_backprop(
+    global const REAL* W,
+    global const REAL* prevA,
+    global const REAL* gA,
+    global REAL* prevgA,
     const uint cols,
     const uint rows,
-    const uint n,
-    const float learning_rate
-) {
-    const int id = get_global_id(0);
-    if(id >= cols) return;
+    const uint batch)
+{
+    local ACCUM As[GEMM_TS*GEMM_LTS];
+    local ACCUM Bs[GEMM_TS*GEMM_LTS];
+    ACCUM acc[GEMM_WPT][GEMM_WPT];
+
+    gemm_accumulate(gA, 0, W, 1, batch, rows, cols, As, Bs, acc);
 
-    const float nf = (float)n;
+    for(int i = 0; i < GEMM_WPT; i++) {
+        const uint b = get_group_id(1)*GEMM_TS + get_local_id(1) + i*GEMM_RTS;
+        if(b >= batch) break;
 
-    B[id] -= learning_rate*(gB[id] / nf);
-    for(int i = 0; i < rows; i++) W[i*cols + id] -= learning_rate*(gW[i*cols + id] / nf);
+        for(int j = 0; j < GEMM_WPT; j++) {
+            const uint k = get_group_id(0)*GEMM_TS + get_local_id(0) + j*GEMM_RTS;
+            if(k >= rows) break;
 
+            STORE(acc[i][j] * activate_lazy_prime(LOAD(prevA, b*rows + k)), prevgA, b*rows + k);
+        }
+    }
 }
 
-void kernel cost(global float* A, global float* expected, const int n, global float* out) {
-    // This doesn't run in parallel, not really needed
-    if(get_global_id(0) != 0) return;
+// Accumulates the weight gradient of a layer over the whole batch.
+// gW += prevA^T * gA, gradients are always ACCUM
+// Global range is (ceil(cols/GEMM_TS)*GEMM_RTS, ceil(rows/GEMM_TS)*GEMM_RTS)
+__attribute__((reqd_work_group_size(GEMM_RTS, GEMM_RTS, 1)))
+void kernel gemm_weight_gradient(
+    global ACCUM* gW,
+    global const REAL* prevA,
+    global const REAL* gA,
+    const uint cols,
+    const uint rows,
+    const uint batch)
+{
+    local ACCUM As[GEMM_TS*GEMM_LTS];
+    local ACCUM Bs[GEMM_TS*GEMM_LTS];
+    ACCUM acc[GEMM_WPT][GEMM_WPT];
 
-    for(int i = 0; i < n; i++) {
-        float diff = A[0] - expected[0];
-        out[0] += diff*diff;
-    }
+    gemm_accumulate(prevA, 1, gA, 0, rows, cols, batch, As, Bs, acc);
+
+    for(int i = 0; i < GEMM_WPT; i++) {
+        const uint k = get_group_id(1)*GEMM_TS + get_local_id(1) + i*GEMM_RTS;
+        if(k >= rows) break;
+
+        for(int j = 0; j < GEMM_WPT; j++) {
+            const uint c = get_group_id(0)*GEMM_TS + get_local_id(0) + j*GEMM_RTS;
+            if(c >= cols) break;
 
-    out[0] /= n;
+            gW[k*cols + c] += acc[i][j];
+        }
+    }
 }
 
-void kernel forward(
-    global float* W,
-    global float* B,
-    global float* A,
-    const uint rows,
+// Numerically stable softmax of every row of the [batch x cols] matrix A, in place.
+// The largest value of a row is subtracted before exponentiating, so exp never overflows.
+// Global range is (batch)
+void kernel softmax(
+    global REAL* A,
     const uint cols,
-    global float* out)
-{ 
+    const uint batch)
+{
+    const uint b = get_global_id(0);
+    if(b >= batch) return;
+
+    global REAL* a = A + b*cols;
+
+    ACCUM m = LOAD(a, 0);
+    for(uint j = 1; j < cols; j++) m = fmax(m, LOAD(a, j));
+
+    // The exponentials are recomputed instead of stored, a half buffer would round them before the sum
+    ACCUM sum = 0;
+    for(uint j = 0; j < cols; j++) sum += exp(LOAD(a, j) - m);
+
+    const ACCUM inv = 1.0f / sum;
+    for(uint j = 0; j < cols; j++) STORE(exp(LOAD(a, j) - m) * inv, a, j);
+}
+
+// Turns the targets stored in out into the deltas of the output layer
+// out = 2 * (aL - y) * activate'(aL) for the squared error, or
+// out = aL - y for softmax with cross entropy, where the softmax Jacobian cancels out
+void kernel backprop_delta_init(
+    global const REAL* A,
+    global REAL* out,
+    const uint n)
+{
     int id = get_global_id(0);
 
+    if(id >= n) return;
+
+    const ACCUM a = LOAD(A, id);
+    const ACCUM y = LOAD(out, id);
+
+#if ACTIVATION == ACTIVATION_SOFTMAX
+    STORE(a - y, out, id);
+#else
+    STORE(2.0f * (a - y) * activate_lazy_prime(a), out, id);
+#endif
+}
+
+// Accumulates the bias gradient of a layer over the whole batch.
+// Global range is (cols)
+void kernel bias_gradient(
+    global ACCUM* gB,
+    global const REAL* gA,
+    const uint cols,
+    const uint batch)
+{
+    const int id = get_global_id(0);
     if(id >= cols) return;
 
-    float value = 0;
-    for(int i = 0; i < rows; i++) {
-        value += A[i] * W[i*cols + id];
+    ACCUM value = 0;
+    for(int b = 0; b < batch; b++) value += LOAD(gA, b*cols + id);
+
+    gB[id] += value;
+}
+
+// The update kernels run over the whole parameter arena of the network, work
+// item id updates parameter id. The gradients and the optimizer state share
+// the layout of the parameters, and the padding between tensors has a gradient
+// of 0, which leaves it unchanged. scale turns the summed gradient of the batch
+// into its average. See model/optimizer.hpp.
+// Parameters are REAL, gradients and optimizer state ACCUM.
+#define UPDATE_PARAMETER(delta) STORE(LOAD(P, id) - (delta), P, id)
+
+void kernel apply_gradient(
+    global REAL* P,
+    global const ACCUM* G,
+    const uint n,
+    const ACCUM scale,
+    const ACCUM learning_rate
+) {
+    const uint id = get_global_id(0);
+    if(id >= n) return;
+
+    const ACCUM g = G[id] * scale;
+    UPDATE_PARAMETER(learning_rate*g);
+}
+
+// Momentum and Nesterov momentum, V holds the velocity of every parameter
+void kernel apply_momentum(
+    global REAL* P,
+    global const ACCUM* G,
+    global ACCUM* V,
+    const uint n,
+    const ACCUM scale,
+    const ACCUM learning_rate,
+    const ACCUM momentum,
+    const uint nesterov
+) {
+    const uint id = get_global_id(0);
+    if(id >= n) return;
+
+    const ACCUM g = G[id] * scale;
+
+    const ACCUM velocity = momentum*V[id] + g;
+    V[id] = velocity;
+
+    UPDATE_PARAMETER(learning_rate*(nesterov ? g + momentum*velocity : velocity));
+}
+
+// Adam, M and V hold the first and second moments. The bias corrections are
+// folded into learning_rate on the host.
+void kernel apply_adam(
+    global REAL* P,
+    global const ACCUM* G,
+    global ACCUM* M,
+    global ACCUM* V,
+    const uint n,
+    const ACCUM scale,
+    const ACCUM learning_rate,
+    const ACCUM beta1,
+    const ACCUM beta2,
+    const ACCUM epsilon
+) {
+    const uint id = get_global_id(0);
+    if(id >= n) return;
+
+    const ACCUM g = G[id] * scale;
+
+    const ACCUM m1 = beta1*M[id] + (1.0f - beta1)*g;
+    const ACCUM v1 = beta2*V[id] + (1.0f - beta2)*g*g;
+    M[id] = m1;
+    V[id] = v1;
+
+    UPDATE_PARAMETER(learning_rate * m1 / (sqrt(v1) + epsilon));
+}
+
+#undef UPDATE_PARAMETER
+
+// Squared error, or cross entropy for softmax outputs, and classification result
+// of every sample in the batch, summed per work group.
+// Work item b handles sample b. A sample counts as correct when the largest output
+// matches the largest target, or for single output networks when both are on the
+// same side of 0.5.
+// partials[offset + group] receives the summed error of the work group and
+// partials[stride + offset + group] its number of correct samples.
+// The local size has to be a power of two, scratch holds 2 ACCUM values per work item.
+void kernel cost(
+    global const REAL* A,
+    global const REAL* Y,
+    const uint cols,
+    const uint batch,
+    global ACCUM* partials,
+    const uint offset,
+    const uint stride,
+    local ACCUM* scratch)
+{
+    const uint b = get_global_id(0);
+    const uint lid = get_local_id(0);
+    const uint lsz = get_local_size(0);
+
+    ACCUM err = 0;
+    ACCUM correct = 0;
+
+    if(b < batch) {
+        global const REAL* a = A + b*cols;
+        global const REAL* y = Y + b*cols;
+
+        uint a_max = 0, y_max = 0;
+        ACCUM a_best = LOAD(a, 0), y_best = LOAD(y, 0);
+        for(uint j = 0; j < cols; j++) {
+            const ACCUM aj = LOAD(a, j);
+            const ACCUM yj = LOAD(y, j);
+
+#if ACTIVATION == ACTIVATION_SOFTMAX
+            // Clamped so a confidently wrong output costs a large but finite amount
+            err -= yj * log(fmax(aj, (ACCUM)ACCUM_MIN));
+#else
+            ACCUM diff = aj - yj;
+            err += diff*diff;
+#endif
+
+            if(aj > a_best) { a_max = j; a_best = aj; }
+            if(yj > y_best) { y_max = j; y_best = yj; }
+        }
+
+        if(cols == 1) correct = ((a_best >= 0.5f) == (y_best >= 0.5f)) ? 1 : 0;
+        else correct = (a_max == y_max) ? 1 : 0;
     }
-    value += B[id];
 
-    out[id] = sigmoid(value);
-} 
+    scratch[lid] = err;
+    scratch[lsz + lid] = correct;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
+    for(uint s = lsz/2; s > 0; s >>= 1) {
+        if(lid < s) {
+            scratch[lid] += scratch[lid + s];
+            scratch[lsz + lid] += scratch[lsz + lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if(lid == 0) {
+        partials[offset + get_group_id(0)] = scratch[0];
+        partials[stride + offset + get_group_id(0)] = scratch[lsz];
+    }
+}
 
 // Equivalent to backprop_step, but doesn't run in parallel
 // Used for debugging
@@ -0,0 +1,25 @@
+# Turns OpenCL source files into a C++ header so the kernels are part of the library.
+#
+# Usage: cmake -DOUTPUT=<header> -DSOURCES=<file;file;...> -P embed_cl.cmake
+#
+# Every file becomes `lazyml::kernels::embedded::<file name without extension>`.
+
+set(CONTENT "#pragma once\n\n// Generated by cmake/embed_cl.cmake, do not edit\n\nnamespace lazyml::kernels::embedded {\n")
+
+foreach(SOURCE ${SOURCES})
+    get_filename_component(NAME ${SOURCE} NAME_WE)
+    file(READ ${SOURCE} SOURCE_CONTENT)
+    string(APPEND CONTENT "\n    inline constexpr const char ${NAME}[] = R\"lazyml_cl(${SOURCE_CONTENT})lazyml_cl\";\n")
+endforeach()
+
+string(APPEND CONTENT "\n}\n")
+
+# Only touch the header when something changed to avoid needless rebuilds
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} OLD_CONTENT)
+    if(OLD_CONTENT STREQUAL CONTENT)
+        return()
+    endif()
+endif()
+
+file(WRITE ${OUTPUT} "${CONTENT}")
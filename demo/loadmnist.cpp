@@ -4,8 +4,6 @@
 #include <cassert>
 
 #include "clwrapper.hpp"
-
-#define ENTRIES 10000
 #include "mnistdata.hpp"
 
 using namespace lazyml;
@@ -16,21 +14,20 @@ int main() {
     cl::Device default_device = utils::value_or_panic(clwrapper::getBestDevice(), "Could not any find device");
     clwrapper::clcontext con = {default_device};
 
-    auto inputs_outputs  = get_mnist_data(
+    auto data = get_mnist_data(
         con,
         "data/t10k-images-idx3-ubyte",
         "data/t10k-labels-idx1-ubyte"
     );
 
-    auto inputs = inputs_outputs.first;
-    auto outputs = inputs_outputs.second;
+    std::cout << "samples: " << data.size() << std::endl;
 
-    std::cout << "inputs len: " << inputs.size() << std::endl;
-    std::cout << "outputs len: " << outputs.size() << std::endl;
+    std::vector<VNN_FLOAT_TYPE> image(PIXELS_PER_IMAGE), target(DIGITS);
+    data.decode_input(0, image.data());
 
     std::cout << "Image\n";
     for(size_t i = 0; i < PIXELS_PER_IMAGE; i++) {
-        std::cout << inputs[0][i] << " ";
+        std::cout << image[i] << " ";
     }
     std::cout << std::endl;
 
@@ -39,29 +36,31 @@ int main() {
     // 10 outputs neurons, one for each possible digit[0-9]
     std::vector<cl_uint> arch = {784, 16, 16, 10};
 
-    models::vnn nn {con, "mnist2.nn"};
+    // Loaded for inference only, training it below needs mode::TRAINING
+    models::vnn nn {con, "mnist2.nn", models::vnn::mode::INFERENCE};
 
-    float c0 = nn.cost(inputs, outputs);
+    float c0 = nn.cost(data);
     std::cout << "COST: " << c0 << std::endl;
 
-    for(size_t i = 0; i < inputs.size(); i++) {
-        auto result = nn.run(inputs[i]);
+    for(size_t i = 0; i < data.size(); i++) {
+        auto result = nn.run(data, i);
 
         std::cout << "Result: ";
         for(size_t j = 0; j < 10; j++) {
             std::cout << result[j] << " ";
         }
         std::cout << "\nExpected: ";
+        data.decode_target(i, target.data());
         for(size_t j = 0; j < 10; j++) {
-            std::cout << outputs[i][j] << " ";
+            std::cout << target[j] << " ";
         }
         std::cout << std::endl;
 
     }
 
-//    nn.train(inputs, outputs, 3, 20.0);
+//    nn.train(data, 3, 1.0, 32);
 //
-//    float c1 = nn.cost(inputs, outputs);
+//    float c1 = nn.cost(data);
 //    std::cout << "COST: " << c1 << std::endl;
 
 //    if(c1 < c0) nn.serialize("mnist.nn");
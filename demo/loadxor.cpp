@@ -31,8 +31,8 @@ int main() {
     // Create context using previously found GPU
     clwrapper::clcontext con = {default_device};
 
-    // Load the serialized xor model
-    models::vnn nn {con, "xor.nn"};
+    // Load the serialized xor model, it is only run so it doesn't need any gradients
+    models::vnn nn {con, "xor.nn", models::vnn::mode::INFERENCE};
 
     std::vector<clwrapper::memory<VNN_FLOAT_TYPE>> inputs = data_input(con);
     std::vector<clwrapper::memory<VNN_FLOAT_TYPE>> outputs = data_output(con);
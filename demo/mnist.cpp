@@ -5,6 +5,7 @@
 
 #include "clwrapper.hpp"
 #include "mnistdata.hpp"
+#include "model/qvnn.hpp"
 
 using namespace lazyml;
 
@@ -14,35 +15,50 @@ int main() {
     cl::Device default_device = utils::value_or_panic(clwrapper::getBestDevice(), "Could not any find device");
     clwrapper::clcontext con = {default_device};
 
-    auto inputs_outputs  = get_mnist_data(
+    auto data = get_mnist_data(
         con,
         "data/train-images-idx3-ubyte",
         "data/train-labels-idx1-ubyte"
     );
 
-    auto inputs = inputs_outputs.first;
-    auto outputs = inputs_outputs.second;
-
-    std::cout << "inputs len: " << inputs.size() << std::endl;
-    std::cout << "outputs len: " << outputs.size() << std::endl;
+    std::cout << "samples: " << data.size() << std::endl;
 
     // 784 input neurons(28*28) for the image
     // two hidden layers with 16 neurons each
     // 10 outputs neurons, one for each possible digit[0-9]
     std::vector<cl_uint> arch = {784, 16, 16, 10};
 
-    models::vnn nn {con, arch};
+    // ReLU hidden layers and a softmax output trained with cross entropy
+    using models::activation;
+    models::vnn nn {con, arch, {activation::RELU, activation::RELU, activation::SOFTMAX}};
 
-    float c0 = nn.cost(inputs, outputs);
+    float c0 = nn.cost(data);
     std::cout << "COST: " << c0 << std::endl;
 
-    nn.train(inputs, outputs, 100, 10.0);
+    // Mini-batches of 32 samples, the gradient is applied after each batch
+    nn.report_progress_to(&std::cout);
+    nn.train(data, 10, 0.1, 32);
 
-    float c1 = nn.cost(inputs, outputs);
+    auto result = nn.evaluate(data);
+    float c1 = result.cost;
     std::cout << "COST: " << c1 << std::endl;
+    std::cout << "ACCURACY: " << result.accuracy << std::endl;
 
     if(c1 < c0) nn.serialize("mnist2.nn");
 
+    // Int8 version of the trained network for inference, calibrated on the first 500 images
+    size_t calibration_samples = 500;
+    std::vector<VNN_FLOAT_TYPE> calibration(calibration_samples * data.input_size());
+    for(size_t i = 0; i < calibration_samples; i++) data.decode_input(i, calibration.data() + i*data.input_size());
+
+    models::cpu_vnn reference(nn.to_network());
+    models::qvnn quantized {con, nn, calibration};
+    auto report = quantized.compare(reference, data, 10000);
+
+    std::cout << "INT8 ACCURACY: " << report.quantized_accuracy << " (float " << report.reference_accuracy << ")" << std::endl;
+    std::cout << "INT8 AGREEMENT: " << report.agreement << ", largest output error " << report.max_error << std::endl;
+    std::cout << "PARAMETER BYTES: " << report.quantized_bytes << " (float " << report.reference_bytes << ")" << std::endl;
+
     return 0;
 }
 
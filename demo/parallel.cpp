@@ -0,0 +1,97 @@
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "lazyml.hpp"
+
+using namespace lazyml;
+using models::activation;
+
+// Data parallel training on the sub-devices of a single device, usually a CPU
+// OpenCL implementation such as pocl. Trains the same network on one
+// sub-device and then on all of them and prints the scaling efficiency.
+//
+// Usage: parallel [parts], parts = 0 splits by NUMA node
+
+static const size_t SAMPLES = 8192;
+static const size_t OUTPUTS = 10;
+
+// A CPU device if there is one, they can be split into sub-devices
+static std::optional<cl::Device> find_cpu() {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+
+    for(const cl::Platform &platform : platforms) {
+        std::vector<cl::Device> devices;
+        platform.getDevices(CL_DEVICE_TYPE_CPU, &devices);
+        if(!devices.empty()) return devices.front();
+    }
+
+    return clwrapper::getBestDevice();
+}
+
+int main(int argc, char** argv) {
+    srand(time(nullptr));
+
+    size_t parts = argc > 1 ? std::stoul(argv[1]) : 0;
+
+    cl::Device device = utils::value_or_panic(find_cpu(), "Could not any find device");
+    std::cout << "Device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+
+    // Machines with a single NUMA node are split in two instead
+    std::vector<cl::Device> devices = clwrapper::split_device(device, parts);
+    if(devices.empty() && parts == 0) devices = clwrapper::split_device(device, 2);
+    if(devices.size() < 2) {
+        std::cout << "Device can't be split into sub-devices\n";
+        return 1;
+    }
+
+    // One context for all sub-devices, so gradients are summed with copies between them
+    cl::Context shared(devices);
+    std::vector<std::unique_ptr<clwrapper::clcontext>> contexts;
+    for(const cl::Device &d : devices) contexts.push_back(std::make_unique<clwrapper::clcontext>(shared, d));
+
+    std::vector<std::reference_wrapper<clwrapper::clcontext>> all, single;
+    for(auto &con : contexts) all.push_back(*con);
+    single.push_back(*contexts.front());
+
+    // Uniform random inputs and one hot targets, the values don't matter for throughput
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<VNN_FLOAT_TYPE> value(0, 1);
+    std::uniform_int_distribution<size_t> label(0, OUTPUTS - 1);
+
+    std::vector<cl_uint> arch = {256, 512, 512, OUTPUTS};
+    std::vector<activation> activations = {activation::RELU, activation::RELU, activation::SOFTMAX};
+
+    std::vector<VNN_FLOAT_TYPE> inputs(SAMPLES * arch.front()), targets(SAMPLES * OUTPUTS, 0);
+    for(VNN_FLOAT_TYPE &x : inputs) x = value(rng);
+    for(size_t i = 0; i < SAMPLES; i++) targets[i * OUTPUTS + label(rng)] = 1;
+
+    const uint iterations = 3;
+    const uint batch_size = 512;
+    const VNN_FLOAT_TYPE learning_rate = 0.05;
+
+    auto run = [&](std::vector<std::reference_wrapper<clwrapper::clcontext>> &contexts) {
+        models::data_parallel trainer(contexts, arch, activations);
+        trainer.set_data(inputs, targets);
+        trainer.report_progress_to(&std::cout);
+
+        // Warm up, builds the kernels and records the launch plans
+        trainer.train(1, learning_rate, batch_size);
+        models::data_parallel::report r = trainer.train(iterations, learning_rate, batch_size);
+
+        std::cout << r.replicas << " replica(s): " << r.samples_per_second() << " samples/s, "
+            << r.reduce_seconds << "s of " << r.seconds << "s summing gradients"
+            << (trainer.peer_reduce() ? " on the devices" : " on the host") << "\n";
+        return r;
+    };
+
+    models::data_parallel::report one = run(single);
+    models::data_parallel::report many = run(all);
+
+    std::cout << "Scaling efficiency: " << models::data_parallel::scaling_efficiency(one, many) << std::endl;
+}
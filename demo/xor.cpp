@@ -41,7 +41,8 @@ int main() {
     std::cout << "1 0 = " << (nn.run(inputs[2]))[0] << "\n";
     std::cout << "1 1 = " << (nn.run(inputs[3]))[0] << "\n";
 
-    // Train the model for 750 iterations with learning rate = 15
+    // Train the model for 750 iterations with learning rate = 15, printing every finished epoch
+    nn.report_progress_to(&std::cout);
     nn.train(inputs, outputs, 750, 15.0);
 
     // Print out the new cost after training
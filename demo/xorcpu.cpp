@@ -0,0 +1,41 @@
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+
+#include "lazyml.hpp"
+
+using namespace lazyml;
+
+// Same as the xor demo, but trained on the host without touching OpenCL
+int main() {
+    srand(time(nullptr)); 
+
+    // {0,0} => {0}
+    // {0,1} => {1}
+    // {1,0} => {1}
+    // {1,1} => {0}
+    std::vector<VNN_FLOAT_TYPE> inputs = {0,0, 0,1, 1,0, 1,1};
+    std::vector<VNN_FLOAT_TYPE> outputs = {0, 1, 1, 0};
+
+    // 2 input neurons, a hidden layer with 2 neurons and a single output neuron
+    std::vector<uint> arch = {2, 2, 1};
+    models::cpu_vnn nn {arch};
+
+    std::cout << "COST: " << nn.evaluate(inputs, outputs).cost << "\n";
+
+    // Train the model for 750 iterations with learning rate = 15, one batch with all 4 samples
+    nn.report_progress_to(&std::cout);
+    nn.train(inputs, outputs, 750, 15.0, 4);
+
+    std::cout << "COST: " << nn.evaluate(inputs, outputs).cost << "\n";
+
+    std::vector<VNN_FLOAT_TYPE> out;
+    const char* names[] = {"0 0", "0 1", "1 0", "1 1"};
+    for(size_t i = 0; i < 4; i++) {
+        nn.run(std::span<const VNN_FLOAT_TYPE>(inputs.data() + 2*i, 2), out);
+        std::cout << names[i] << " = " << out[0] << "\n";
+    }
+
+    // The file can be loaded by the OpenCL model as well, see loadxor
+    nn.serialize("xor.nn");
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "clwrapper.hpp"
+#include "kernels.hpp"
+#include <CL/opencl.hpp>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Bump to throw away every tuning result
+#define TUNING_CACHE_VERSION "1"
+
+// Timed launches per candidate, after one warm up launch
+#ifndef AUTOTUNE_RUNS
+#define AUTOTUNE_RUNS 5
+#endif
+
+// Batch size and rough duration of the forward passes autotuner::throughput times
+#ifndef THROUGHPUT_BATCH
+#define THROUGHPUT_BATCH 64
+#endif
+#ifndef THROUGHPUT_SECONDS
+#define THROUGHPUT_SECONDS 0.05
+#endif
+
+namespace lazyml {
+
+namespace clwrapper {
+
+    /**
+    * Picks launch parameters by timing the candidates on the device. Results
+    * are kept in a file per device in utils::cache_directory("tuning"), keyed
+    * by device name, driver version and precision, so only the first run on a
+    * device pays for the benchmarks. LAZYML_AUTOTUNE=0 turns tuning off and
+    * every query returns the default.
+    */
+    class autotuner {
+        public:
+            autotuner(clcontext &context);
+
+            /**
+            * Fastest local size for a 1-D launch of kernel over n work items. Results
+            * are shared by all n rounding up to the same power of two. The candidates
+            * are multiples of the kernel's preferred work group size multiple up to
+            * CL_KERNEL_WORK_GROUP_SIZE, and 0, which leaves it to the driver.
+            *
+            * bind sets the arguments of the trial launches. They have to work on
+            * scratch buffers, every candidate is launched several times.
+            */
+            size_t local_size(const cl::Kernel &kernel, size_t n, const std::function<void(cl::Kernel&)> &bind);
+
+            // Fastest GEMM tile parameters that fit the device, timed on a forward pass of a mid sized layer
+            kernels::gemm_config gemm();
+
+            /**
+            * Samples per second of forward passes through a network with shape
+            * neurons per layer, each one uploading the inputs of its batch first,
+            * so both GEMM speed and host bandwidth count. Timed with the default
+            * GEMM tiles, the devices getBestDevice compares don't have to be tuned.
+            * Results are cached like the tuning results, with LAZYML_AUTOTUNE=0
+            * the benchmark still runs but nothing is kept.
+            */
+            double throughput(const std::vector<uint> &shape);
+
+            // Ranges of a 1-D launch over n items with a local size from local_size, the
+            // global range is padded to a multiple of it and the kernels check the bounds
+            static cl::NDRange global_range(size_t n, size_t local);
+            static cl::NDRange local_range(size_t local);
+
+        private:
+            clcontext& _context;
+            bool _enabled;
+
+            std::optional<std::string> _path;
+            std::map<std::string, std::string> _results;
+
+            void load();
+            void save();
+
+            // Seconds per launch
+            double time(const std::function<void()> &launch);
+            bool fits(const kernels::gemm_config &gemm);
+    };
+
+}
+
+}
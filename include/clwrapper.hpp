@@ -2,8 +2,18 @@
 
 #include "kernels.hpp"
 #include "math/math.hpp"
+#include "profiler.hpp"
 #include <CL/opencl.hpp>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
 #include<optional>
+#include <span>
+#include <utility>
+#include <vector>
 
 namespace lazyml {
 
@@ -11,7 +21,19 @@ namespace clwrapper {
 
     enum class SearchBy {
         VRAM,
-        FREQ
+        FREQ,
+        // Samples per second of a short forward pass benchmark on every candidate, see autotuner::throughput
+        THROUGHPUT
+    };
+
+    // Devices getBestDevice picks from
+    struct device_filter {
+        // Any combination of CL_DEVICE_TYPE_* flags
+        cl_device_type type = CL_DEVICE_TYPE_ALL;
+        // Bytes of global memory the device needs at least
+        cl_ulong min_memory = 0;
+        // Neurons per layer of the network THROUGHPUT benchmarks, a mid sized classifier if empty
+        std::vector<uint> shape;
     };
 
     #define FORWARD_METHOD(x) auto x() { return _kernels.x(_context, _device); }
@@ -21,89 +43,429 @@ namespace clwrapper {
     * Will by default return device with highest amount of VRAM.
     * Returns empty optional if no device could be found.
     *
+    * With SearchBy::THROUGHPUT every device passing the filter runs a forward
+    * pass of a network of the filter's shape, the scores are cached per device
+    * and driver. Setting LAZYML_DEVICE to an index into all_devices() or to
+    * part of a device name returns that device instead, whatever the arguments.
+    *
     * @param searchBy What devices should be compared for.
+    * @param filter Which devices are considered at all.
     * @return Device wrapped in optional or an empty optional if no device could be found.
     */
-    std::optional<cl::Device> getBestDevice(SearchBy searchBy = SearchBy::VRAM);
+    std::optional<cl::Device> getBestDevice(SearchBy searchBy = SearchBy::VRAM, const device_filter &filter = {});
+
+    // Devices of the given type on every platform, platform by platform
+    std::vector<cl::Device> all_devices(cl_device_type type = CL_DEVICE_TYPE_ALL);
+
+    /**
+    * Splits a device into sub-devices, such as a multi-socket CPU into one
+    * device per NUMA node. With parts = 0 the device is split by NUMA domain,
+    * otherwise into parts sub-devices with the same number of compute units.
+    * Returns an empty vector if the device can't be split that way.
+    */
+    std::vector<cl::Device> split_device(cl::Device device, size_t parts = 0);
 
     class clcontext {
         public:
         cl::Device _device;
         cl::Context _context;
         cl::CommandQueue _queue;
+        // Uploads that should overlap with the work on _queue, such as streamed training data
+        cl::CommandQueue _transfer_queue;
 
+        /**
+        * With profiling enabled every command enqueued through the enqueue_*
+        * helpers records an event, see profiler for what is collected.
+        *
+        * With out_of_order, _queue is created with CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
+        * if the device supports it. Commands enqueued through the helpers with a
+        * wait list then only wait for what is in it, see event_graph. Commands
+        * without one are fenced by barriers, so they behave like on an in-order queue.
+        */
+        clcontext(cl::Device device, bool profiling = false, bool out_of_order = false) :
+            clcontext(cl::Context({device}), device, profiling, out_of_order)
+        {}
 
-        clcontext(cl::Device device) : _device(device), _context({device}), _queue({_context, _device}) {}
+        // A device of an existing context. Buffers of contexts sharing a cl::Context
+        // can be copied between their queues, see models::data_parallel.
+        clcontext(cl::Context context, cl::Device device, bool profiling = false, bool out_of_order = false) :
+            _device(device),
+            _context(context),
+            _queue(_context, _device, queue_properties(device, profiling, out_of_order)),
+            _transfer_queue(_context, _device, profiling ? CL_QUEUE_PROFILING_ENABLE : 0)
+        {
+            if(profiling) _profiler.emplace();
+            _out_of_order = queue_properties(device, profiling, out_of_order) & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+        }
 
-        FORWARD_METHOD(get_vnn_kernels);
+        // Kernels of the program built with the given extra options, every set of options is built once.
+        // The GEMM kernels use gemm_config() unless told otherwise.
+        auto get_vnn_kernels(const std::string &options = "") { return _kernels.get_vnn_kernels(_context, _device, options, gemm_config()); }
+        auto get_vnn_kernels(const std::string &options, const kernels::gemm_config &gemm) {
+            return _kernels.get_vnn_kernels(_context, _device, options, gemm);
+        }
+        auto get_quantized_kernels(const std::string &options = "") { return _kernels.get_quantized_kernels(_context, _device, options); }
         FORWARD_METHOD(get_utils_kernels);
 
+        // GEMM tile parameters for this device, picked by the autotuner the first time
+        const kernels::gemm_config& gemm_config();
+
+        // True for CPUs and integrated GPUs, where a device buffer is host memory as well
+        bool shares_host_memory() const;
+        // Alignment in bytes of buffer addresses, and what the origin of a sub-buffer has to be a multiple of
+        size_t base_address_alignment() const;
+
+        bool profiling() const { return _profiler.has_value(); }
+        // True if _queue runs commands out of order
+        bool out_of_order() const { return _out_of_order; }
+        // Barriers enqueued so far to fence commands without a wait list. Every command
+        // enqueued before a barrier is done before any command enqueued after it starts.
+        uint64_t barrier_count() const { return _barriers; }
+        profiler& get_profiler() { return _profiler.value(); }
+
+        // Hands the profile collected so far to the profiler, see profiler::finish
+        void report() { if(_profiler) _profiler->finish(); }
+
+        // layer is only used to group the profile, -1 means the command doesn't belong to a layer.
+        // wait and done work like for enqueue_copy.
+        void enqueue_kernel(
+            const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+            const std::string &name, int layer = -1,
+            const std::vector<cl::Event>* wait = nullptr, cl::Event* done = nullptr
+        );
+        void enqueue_write(
+            const cl::Buffer &buffer, bool blocking, size_t offset, size_t bytes, const void* ptr,
+            const std::string &name = "write"
+        );
+        // done receives the event of the read, for non-blocking reads
+        void enqueue_read(
+            const cl::Buffer &buffer, bool blocking, size_t offset, size_t bytes, void* ptr,
+            const std::string &name = "read", cl::Event* done = nullptr
+        );
+        // Maps and unmaps buffers created with CL_MEM_ALLOC_HOST_PTR or CL_MEM_USE_HOST_PTR, see memory_mode
+        void* enqueue_map(
+            const cl::Buffer &buffer, bool blocking, cl_map_flags flags, size_t offset, size_t bytes,
+            const std::string &name = "map"
+        );
+        void enqueue_unmap(const cl::Buffer &buffer, void* ptr, const std::string &name = "unmap", cl::Event* done = nullptr);
+        // The copy starts once the commands behind wait are done, done receives the event of the copy
+        void enqueue_copy(
+            const cl::Buffer &src, const cl::Buffer &dst, size_t src_offset, size_t dst_offset, size_t bytes,
+            const std::string &name = "copy",
+            const std::vector<cl::Event>* wait = nullptr, cl::Event* done = nullptr
+        );
+        // Repeats pattern over bytes bytes from offset without touching the host, both have to be multiples of sizeof(P)
+        template<typename P>
+        void enqueue_fill(const cl::Buffer &buffer, const P &pattern, size_t offset, size_t bytes, const std::string &name = "fill") {
+            bool fenced = begin_command(nullptr);
+            cl::Event* event = _profiler ? _profiler->record(command_kind::FILL, name, -1, bytes) : nullptr;
+
+            auto start = std::chrono::steady_clock::now();
+            _queue.enqueueFillBuffer(buffer, pattern, offset, bytes, nullptr, event);
+            if(_profiler) _profiler->add_host_time(std::chrono::steady_clock::now() - start);
+
+            end_command(fenced);
+        }
+
         private:
             kernels::kernelloader _kernels;
+            std::optional<profiler> _profiler;
+            std::optional<kernels::gemm_config> _gemm;
+
+            bool _out_of_order = false;
+            // True while the last command on the out-of-order queue is a barrier
+            bool _fenced = true;
+            uint64_t _barriers = 0;
+
+            // CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE is only asked for where the device has it
+            static cl_command_queue_properties queue_properties(const cl::Device &device, bool profiling, bool out_of_order);
+
+            // Called around every command on _queue, returns whether it has to be fenced
+            bool begin_command(const std::vector<cl::Event>* wait);
+            void end_command(bool fenced);
+            void barrier();
     };
     
-    // TODO clean this up
+    /**
+    * Adds the host time of its scope to the dispatch time of the context's
+    * profiler, does nothing without profiling. Wraps the code that sets up and
+    * enqueues the launches of a pass, so the cost of issuing them can be told
+    * apart from the time the device takes.
+    */
+    class dispatch_timer {
+        public:
+            dispatch_timer(clcontext &context) :
+            _profiler(context.profiling() ? &context.get_profiler() : nullptr),
+            _start(std::chrono::steady_clock::now())
+            {}
+
+            ~dispatch_timer() {
+                if(_profiler) _profiler->add_dispatch_time(std::chrono::steady_clock::now() - _start);
+            }
+        private:
+            profiler* _profiler;
+            std::chrono::steady_clock::time_point _start;
+    };
+
+    /**
+    * Where the data of a memory lives and how it gets to the device.
+    *
+    * HOST_COPY  a std::vector on the host and a separate device buffer,
+    *            write_to_device and read_from_device copy between them through
+    *            the driver. The host copy can always be used.
+    * DEVICE     only the device buffer until the host asks for the data. The
+    *            first read_from_device, host_data() or operator[] creates the
+    *            host copy and reads the buffer into it, from then on it works
+    *            like HOST_COPY until release_host. Initial values are uploaded
+    *            once by the constructor, zeros are filled in on the device.
+    * PINNED     a CL_MEM_ALLOC_HOST_PTR buffer and the host copy is a mapping of it,
+    *            so the driver can DMA straight from and to it without staging.
+    * ZERO_COPY  a CL_MEM_USE_HOST_PTR buffer over host storage aligned for the
+    *            device. Devices sharing memory with the host, see
+    *            clcontext::shares_host_memory, use it in place.
+    *
+    * PINNED and ZERO_COPY turn write_to_device into an unmap and read_from_device
+    * into a map. The host copy can only be used while mapped, which it is after
+    * construction and read_from_device, and the device only after write_to_device.
+    */
+    enum class memory_mode {
+        HOST_COPY,
+        DEVICE,
+        PINNED,
+        ZERO_COPY
+    };
+
+    // ZERO_COPY where the device works on host memory anyway, HOST_COPY otherwise
+    inline memory_mode preferred_memory_mode(const clcontext &context) {
+        return context.shares_host_memory() ? memory_mode::ZERO_COPY : memory_mode::HOST_COPY;
+    }
+
+    struct aligned_deleter {
+        void operator()(void* p) const { std::free(p); }
+    };
+
+    /**
+    * Places tensors one after another in a single buffer, every one starting
+    * at an offset that can be the origin of a sub-buffer. Offsets and sizes
+    * are in elements of element_size bytes. Buffers of larger elements can
+    * share the layout, their offsets in bytes are aligned as well.
+    */
+    class arena_layout {
+        public:
+            arena_layout(const clcontext &context, size_t element_size) :
+            _alignment(std::max<size_t>(1, context.base_address_alignment() / element_size))
+            {}
+
+            // Reserves n elements and returns their offset
+            size_t add(size_t n) {
+                size_t offset = _size;
+                _size = (offset + n + _alignment - 1) / _alignment * _alignment;
+                return offset;
+            }
+
+            // Elements of the whole arena, including the padding between tensors
+            size_t size() const { return _size; }
+        private:
+            size_t _alignment;
+            size_t _size = 0;
+    };
+
     template<typename T>
     class memory {
         public:
-            memory(clcontext &context, std::initializer_list<T> initial_values) : 
-            _context(context),
-            _host(initial_values),
-            _device(cl::Buffer(_context._context, CL_MEM_READ_WRITE, sizeof(T)*initial_values.size()))
+            memory(clcontext &context, std::initializer_list<T> initial_values, memory_mode mode = memory_mode::HOST_COPY) :
+            memory(context, std::span<const T>(initial_values.begin(), initial_values.size()), mode)
             {}
 
-            memory(clcontext &context, std::span<T> initial_values) : 
-            _context(context),
-            _device(cl::Buffer(_context._context, CL_MEM_READ_WRITE, sizeof(T)*initial_values.size()))
+            memory(clcontext &context, std::span<const T> initial_values, memory_mode mode = memory_mode::HOST_COPY) :
+            memory(context, initial_values.size(), mode)
             {
-                size_t n = initial_values.size();
-                _host = std::vector<T>(n, 0);
-                for(size_t i = 0; i < n; i++) _host[i] = initial_values[i];
+                if(_mode == memory_mode::DEVICE) {
+                    _context.enqueue_write(_device, true, 0, bytes(), initial_values.data());
+                } else {
+                    std::copy(initial_values.begin(), initial_values.end(), host_data());
+                }
             }
 
-            memory(clcontext &context, bool random, size_t n) : 
-            _context(context)
+            // Zeroed memory is filled on the device, or in place while mapped. Host copies
+            // start out zeroed and are uploaded by write_to_device like any other values.
+            memory(clcontext &context, bool random, size_t n, memory_mode mode = memory_mode::HOST_COPY) :
+            memory(context, n, mode)
             {
-                _host = std::vector<T>(n, 0);
+                if(!random) {
+                    if(_mode != memory_mode::HOST_COPY) fill(T(0));
+                    return;
+                }
+
+                // Device only memory doesn't get a host copy for its initial values
+                if(_mode == memory_mode::DEVICE) {
+                    std::vector<T> values(n);
+                    for(size_t i = 0; i < n; i++) values[i] = math::rand_float();
+                    _context.enqueue_write(_device, true, 0, bytes(), values.data());
+                    return;
+                }
+
+                T* values = host_data();
+                for(size_t i = 0; i < n; i++) values[i] = math::rand_float();
+            }
+
+            memory(memory &&other) noexcept :
+            _context(other._context),
+            _mode(other._mode),
+            _size(other._size),
+            _host(std::move(other._host)),
+            _storage(std::move(other._storage)),
+            _device(std::move(other._device)),
+            _mapped(std::exchange(other._mapped, nullptr))
+            {}
 
-                if(random) for(size_t i = 0; i < n; i++) _host[i] = math::rand_float();
-                else for(size_t i = 0; i < n; i++) _host[i] = 0;
+            // Buffers and mappings have a single owner
+            memory(const memory&) = delete;
 
-                _device = cl::Buffer(_context._context, CL_MEM_READ_WRITE, sizeof(T)*_host.size());
+            ~memory() {
+                if(_mapped) unmap(false);
+
+                // The device may still be working on the host storage of a zero copy buffer
+                if(_storage) _context._queue.finish();
             }
 
-            void write_to_device(bool blocking) { 
-                size_t zero_offset = 0;
-                _context._queue.enqueueWriteBuffer(
-                    _device,
-                    (blocking ? CL_TRUE : CL_FALSE), // <-- Need to convert std bool to cl_bool
-                    zero_offset,
-                    sizeof(T)*_host.size(),
-                    _host.data()
-                ); 
+            void write_to_device(bool blocking) {
+                switch(_mode) {
+                    case memory_mode::HOST_COPY:
+                        _context.enqueue_write(_device, blocking, 0, bytes(), _host.data());
+                        break;
+                    case memory_mode::DEVICE:
+                        // Without a host copy the device has the only values
+                        if(has_host_copy()) _context.enqueue_write(_device, blocking, 0, bytes(), _host.data());
+                        break;
+                    case memory_mode::PINNED:
+                    case memory_mode::ZERO_COPY:
+                        if(_mapped) unmap(blocking);
+                        break;
+                }
             }
 
-            void read_from_device(bool blocking) { 
-                size_t zero_offset = 0;
-                _context._queue.enqueueReadBuffer(
-                    _device,
-                    (blocking ? CL_TRUE : CL_FALSE),
-                    zero_offset,
-                    sizeof(T)*_host.size(),
-                    _host.data()
-                ); 
+            void read_from_device(bool blocking) {
+                switch(_mode) {
+                    case memory_mode::HOST_COPY:
+                    case memory_mode::DEVICE:
+                        // Device only memory gets its host copy here
+                        _host.resize(_size);
+                        _context.enqueue_read(_device, blocking, 0, bytes(), _host.data());
+                        break;
+                    case memory_mode::PINNED:
+                    case memory_mode::ZERO_COPY:
+                        if(!_mapped) map(blocking);
+                        break;
+                }
             }
 
             cl::Buffer& get() { return _device; }
 
-            T& operator[](size_t index) { return _host[index]; }
-            T* host_data() { return _host.data(); }
+            // Buffer of the n elements starting at element offset, sharing the memory of this one.
+            // The offset in bytes has to be a multiple of clcontext::base_address_alignment.
+            cl::Buffer sub_buffer(size_t offset, size_t n) {
+                assert(offset + n <= _size);
+                cl_buffer_region region = {offset * sizeof(T), n * sizeof(T)};
+                assert(region.origin % _context.base_address_alignment() == 0 && "Misaligned sub-buffer");
+                return _device.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+            }
+
+            T& operator[](size_t index) { return host_data()[index]; }
+            T* host_data() {
+                bool mapped_mode = _mode == memory_mode::PINNED || _mode == memory_mode::ZERO_COPY;
+                assert((!mapped_mode || _mapped) && "Mapped memory has to be read_from_device before the host can use it");
+                if(mapped_mode) return _mapped;
+
+                if(!has_host_copy()) read_from_device(true);
+                return _host.data();
+            }
 
-            size_t size() { return _host.size(); }
+            // Sets every element on the device without a transfer, and in the host copy or mapping if there is one.
+            // A mapping is only written on the host, write_to_device hands it to the device as usual.
+            void fill(const T &value) {
+                if(_size == 0) return;
+                if(_mapped) {
+                    std::fill_n(_mapped, _size, value);
+                    return;
+                }
+
+                _context.enqueue_fill(_device, value, 0, bytes());
+                std::fill(_host.begin(), _host.end(), value);
+            }
+
+            // Frees the host copy of DEVICE memory once no transfer uses it, the next access reads the buffer again
+            void release_host() {
+                if(_mode == memory_mode::DEVICE) std::vector<T>().swap(_host);
+            }
+
+            // Always true for HOST_COPY, for DEVICE between the first host access and release_host
+            bool has_host_copy() const { return _mode == memory_mode::HOST_COPY || !_host.empty() || _size == 0; }
+
+            size_t size() const { return _size; }
+            memory_mode mode() const { return _mode; }
         private:
             clcontext& _context;
+            memory_mode _mode;
+            size_t _size;
+
+            // HOST_COPY, and DEVICE memory while it has a host copy
             std::vector<T> _host;
+            // ZERO_COPY only, the memory the buffer uses
+            std::unique_ptr<void, aligned_deleter> _storage;
+
             cl::Buffer _device;
+            // Host pointer of the current mapping of PINNED and ZERO_COPY memory, null while unmapped
+            T* _mapped = nullptr;
+
+            // Allocates without initializing, mapped memory starts out mapped
+            memory(clcontext &context, size_t n, memory_mode mode) :
+            _context(context),
+            _mode(mode),
+            _size(n)
+            {
+                cl_mem_flags flags = CL_MEM_READ_WRITE;
+                void* host_ptr = nullptr;
+
+                switch(_mode) {
+                    case memory_mode::HOST_COPY:
+                        _host = std::vector<T>(n, 0);
+                        break;
+                    case memory_mode::DEVICE:
+                        break;
+                    case memory_mode::PINNED:
+                        flags |= CL_MEM_ALLOC_HOST_PTR;
+                        break;
+                    case memory_mode::ZERO_COPY: {
+                        // Page aligned and a whole number of cache lines, what zero copy
+                        // implementations ask for, or more if the device says so
+                        size_t alignment = std::max<size_t>(4096, _context.base_address_alignment());
+                        _storage.reset(std::aligned_alloc(alignment, (bytes() + alignment - 1) / alignment * alignment));
+                        assert(_storage && "Could not allocate aligned host memory");
+
+                        flags |= CL_MEM_USE_HOST_PTR;
+                        host_ptr = _storage.get();
+                        break;
+                    }
+                }
+
+                _device = cl::Buffer(_context._context, flags, bytes(), host_ptr);
+
+                if(_mode == memory_mode::PINNED || _mode == memory_mode::ZERO_COPY) map(true);
+            }
+
+            size_t bytes() const { return sizeof(T) * _size; }
+
+            void map(bool blocking) {
+                _mapped = static_cast<T*>(_context.enqueue_map(_device, blocking, CL_MAP_READ | CL_MAP_WRITE, 0, bytes()));
+            }
+
+            void unmap(bool blocking) {
+                cl::Event done;
+                _context.enqueue_unmap(_device, _mapped, "unmap", &done);
+                _mapped = nullptr;
+                if(blocking) done.wait();
+            }
     };
 }
 
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "clwrapper.hpp"
+#include <CL/opencl.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace lazyml {
+
+namespace data {
+
+    // How the elements of a dataset buffer are stored on the device
+    enum class encoding {
+        NATIVE, // the element type of the model, copied as is
+        UINT8,  // one byte per element, multiplied by the scale while loading
+        LABEL   // one byte class index per sample, expanded to a one hot vector while loading
+    };
+
+    // A range of samples inside one of the dataset buffers.
+    // Offsets and strides are in elements, not bytes.
+    struct slice {
+        cl::Buffer& buffer;
+        size_t offset;
+        size_t count;
+        size_t stride;
+        encoding format = encoding::NATIVE;
+        float scale = 1;
+
+        // native_size is only used for NATIVE slices, the compact encodings are a byte per element
+        size_t element_size(size_t native_size) const { return format == encoding::NATIVE ? native_size : 1; }
+        size_t offset_bytes(size_t native_size) const { return offset * element_size(native_size); }
+        size_t size_bytes(size_t native_size) const { return count * stride * element_size(native_size); }
+    };
+
+    /**
+    * Inputs and expected outputs of a data set, each stored in a single
+    * contiguous buffer. Sample i occupies elements [i*input_size, (i+1)*input_size)
+    * of the input buffer and [i*output_size, (i+1)*output_size) of the target buffer.
+    *
+    * Compact data sets keep raw bytes on the device instead, see encoding.
+    * They have no host side copy of their own, input(i)/target(i) are only
+    * available for NATIVE data sets while decode_input/decode_target work for both.
+    */
+    template<typename T>
+    class dataset {
+        public:
+            // Zero initialized data set, fill it through input(i)/target(i) and call write_to_device
+            dataset(clwrapper::clcontext &context, size_t samples, size_t input_size, size_t output_size) :
+            _samples(samples),
+            _input_size(input_size),
+            _output_size(output_size),
+            _inputs(std::in_place, context, false, samples * input_size),
+            _targets(std::in_place, context, false, samples * output_size)
+            {
+                assert(samples > 0 && input_size > 0 && output_size > 0);
+            }
+
+            // Inputs and targets laid out sample after sample, copied in and uploaded to the device
+            dataset(clwrapper::clcontext &context, std::span<const T> inputs, std::span<const T> targets, size_t input_size, size_t output_size) :
+            _samples(inputs.size() / input_size),
+            _input_size(input_size),
+            _output_size(output_size),
+            _inputs(std::in_place, context, inputs),
+            _targets(std::in_place, context, targets)
+            {
+                assert(inputs.size() % input_size == 0 && "Input data is not a whole number of samples");
+                assert(targets.size() == _samples * output_size && "Number of targets doesn't match number of inputs");
+
+                write_to_device(false);
+            }
+
+            /**
+            * Compact data set of bytes, inputs are multiplied by input_scale and
+            * labels are expanded to one hot vectors of classes elements on the
+            * device while loading. The bytes are uploaded right away, owner keeps
+            * the memory behind the spans alive for decode_input/decode_target.
+            */
+            dataset(
+                clwrapper::clcontext &context,
+                std::span<const uint8_t> inputs, std::span<const uint8_t> labels,
+                size_t input_size, size_t classes, T input_scale,
+                std::shared_ptr<const void> owner = nullptr
+            ) :
+            _samples(labels.size()),
+            _input_size(input_size),
+            _output_size(classes),
+            _input_encoding(encoding::UINT8),
+            _target_encoding(encoding::LABEL),
+            _input_scale(input_scale),
+            _raw_host_inputs(inputs),
+            _raw_host_labels(labels),
+            _owner(std::move(owner))
+            {
+                assert(_samples > 0 && input_size > 0 && classes > 0);
+                assert(inputs.size() == _samples * input_size && "Number of labels doesn't match number of inputs");
+
+                // Straight from the caller's memory to the device, no intermediate host copy
+                _raw_inputs = cl::Buffer(
+                    context._context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, inputs.size(), const_cast<uint8_t*>(inputs.data())
+                );
+                _raw_labels = cl::Buffer(
+                    context._context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, labels.size(), const_cast<uint8_t*>(labels.data())
+                );
+            }
+
+            size_t size() const { return _samples; }
+            size_t input_size() const { return _input_size; }
+            size_t output_size() const { return _output_size; }
+            bool compact() const { return _input_encoding != encoding::NATIVE; }
+
+            // Host side view of a single sample
+            std::span<T> input(size_t i) {
+                assert(i < _samples && !compact());
+                return {_inputs->host_data() + i*_input_size, _input_size};
+            }
+            std::span<T> target(size_t i) {
+                assert(i < _samples && !compact());
+                return {_targets->host_data() + i*_output_size, _output_size};
+            }
+
+            // Writes sample i as the model sees it to out, input_size/output_size elements
+            void decode_input(size_t i, T* out) {
+                assert(i < _samples);
+                if(!compact()) {
+                    std::span<T> x = input(i);
+                    std::copy(x.begin(), x.end(), out);
+                    return;
+                }
+
+                const uint8_t* x = _raw_host_inputs.data() + i*_input_size;
+                for(size_t j = 0; j < _input_size; j++) out[j] = static_cast<T>(x[j]) * _input_scale;
+            }
+            void decode_target(size_t i, T* out) {
+                assert(i < _samples);
+                if(!compact()) {
+                    std::span<T> y = target(i);
+                    std::copy(y.begin(), y.end(), out);
+                    return;
+                }
+
+                for(size_t j = 0; j < _output_size; j++) out[j] = _raw_host_labels[i] == j ? 1 : 0;
+            }
+
+            // Device side view of samples [first, first + count)
+            slice input_slice(size_t first, size_t count) {
+                assert(first + count <= _samples);
+                if(compact()) {
+                    return {_raw_inputs, first*_input_size, count, _input_size, encoding::UINT8, static_cast<float>(_input_scale)};
+                }
+                return {_inputs->get(), first*_input_size, count, _input_size};
+            }
+            slice target_slice(size_t first, size_t count) {
+                assert(first + count <= _samples);
+                if(_target_encoding == encoding::LABEL) return {_raw_labels, first, count, 1, encoding::LABEL};
+                return {_targets->get(), first*_output_size, count, _output_size};
+            }
+
+            clwrapper::memory<T>& inputs() { return _inputs.value(); }
+            clwrapper::memory<T>& targets() { return _targets.value(); }
+
+            // One transfer per buffer, regardless of the number of samples.
+            // Compact data sets are uploaded when they are created.
+            void write_to_device(bool blocking) {
+                if(compact()) return;
+                _inputs->write_to_device(blocking);
+                _targets->write_to_device(blocking);
+            }
+
+        private:
+            size_t _samples, _input_size, _output_size;
+            encoding _input_encoding = encoding::NATIVE, _target_encoding = encoding::NATIVE;
+            T _input_scale = 1;
+
+            // NATIVE storage
+            std::optional<clwrapper::memory<T>> _inputs, _targets;
+
+            // Compact storage
+            cl::Buffer _raw_inputs, _raw_labels;
+            std::span<const uint8_t> _raw_host_inputs, _raw_host_labels;
+            std::shared_ptr<const void> _owner;
+    };
+
+}
+
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "data/dataset.hpp"
+#include "data/source.hpp"
+#include "utils.hpp"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// Data type byte of IDX files made up of unsigned bytes, the only type read by load_idx
+#define IDX_UNSIGNED_BYTE 0x08
+
+namespace lazyml {
+
+namespace data {
+
+    /**
+    * Memory mapped IDX file, the format of the MNIST data set.
+    * Header: two zero bytes, data type, number of dimensions, followed by one
+    * big endian uint32 per dimension. The first dimension is the number of samples.
+    */
+    class idx_file {
+        public:
+            // Empty optional if the file can't be mapped or the header doesn't match the file size
+            static std::optional<idx_file> open(const std::string &filepath);
+
+            uint8_t type() const { return _type; }
+            const std::vector<uint32_t>& dimensions() const { return _dimensions; }
+
+            size_t samples() const { return _dimensions[0]; }
+            // Number of elements per sample, product of all dimensions but the first
+            size_t sample_size() const { return _sample_size; }
+
+            // Payload of the file, directly from the mapping
+            std::span<const uint8_t> bytes() const { return _bytes; }
+            const std::shared_ptr<const utils::mapped_file>& mapping() const { return _file; }
+
+        private:
+            std::shared_ptr<const utils::mapped_file> _file;
+            uint8_t _type;
+            std::vector<uint32_t> _dimensions;
+            size_t _sample_size;
+            std::span<const uint8_t> _bytes;
+    };
+
+    /**
+    * Streams an IDX image file and an IDX label file of unsigned bytes from their
+    * mappings. Inputs are multiplied by scale and labels turned into one hot
+    * vectors on the host, only the samples being trained on reach the device.
+    */
+    template<typename T>
+    class idx_source : public source<T> {
+        public:
+            idx_source(idx_file inputs, idx_file labels, size_t classes, T scale = T(1) / T(255)) :
+            _inputs(std::move(inputs)),
+            _labels(std::move(labels)),
+            _classes(classes),
+            _scale(scale)
+            {
+                assert(_inputs.type() == IDX_UNSIGNED_BYTE && _labels.type() == IDX_UNSIGNED_BYTE);
+                assert(_inputs.samples() == _labels.samples() && _labels.sample_size() == 1);
+            }
+
+            size_t size() const { return _inputs.samples(); }
+            size_t input_size() const { return _inputs.sample_size(); }
+            size_t output_size() const { return _classes; }
+
+            void read(size_t first, size_t count, T* inputs, T* targets) {
+                assert(first + count <= size());
+
+                const uint8_t* x = _inputs.bytes().data() + first*input_size();
+                for(size_t i = 0; i < count*input_size(); i++) inputs[i] = static_cast<T>(x[i]) * _scale;
+
+                const uint8_t* y = _labels.bytes().data() + first;
+                for(size_t i = 0; i < count; i++) {
+                    for(size_t j = 0; j < _classes; j++) targets[i*_classes + j] = y[i] == j ? 1 : 0;
+                }
+            }
+
+        private:
+            idx_file _inputs, _labels;
+            size_t _classes;
+            T _scale;
+    };
+
+    /**
+    * Loads an IDX image file and an IDX label file of unsigned bytes as a compact
+    * data set. The raw bytes are uploaded to the device, inputs are multiplied by
+    * scale and labels turned into one hot vectors of classes elements while loading.
+    */
+    template<typename T>
+    std::optional<dataset<T>> load_idx(
+        clwrapper::clcontext &context,
+        const std::string &inputs_path, const std::string &labels_path,
+        size_t classes, T scale = T(1) / T(255)
+    ) {
+        std::optional<idx_file> inputs = idx_file::open(inputs_path);
+        std::optional<idx_file> labels = idx_file::open(labels_path);
+        if(!inputs || !labels) return std::nullopt;
+
+        if(inputs->type() != IDX_UNSIGNED_BYTE || labels->type() != IDX_UNSIGNED_BYTE) {
+            std::cout << "IDX files have to contain unsigned bytes" << std::endl;
+            return std::nullopt;
+        }
+
+        if(inputs->samples() != labels->samples() || labels->sample_size() != 1) {
+            std::cout << inputs->samples() << " samples and " << labels->samples() << " labels don't match" << std::endl;
+            return std::nullopt;
+        }
+
+        // Both mappings stay alive for as long as the data set, for decode_input/decode_target
+        auto owner = std::make_shared<std::pair<idx_file, idx_file>>(inputs.value(), labels.value());
+
+        return std::optional<dataset<T>>(
+            std::in_place, context, inputs->bytes(), labels->bytes(), inputs->sample_size(), classes, scale, owner
+        );
+    }
+
+}
+
+}
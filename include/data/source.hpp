@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <span>
+
+namespace lazyml {
+
+namespace data {
+
+    /**
+    * Samples that stay on the host until they are needed, unlike dataset
+    * which uploads everything to the device up front. Used for streamed
+    * training of data sets that don't fit in device memory.
+    */
+    template<typename T>
+    class source {
+        public:
+            virtual ~source() = default;
+
+            virtual size_t size() const = 0;
+            virtual size_t input_size() const = 0;
+            virtual size_t output_size() const = 0;
+
+            // Writes samples [first, first + count) sample after sample to inputs and targets.
+            // Called from a producer thread while the caller keeps training.
+            virtual void read(size_t first, size_t count, T* inputs, T* targets) = 0;
+    };
+
+    // Source over host memory laid out sample after sample, the memory has to outlive the source
+    template<typename T>
+    class span_source : public source<T> {
+        public:
+            span_source(std::span<const T> inputs, std::span<const T> targets, size_t input_size, size_t output_size) :
+            _inputs(inputs),
+            _targets(targets),
+            _input_size(input_size),
+            _output_size(output_size)
+            {
+                assert(inputs.size() % input_size == 0 && "Input data is not a whole number of samples");
+                assert(targets.size() == inputs.size() / input_size * output_size && "Number of targets doesn't match number of inputs");
+            }
+
+            size_t size() const { return _inputs.size() / _input_size; }
+            size_t input_size() const { return _input_size; }
+            size_t output_size() const { return _output_size; }
+
+            void read(size_t first, size_t count, T* inputs, T* targets) {
+                assert(first + count <= size());
+                std::copy_n(_inputs.begin() + first*_input_size, count*_input_size, inputs);
+                std::copy_n(_targets.begin() + first*_output_size, count*_output_size, targets);
+            }
+
+        private:
+            std::span<const T> _inputs, _targets;
+            size_t _input_size, _output_size;
+    };
+
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "clwrapper.hpp"
+#include <CL/opencl.hpp>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace lazyml {
+
+namespace clwrapper {
+
+    // Buffers a command reads and writes. A buffer that is read and written only has to be in writes.
+    struct buffer_access {
+        std::vector<cl_mem> reads, writes;
+    };
+
+    /**
+    * Dependencies between the commands on an out-of-order queue, derived from
+    * the buffers they use. A command waits for the last writer of everything it
+    * reads, and for the last writer and every reader since of everything it
+    * writes, so commands using different buffers can run at the same time.
+    *
+    * Buffers are told apart by their cl_mem handle, sub-buffers count as
+    * buffers of their own. Whole arena commands list the sub-buffers they touch.
+    * Commands enqueued without a wait list are fenced by barriers in clcontext,
+    * every barrier makes the graph forget the commands before it.
+    */
+    class event_graph {
+        public:
+            event_graph(clcontext &context) : _context(context) {}
+
+            // clcontext::enqueue_kernel once everything behind access and wait is done
+            void enqueue_kernel(
+                const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+                const std::string &name, int layer, const buffer_access &access,
+                const std::vector<cl::Event>* wait = nullptr
+            );
+
+            // Wait list of a command using access, followed by the events in wait
+            std::vector<cl::Event> dependencies(const buffer_access &access, const std::vector<cl::Event>* wait = nullptr);
+            // Makes the command behind done the last one to use access. done can be a command of
+            // another queue, such as an upload on the transfer queue. Barriers on this queue don't
+            // cover those, so they have to be recorded right before the commands depending on them.
+            void record(const buffer_access &access, const cl::Event &done);
+
+        private:
+            struct buffer_state {
+                cl::Event writer;
+                std::vector<cl::Event> readers;
+            };
+
+            clcontext& _context;
+            std::map<cl_mem, buffer_state> _buffers;
+            // clcontext::barrier_count when _buffers was last cleared
+            uint64_t _barriers = 0;
+
+            // Drops everything enqueued before the last barrier
+            void prune();
+    };
+
+}
+
+}
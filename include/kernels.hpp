@@ -1,41 +1,112 @@
 #pragma once
 
 #include <CL/opencl.hpp>
+#include <map>
 #include <optional>
+#include <string>
 
 
+// Only used when the library is built without embedded kernel sources
 #define KERNEL_VNN_SOURCE_PATH "cl/vanilla_nn_kernel.cl"
 #define KERNEL_UTILS_SOURCE_PATH "cl/utils.cl"
+#define KERNEL_PRECISION_SOURCE_PATH "cl/precision.cl"
+#define KERNEL_QUANTIZED_SOURCE_PATH "cl/quantized_kernel.cl"
+
+// Bump to invalidate every cached program binary
+#define PROGRAM_CACHE_VERSION "1"
+
+// Default tile parameters the GEMM kernels are built with, clwrapper::autotuner may pick others.
+// A work group computes a GEMM_TILE_SIZE x GEMM_TILE_SIZE block of the output
+// and every work item computes GEMM_WORK_PER_THREAD^2 entries of it.
+#define GEMM_TILE_SIZE 32
+#define GEMM_WORK_PER_THREAD 4
+#define GEMM_GROUP_SIZE (GEMM_TILE_SIZE / GEMM_WORK_PER_THREAD)
+
+// Work group sizes of the reduction kernels, both have to be powers of two
+#define COST_GROUP_SIZE 64
+#define REDUCE_GROUP_SIZE 256
+
+// Tile size of the integer GEMM kernels, a work group computes QGEMM_TILE_SIZE^2
+// outputs and reads QGEMM_TILE_SIZE * 4 bytes of k per step
+#define QGEMM_TILE_SIZE 16
 
 namespace lazyml {
 
     namespace kernels {
 
+        // Tile parameters of the GEMM kernels of a vnn program, see cl/vanilla_nn_kernel.cl.
+        // The tile size has to be a multiple of 4 and of the work per thread.
+        struct gemm_config {
+            uint tile = GEMM_TILE_SIZE;
+            uint work_per_thread = GEMM_WORK_PER_THREAD;
+
+            // Work items along each side of a work group
+            uint group_size() const { return tile / work_per_thread; }
+            std::string options() const;
+        };
+
         struct vnn_kernels {
             cl::Program program;
 
             cl::Kernel cost_kernel,
                        forward_kernel,
+                       softmax_kernel,
                        backprop_init_kernel,
                        backprop_step_kernel,
-                       apply_gradient_kernel;
+                       backprop_gradient_kernel,
+                       bias_gradient_kernel,
+                       apply_gradient_kernel,
+                       apply_momentum_kernel,
+                       apply_adam_kernel;
+        };
+
+        // Integer inference kernels of models::qvnn
+        struct quantized_kernels {
+            cl::Program program;
+
+            cl::Kernel quantize_kernel,
+                       forward_kernel,
+                       output_kernel,
+                       softmax_kernel;
         };
 
         struct utils_kernels {
             cl::Program program;
-            cl::Kernel rand, zero, copy;
+            cl::Kernel rand, zero, copy, add, to_real, copy_u8, one_hot, reduce_sum;
         };
 
         class kernelloader {
             private:
-                std::optional<vnn_kernels> _vnn;
+                // One program per set of build options, such as the activation of a layer
+                std::map<std::string, vnn_kernels> _vnn;
+                std::map<std::string, quantized_kernels> _quantized;
                 std::optional<utils_kernels> _utils;
-                static void compile(cl::Program program, cl::Device device);
+                static void compile(cl::Program program, cl::Device device, const std::string &options = "");
+
+                /**
+                * Creates and builds a program for a single device. Every source is
+                * prepended with cl/precision.cl and built with precision_options().
+                * Program binaries are cached on disk, keyed by device name, driver
+                * version, source and build options. A cache hit skips compilation,
+                * a missing or rejected binary falls back to building from source.
+                */
+                static cl::Program build(
+                    cl::Context context, cl::Device device,
+                    const std::string &source, const std::string &options
+                );
 
             public:
                 kernelloader();
 
-                 std::reference_wrapper<vnn_kernels> get_vnn_kernels(cl::Context context, cl::Device device);
+                // options are added to the build options of the program, see model/activation.hpp
+                std::reference_wrapper<vnn_kernels> get_vnn_kernels(
+                    cl::Context context, cl::Device device, const std::string &options = "",
+                    const gemm_config &gemm = {}
+                );
+                // Built from the vnn source followed by the quantized kernels, options work the same
+                std::reference_wrapper<quantized_kernels> get_quantized_kernels(
+                    cl::Context context, cl::Device device, const std::string &options = ""
+                );
                 std::reference_wrapper<utils_kernels> get_utils_kernels(cl::Context context, cl::Device device);
 
         };
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "clwrapper.hpp"
+#include <CL/opencl.hpp>
+#include <string>
+#include <vector>
+
+namespace lazyml {
+
+namespace clwrapper {
+
+    /**
+    * A fixed sequence of kernel launches, recorded once and replayed as often
+    * as needed. Every launch gets its own instance of the kernel with its
+    * arguments bound when it is added, so a replay doesn't set a single
+    * argument. On devices with cl_khr_command_buffer the finalized sequence
+    * becomes a command buffer and a replay is a single enqueue, everywhere
+    * else the launches are enqueued one after another.
+    *
+    * The buffers bound to the kernels have to outlive the plan. With profiling
+    * enabled a command buffer shows up as a single command named after the
+    * plan, launches replayed one by one keep their own names and layers.
+    */
+    class launch_plan {
+        public:
+            launch_plan(clcontext &context, const std::string &name);
+            ~launch_plan();
+
+            launch_plan(launch_plan &&other) noexcept;
+            launch_plan(const launch_plan&) = delete;
+
+            // Adds a launch of a new instance of kernel and returns that instance for
+            // binding its arguments. The reference is valid until the next add.
+            cl::Kernel& add(
+                const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+                const std::string &name, int layer = -1
+            );
+
+            // Done adding launches, records the command buffer where the device has them
+            void finalize();
+
+            // Enqueues all launches in the order they were added
+            void replay();
+
+            size_t size() const { return _launches.size(); }
+            // True if replay is a single command buffer enqueue
+            bool command_buffer() const { return _command_buffer != nullptr; }
+
+        private:
+            struct launch {
+                cl::Kernel kernel;
+                cl::NDRange global, local;
+                std::string name;
+                int layer;
+            };
+
+            clcontext& _context;
+            std::string _name;
+            std::vector<launch> _launches;
+            bool _finalized = false;
+
+            // cl_command_buffer_khr, kept opaque so the header doesn't need cl_ext.h
+            void* _command_buffer = nullptr;
+
+            void record_command_buffer();
+            bool replay_command_buffer();
+    };
+
+}
+
+}
@@ -1,7 +1,13 @@
 #pragma once
 
 #include "clwrapper.hpp"
+#include "profiler.hpp"
+#include "data/dataset.hpp"
+#include "data/idx.hpp"
 #include "model/vnn.hpp"
+#include "model/cpu_vnn.hpp"
+#include "model/qvnn.hpp"
+#include "model/data_parallel.hpp"
 #include "utils.hpp"
 #include "math/math.hpp"
 
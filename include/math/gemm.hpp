@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+// Cache blocking of the host GEMM routines, a block of B/C rows of this many
+// columns and a panel of this many k values stay in L1/L2 while they are reused
+#ifndef HOST_GEMM_BLOCK_N
+#define HOST_GEMM_BLOCK_N 256
+#endif
+
+#ifndef HOST_GEMM_BLOCK_K
+#define HOST_GEMM_BLOCK_K 128
+#endif
+
+namespace lazyml {
+
+namespace math {
+
+    // Row major host matrix routines for the CPU backend.
+    // All work on row ranges [m_begin, m_end) of the output so they can be split across threads.
+    // The innermost loops walk contiguous memory without dependencies between
+    // iterations so the compiler can turn them into SIMD code.
+
+    // C[m x n] (+)= A[m x k] * B[k x n]
+    template<typename T>
+    void gemm_nn(
+        size_t m_begin, size_t m_end, size_t n, size_t k,
+        const T* __restrict A, const T* __restrict B, T* __restrict C,
+        bool accumulate
+    ) {
+        if(!accumulate) std::fill(C + m_begin*n, C + m_end*n, T(0));
+
+        for(size_t n0 = 0; n0 < n; n0 += HOST_GEMM_BLOCK_N) {
+            size_t n1 = std::min(n, n0 + HOST_GEMM_BLOCK_N);
+
+            for(size_t k0 = 0; k0 < k; k0 += HOST_GEMM_BLOCK_K) {
+                size_t k1 = std::min(k, k0 + HOST_GEMM_BLOCK_K);
+
+                for(size_t i = m_begin; i < m_end; i++) {
+                    T* __restrict c = C + i*n;
+                    const T* a = A + i*k;
+
+                    for(size_t p = k0; p < k1; p++) {
+                        const T a_ip = a[p];
+                        const T* __restrict b = B + p*n;
+                        for(size_t j = n0; j < n1; j++) c[j] += a_ip * b[j];
+                    }
+                }
+            }
+        }
+    }
+
+    // C[m x n] (+)= A[k x m]^T * B[k x n]
+    template<typename T>
+    void gemm_tn(
+        size_t m_begin, size_t m_end, size_t n, size_t k, size_t m,
+        const T* __restrict A, const T* __restrict B, T* __restrict C,
+        bool accumulate
+    ) {
+        if(!accumulate) std::fill(C + m_begin*n, C + m_end*n, T(0));
+
+        for(size_t n0 = 0; n0 < n; n0 += HOST_GEMM_BLOCK_N) {
+            size_t n1 = std::min(n, n0 + HOST_GEMM_BLOCK_N);
+
+            for(size_t p = 0; p < k; p++) {
+                const T* a = A + p*m;
+                const T* __restrict b = B + p*n;
+
+                for(size_t i = m_begin; i < m_end; i++) {
+                    const T a_pi = a[i];
+                    T* __restrict c = C + i*n;
+                    for(size_t j = n0; j < n1; j++) c[j] += a_pi * b[j];
+                }
+            }
+        }
+    }
+
+    // C[m x n] (+)= A[m x k] * B[n x k]^T
+    template<typename T>
+    void gemm_nt(
+        size_t m_begin, size_t m_end, size_t n, size_t k,
+        const T* __restrict A, const T* __restrict B, T* __restrict C,
+        bool accumulate
+    ) {
+        // Independent partial sums, a single accumulator would serialize the dot product
+        constexpr size_t LANES = 8;
+
+        for(size_t i = m_begin; i < m_end; i++) {
+            const T* __restrict a = A + i*k;
+
+            for(size_t j = 0; j < n; j++) {
+                const T* __restrict b = B + j*k;
+
+                T partial[LANES] = {};
+                size_t p = 0;
+                for(; p + LANES <= k; p += LANES) {
+                    for(size_t l = 0; l < LANES; l++) partial[l] += a[p + l] * b[p + l];
+                }
+
+                T value = 0;
+                for(; p < k; p++) value += a[p] * b[p];
+                for(size_t l = 0; l < LANES; l++) value += partial[l];
+
+                C[i*n + j] = accumulate ? C[i*n + j] + value : value;
+            }
+        }
+    }
+
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace lazyml {
+
+namespace math {
+
+    // IEEE 754 binary16 <-> binary32, the host side of vload_half/vstore_half.
+    // Rounds to nearest even, values too large for a half become infinity.
+    inline uint16_t float_to_half(float value) {
+        uint32_t x;
+        std::memcpy(&x, &value, sizeof(float));
+
+        uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000);
+        uint32_t exponent = (x >> 23) & 0xff;
+        uint32_t mantissa = x & 0x7fffff;
+
+        // Infinity and NaN, NaNs keep a mantissa bit so they stay NaN
+        if(exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+        int e = static_cast<int>(exponent) - 127 + 15;
+        if(e >= 0x1f) return sign | 0x7c00;
+
+        // Subnormal halves, the implicit bit becomes explicit and is shifted into place
+        if(e <= 0) {
+            if(e < -10) return sign;
+            mantissa |= 0x800000;
+            uint32_t shift = static_cast<uint32_t>(14 - e);
+            uint32_t half = mantissa >> shift;
+            uint32_t rest = mantissa & ((1u << shift) - 1);
+            uint32_t halfway = 1u << (shift - 1);
+            if(rest > halfway || (rest == halfway && (half & 1))) half++;
+            return sign | static_cast<uint16_t>(half);
+        }
+
+        uint32_t half = (static_cast<uint32_t>(e) << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1fff;
+        // A carry out of the mantissa correctly bumps the exponent, up to infinity
+        if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+        return sign | static_cast<uint16_t>(half);
+    }
+
+    inline float half_to_float(uint16_t h) {
+        uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+        uint32_t exponent = (h >> 10) & 0x1f;
+        uint32_t mantissa = h & 0x3ff;
+
+        uint32_t x;
+        if(exponent == 0x1f) {
+            x = sign | 0x7f800000 | (mantissa << 13);
+        } else if(exponent != 0) {
+            x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+        } else if(mantissa == 0) {
+            x = sign;
+        } else {
+            // Subnormal half, normalize it for the float
+            int e = -1;
+            do { mantissa <<= 1; e++; } while((mantissa & 0x400) == 0);
+            x = sign | (static_cast<uint32_t>(127 - 15 - e) << 23) | ((mantissa & 0x3ff) << 13);
+        }
+
+        float value;
+        std::memcpy(&value, &x, sizeof(float));
+        return value;
+    }
+
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "math/math.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Slope of leaky ReLU for negative inputs, passed to the kernels as -DLEAKY_RELU_SLOPE
+#define LEAKY_RELU_SLOPE 0.01f
+
+namespace lazyml {
+
+namespace models {
+
+    /**
+    * Activation function of a layer. The vnn kernels are built once per
+    * activation with -DACTIVATION=<value>, so there are no branches on it in
+    * the forward and backward passes. Values are stored in model files and
+    * have to match the ACTIVATION_* defines of cl/vanilla_nn_kernel.cl.
+    *
+    * SOFTMAX is only allowed on the output layer. It is fused with a cross
+    * entropy cost, which makes the deltas of the output layer simply a - y.
+    */
+    enum class activation : uint32_t {
+        SIGMOID = 0,
+        RELU = 1,
+        LEAKY_RELU = 2,
+        TANH = 3,
+        LINEAR = 4,
+        SOFTMAX = 5
+    };
+
+    inline bool valid_activation(uint32_t a) {
+        return a <= static_cast<uint32_t>(activation::SOFTMAX);
+    }
+
+    /**
+    * Activations of a network with the given number of layers, counting the
+    * input. An empty list means all sigmoid, the only option before
+    * activations could be chosen.
+    */
+    inline std::vector<activation> resolve_activations(const std::vector<activation> &activations, size_t layers) {
+        if(activations.empty()) return std::vector<activation>(layers - 1, activation::SIGMOID);
+
+        assert(activations.size() + 1 == layers && "Every layer after the input needs an activation");
+        for(size_t l = 0; l + 1 < activations.size(); l++) {
+            assert(activations[l] != activation::SOFTMAX && "Only the output layer can use softmax");
+        }
+
+        return activations;
+    }
+
+    // Same for activations as they are stored in model files
+    inline std::vector<activation> resolve_activations(const std::vector<uint32_t> &stored, size_t layers) {
+        std::vector<activation> activations;
+        for(uint32_t a : stored) {
+            assert(valid_activation(a) && "Unknown activation");
+            activations.push_back(static_cast<activation>(a));
+        }
+
+        return resolve_activations(activations, layers);
+    }
+
+    // Build options of the vnn kernels for a layer with this activation.
+    // Sigmoid is what the kernels default to, its layers share the default program.
+    inline std::string activation_options(activation a) {
+        if(a == activation::SIGMOID) return "";
+        return "-DACTIVATION=" + std::to_string(static_cast<uint32_t>(a)) +
+            " -DLEAKY_RELU_SLOPE=" + std::to_string(LEAKY_RELU_SLOPE) + "f";
+    }
+
+    /**
+    * Sigmoid layers keep the original initialization where every weight and
+    * bias is drawn from [0, 1], so existing setups train exactly as before.
+    * Every other activation would saturate or blow up with only positive
+    * weights, their weights are redrawn from [-limit, limit] with He
+    * initialization for the ReLU family and Xavier initialization otherwise,
+    * and their biases start at 0.
+    */
+    template<typename T>
+    void initialize_layer(activation a, size_t rows, size_t cols, T* weights, T* biases) {
+        if(a == activation::SIGMOID) return;
+
+        bool rectifier = a == activation::RELU || a == activation::LEAKY_RELU;
+        double limit = rectifier ? std::sqrt(6.0 / rows) : std::sqrt(6.0 / (rows + cols));
+
+        for(size_t i = 0; i < rows*cols; i++) weights[i] = static_cast<T>((2.0*math::rand_float() - 1.0) * limit);
+        for(size_t i = 0; i < cols; i++) biases[i] = 0;
+    }
+
+}
+
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "activation.hpp"
+#include "model.hpp"
+#include "optimizer.hpp"
+#include "serialization.hpp"
+#include "thread_pool.hpp"
+#include <array>
+#include <functional>
+#include <ostream>
+#include <random>
+#include <span>
+
+// Largest number of samples the CPU backend pushes through the network at once
+#ifndef CPU_VNN_MAX_BATCH_CHUNK
+#define CPU_VNN_MAX_BATCH_CHUNK 256
+#endif
+
+namespace lazyml {
+
+namespace models {
+
+    /**
+    * Native implementation of vnn that runs on the host without OpenCL.
+    * Uses the same math, the same training semantics and the same file format
+    * as vnn, so models can be moved freely between the two.
+    *
+    * Matrices are multiplied with the cache blocked routines in math/gemm.hpp
+    * and every batch is split across a thread pool.
+    *
+    * The clwrapper::memory/dataset overloads read the host side copies of the
+    * data, those have to be up to date. The span overloads don't touch
+    * OpenCL at all.
+    */
+    class cpu_vnn : public model<VNN_FLOAT_TYPE> {
+        public:
+        // 0 threads = one per hardware thread
+        cpu_vnn(std::vector<uint> &arch, size_t threads = 0);
+        // Same as the vnn constructor, activations holds the activation of every layer after the input
+        cpu_vnn(std::vector<uint> &arch, const std::vector<activation> &activations, size_t threads = 0);
+        cpu_vnn(const std::string &filename, size_t threads = 0);
+        cpu_vnn(const serialization::network<VNN_FLOAT_TYPE> &net, size_t threads = 0);
+
+        struct evaluation {
+            // Same as vnn::evaluation
+            VNN_FLOAT_TYPE cost;
+            VNN_FLOAT_TYPE accuracy;
+        };
+
+        // Host only interface. Inputs and targets are laid out sample after sample.
+        void run(std::span<const VNN_FLOAT_TYPE> input, std::vector<VNN_FLOAT_TYPE> &output);
+        void train(
+                std::span<const VNN_FLOAT_TYPE> inputs,
+                std::span<const VNN_FLOAT_TYPE> targets,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size
+        );
+        evaluation evaluate(std::span<const VNN_FLOAT_TYPE> inputs, std::span<const VNN_FLOAT_TYPE> targets);
+
+        // Runs the samples in chunks and hands the activations of every layer, input and
+        // output included, to visit as [samples in chunk x neurons] matrices
+        typedef std::function<void(size_t layer, std::span<const VNN_FLOAT_TYPE> activations)> layer_visitor;
+        void trace(std::span<const VNN_FLOAT_TYPE> inputs, const layer_visitor& visit);
+
+        // models::model
+        void run(clwrapper::memory<VNN_FLOAT_TYPE>& input, std::vector<VNN_FLOAT_TYPE> &output);
+        std::vector<VNN_FLOAT_TYPE> run(clwrapper::memory<VNN_FLOAT_TYPE>& input);
+
+        void train(
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate
+        );
+        VNN_FLOAT_TYPE cost(
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output
+        );
+
+        void train(
+                data::dataset<VNN_FLOAT_TYPE>& data,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size
+        );
+        VNN_FLOAT_TYPE cost(data::dataset<VNN_FLOAT_TYPE>& data);
+
+        bool serialize(const std::string &filename);
+
+        // Same as vnn::checkpoint, the files can be loaded by either backend
+        bool checkpoint(const std::string &filename);
+        void checkpoint_every(uint epochs, const std::string &filename);
+        // Same as vnn::report_progress_to
+        void report_progress_to(std::ostream* out) { _progress_out = out; }
+        uint64_t epoch() const { return _epoch; }
+
+        const std::vector<activation>& activations() const { return _layer_activations; }
+
+        // Same update rules as vnn::set_optimizer
+        void set_optimizer(const optimizer &opt);
+        const optimizer& get_optimizer() const { return _optimizer; }
+
+        private:
+        std::vector<uint> _neurons_per_layer;
+        size_t _layers;
+        std::vector<activation> _layer_activations;
+
+        // Same layout as the device buffers of vnn
+        // W[l] is [neurons l x neurons l+1], activations are [batch x neurons]
+        std::vector<std::vector<VNN_FLOAT_TYPE>> _weights, _biases, _weight_gradients, _bias_gradients;
+        std::vector<std::vector<VNN_FLOAT_TYPE>> _activations, _deltas;
+        size_t _batch_capacity;
+
+        utils::thread_pool _pool;
+        std::mt19937 _rng;
+
+        uint64_t _epoch;
+        uint _checkpoint_interval;
+        std::string _checkpoint_file;
+        std::ostream* _progress_out = nullptr;
+
+        optimizer _optimizer;
+        uint64_t _step = 0;
+        // Index k is the k-th state value of optimizer::state_buffers, laid out like the parameters
+        std::array<std::vector<std::vector<VNN_FLOAT_TYPE>>, 2> _weights_state, _biases_state;
+
+        bool write_model(const std::string &filename, bool with_state);
+
+        // Samples are handed to the training and evaluation loops as pointers,
+        // which keeps the memory, dataset and span overloads on one code path
+        typedef std::function<const VNN_FLOAT_TYPE*(size_t)> sample_source;
+
+        void train(
+                size_t n,
+                const sample_source& input,
+                const sample_source& target,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size
+        );
+        evaluation evaluate(size_t n, const sample_source& input, const sample_source& target);
+
+        // Compact data sets have no host copy in the model's format, this expands all samples into one
+        static std::pair<std::vector<VNN_FLOAT_TYPE>, std::vector<VNN_FLOAT_TYPE>> decode(data::dataset<VNN_FLOAT_TYPE>& data);
+
+        void allocate();
+        void reserve_batch(size_t batch);
+
+        // Copies the given samples into the first rows of the input activations
+        void load(const sample_source& input, const std::vector<size_t>& order, size_t first, size_t count);
+
+        void forward(size_t batch);
+        // targets[b] is the target of sample b of the batch
+        void backprop(size_t batch, const std::vector<const VNN_FLOAT_TYPE*>& targets);
+        void apply_gradient(size_t n, VNN_FLOAT_TYPE learning_rate);
+        void zero_gradient();
+    };
+
+}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "clwrapper.hpp"
+#include "activation.hpp"
+#include "vnn.hpp"
+#include "data/dataset.hpp"
+#include <CL/opencl.hpp>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <span>
+#include <vector>
+
+namespace lazyml {
+
+namespace models {
+
+    /**
+    * Data parallel training of a vnn over several devices.
+    *
+    * Every device holds a replica of the network and its own copy of the
+    * data set. Each batch is split into one contiguous shard per replica. The
+    * replicas compute the gradients of their shards, the gradients are summed
+    * over all replicas, and every replica applies the same update, so the
+    * parameters stay identical.
+    *
+    * The sum is done with copies between the devices and an add kernel when
+    * all contexts share one cl::Context, e.g. sub-devices made by
+    * clwrapper::split_device. Otherwise the gradients go through the host.
+    */
+    class data_parallel {
+        public:
+        // Timing of a train call
+        struct report {
+            size_t replicas;
+            size_t samples;
+            double seconds;
+            // Host time spent summing the gradients, waiting for them included
+            double reduce_seconds;
+
+            double samples_per_second() const { return samples / seconds; }
+        };
+
+        // One replica per context, activations work like for vnn
+        data_parallel(
+            std::vector<std::reference_wrapper<clwrapper::clcontext>> contexts,
+            std::vector<uint> &arch, const std::vector<activation> &activations = {}
+        );
+
+        // Samples laid out one after another, every replica uploads its own copy
+        void set_data(std::span<const VNN_FLOAT_TYPE> inputs, std::span<const VNN_FLOAT_TYPE> targets);
+
+        // Mini-batch stochastic gradient descent like vnn::train over a data set,
+        // batch_size counts the samples of all replicas together
+        report train(uint iterations, VNN_FLOAT_TYPE learning_rate, uint batch_size);
+        // Same as vnn::report_progress_to
+        void report_progress_to(std::ostream* out) { _progress_out = out; }
+
+        void set_optimizer(const optimizer &opt);
+
+        // The first replica, for evaluating and saving the trained network
+        vnn& model() { return *_replicas.front(); }
+        size_t replicas() const { return _replicas.size(); }
+        // True if the gradients are summed with device to device copies
+        bool peer_reduce() const { return _peer; }
+
+        // Speedup of parallel over single, divided by the number of replicas parallel used.
+        // 1 is perfect scaling.
+        static double scaling_efficiency(const report &single, const report &parallel);
+
+        private:
+        std::vector<std::reference_wrapper<clwrapper::clcontext>> _contexts;
+        std::vector<std::unique_ptr<vnn>> _replicas;
+        std::vector<data::dataset<VNN_FLOAT_TYPE>> _data;
+
+        bool _peer;
+        // Peer reduce: the gradients of replica r > 0 are copied to _scratch_d[r-1] on replica 0's device
+        std::vector<cl::Buffer> _scratch_d;
+        cl::Kernel _add_kernel;
+        size_t _add_local = 0;
+        // Host reduce: the gradient arena of every replica
+        std::vector<std::vector<VNN_FLOAT_TYPE>> _host_gradients;
+
+        std::mt19937 _rng;
+        std::ostream* _progress_out = nullptr;
+
+        // Sums the gradient arenas of all replicas into every one of them
+        void all_reduce();
+        void peer_all_reduce();
+        void host_all_reduce();
+
+        // Makes every replica's parameters those of the first one
+        void broadcast_parameters();
+    };
+
+}
+
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "clwrapper.hpp"
+#include "precision.hpp"
+#include "data/dataset.hpp"
 
 namespace lazyml {
 
@@ -8,10 +10,9 @@ namespace models {
 
     template<typename T = float>
     class model {
-        protected:
-        clwrapper::clcontext& _context;
         public:
-        model(clwrapper::clcontext& con) :_context(con) {}
+        virtual ~model() {}
+
         virtual void run(clwrapper::memory<T>& input, std::vector<T> &output) = 0;
         virtual std::vector<T> run(clwrapper::memory<T>& input) = 0;
 
@@ -27,7 +28,17 @@ namespace models {
                 std::vector<clwrapper::memory<T>>& output
             ) = 0;
 
-        virtual void serialize(
+        virtual void train(
+                data::dataset<T>& data,
+                uint iterations,
+                T learning_rate,
+                uint batch_size
+            ) = 0;
+
+        virtual T cost(data::dataset<T>& data) = 0;
+
+        // False if the file couldn't be written
+        virtual bool serialize(
                 const std::string &filename
         ) = 0;
     };
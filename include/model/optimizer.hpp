@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string>
+
+namespace lazyml {
+
+namespace models {
+
+    enum class optimizer_kind {
+        SGD,
+        MOMENTUM,
+        NESTEROV,
+        ADAM
+    };
+
+    /**
+    * Update rule applied to the averaged gradient g of every batch, p is a
+    * weight or bias and lr the learning rate passed to train.
+    *
+    * SGD       p -= lr*g
+    * MOMENTUM  v = momentum*v + g, p -= lr*v
+    * NESTEROV  v = momentum*v + g, p -= lr*(g + momentum*v)
+    * ADAM      m = beta1*m + (1-beta1)*g, v = beta2*v + (1-beta2)*g^2,
+    *           p -= lr*sqrt(1-beta2^t)/(1-beta1^t) * m/(sqrt(v) + epsilon)
+    *
+    * v and m are state kept per parameter, on the device for vnn.
+    */
+    struct optimizer {
+        optimizer_kind kind = optimizer_kind::SGD;
+
+        float momentum = 0.9f;
+
+        float beta1 = 0.9f;
+        float beta2 = 0.999f;
+        float epsilon = 1e-8f;
+
+        static optimizer sgd() { return {}; }
+
+        static optimizer with_momentum(float momentum = 0.9f, bool nesterov = false) {
+            optimizer opt;
+            opt.kind = nesterov ? optimizer_kind::NESTEROV : optimizer_kind::MOMENTUM;
+            opt.momentum = momentum;
+            return opt;
+        }
+
+        static optimizer adam(float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f) {
+            optimizer opt;
+            opt.kind = optimizer_kind::ADAM;
+            opt.beta1 = beta1;
+            opt.beta2 = beta2;
+            opt.epsilon = epsilon;
+            return opt;
+        }
+
+        // Number of state values kept per parameter
+        size_t state_buffers() const {
+            switch(kind) {
+                case optimizer_kind::SGD: return 0;
+                case optimizer_kind::MOMENTUM:
+                case optimizer_kind::NESTEROV: return 1;
+                case optimizer_kind::ADAM: return 2;
+            }
+            return 0;
+        }
+
+        // Learning rate of step t (counting from 1) with Adam's bias corrections folded in
+        float adam_learning_rate(float learning_rate, uint64_t t) const {
+            double c1 = 1.0 - std::pow(static_cast<double>(beta1), static_cast<double>(t));
+            double c2 = 1.0 - std::pow(static_cast<double>(beta2), static_cast<double>(t));
+            return static_cast<float>(learning_rate * std::sqrt(c2) / c1);
+        }
+
+        // Text form stored in checkpoints
+        std::string to_string() const {
+            std::ostringstream out;
+            out << static_cast<int>(kind) << " " << momentum << " " << beta1 << " " << beta2 << " " << epsilon;
+            return out.str();
+        }
+
+        static std::optional<optimizer> parse(const std::string &str) {
+            std::istringstream in(str);
+            optimizer opt;
+            int kind;
+            if(!(in >> kind >> opt.momentum >> opt.beta1 >> opt.beta2 >> opt.epsilon)) return std::nullopt;
+            if(kind < 0 || kind > static_cast<int>(optimizer_kind::ADAM)) return std::nullopt;
+            opt.kind = static_cast<optimizer_kind>(kind);
+            return opt;
+        }
+    };
+
+}
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "clwrapper.hpp"
+#include "activation.hpp"
+#include "cpu_vnn.hpp"
+#include "serialization.hpp"
+#include "vnn.hpp"
+#include "data/dataset.hpp"
+#include <CL/opencl.hpp>
+#include <optional>
+#include <span>
+
+namespace lazyml {
+
+namespace models {
+
+    /**
+    * Inference only, post-training quantized version of a trained vnn.
+    *
+    * Weights are stored as int8 with one scale per neuron, the activations
+    * between layers as uint8 with a scale and zero point per layer. Those are
+    * calibrated by running a sample of inputs through the float network and
+    * taking the range every layer's activations cover. Layers multiply with
+    * int32 accumulation, integer dot product instructions are used where the
+    * device has cl_khr_integer_dot_product, and dequantize, add the bias and
+    * activate in the same kernel. Only the output layer is kept in
+    * VNN_FLOAT_TYPE.
+    *
+    * The weights take a quarter of the memory of float weights, and a
+    * quarter of the bandwidth to read them.
+    */
+    class qvnn {
+        public:
+        // calibration holds input samples laid out one after another, a few hundred
+        // representative samples are usually enough
+        qvnn(clwrapper::clcontext& con, const serialization::network<VNN_FLOAT_TYPE> &net, std::span<const VNN_FLOAT_TYPE> calibration);
+        qvnn(clwrapper::clcontext& con, vnn &model, std::span<const VNN_FLOAT_TYPE> calibration);
+        qvnn(clwrapper::clcontext& con, const std::string &filename, std::span<const VNN_FLOAT_TYPE> calibration);
+
+        // Runs any number of samples laid out one after another, outputs are laid out the same way
+        void run(std::span<const VNN_FLOAT_TYPE> inputs, std::vector<VNN_FLOAT_TYPE> &outputs);
+        std::vector<VNN_FLOAT_TYPE> run(clwrapper::memory<VNN_FLOAT_TYPE>& input);
+
+        // Accuracy of the quantized network next to the float network it was made from
+        struct report {
+            size_t samples;
+            // Fraction of samples where the largest output matches the largest target
+            VNN_FLOAT_TYPE reference_accuracy, quantized_accuracy;
+            // Fraction of samples where both networks pick the same output
+            VNN_FLOAT_TYPE agreement;
+            // Largest and mean absolute difference of the outputs
+            VNN_FLOAT_TYPE max_error, mean_error;
+            // Bytes of the parameters of both networks
+            size_t reference_bytes, quantized_bytes;
+        };
+
+        report compare(cpu_vnn &reference, std::span<const VNN_FLOAT_TYPE> inputs, std::span<const VNN_FLOAT_TYPE> targets);
+        // Compares on the first samples of the data set, all of them if samples is 0
+        report compare(cpu_vnn &reference, data::dataset<VNN_FLOAT_TYPE>& data, size_t samples = 0);
+
+        // Device memory of the parameters: int8 weights, their sums and the per neuron scales and biases
+        size_t parameter_bytes() const;
+
+        // True when the device has integer dot product instructions for the layers to use
+        bool integer_dot_product() const { return _integer_dot; }
+
+        private:
+        clwrapper::clcontext& _context;
+
+        std::vector<cl_uint> _neurons_per_layer;
+        size_t _layers;
+        std::vector<activation> _layer_activations;
+
+        // Everything of a layer after the input, index l belongs to weight matrix l
+        struct layer {
+            // Transposed [cols x k] weights, k is rows rounded up to a multiple of 4 and padded with 0
+            clwrapper::memory<cl_char> weights;
+            // Sum of the quantized weights of every neuron
+            clwrapper::memory<cl_int> weight_sums;
+            // Input scale * weight scale of every neuron
+            clwrapper::memory<VNN_FLOAT_TYPE> scales;
+            clwrapper::memory<VNN_FLOAT_TYPE> biases;
+
+            // Quantization of the layer's input, real = scale * (q - zero_point)
+            VNN_FLOAT_TYPE input_scale;
+            cl_int input_zero_point;
+        };
+        std::vector<layer> _layer_data;
+
+        // Quantized inputs of every weight layer, [batch x k] bytes
+        std::vector<clwrapper::memory<cl_uchar>> _activations_d;
+        // Inputs as given and outputs of the last layer, [batch x neurons]
+        std::optional<clwrapper::memory<VNN_FLOAT_TYPE>> _input_d, _output_d;
+        cl_uint _batch_capacity;
+
+        bool _integer_dot;
+
+        // Index l is specialized for the activation of weight layer l
+        std::vector<cl::Kernel> _forward_kernels, _output_kernels;
+        cl::Kernel _quantize_kernel, _softmax_kernel;
+
+        // Rows of a layer with rows inputs in the quantized layout
+        static cl_uint padded(cl_uint rows) { return (rows + 3) / 4 * 4; }
+
+        void quantize(const serialization::network<VNN_FLOAT_TYPE> &net, std::span<const VNN_FLOAT_TYPE> calibration);
+        void init();
+        void reserve_batch(cl_uint batch);
+
+        // Operates on the first batch rows, the inputs are in _input_d and the outputs end up in _output_d
+        void forward(cl_uint batch);
+    };
+
+}
+
+}
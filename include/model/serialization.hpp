@@ -0,0 +1,462 @@
+#pragma once
+
+#include "optimizer.hpp"
+#include "utils.hpp"
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+// First bytes of a model file, the legacy format starts with the entry size instead
+#define MODEL_FILE_MAGIC "LZML"
+// 2 added the activation of every layer, files without it are all sigmoid
+#define MODEL_FILE_VERSION 2
+// Every tensor starts at a multiple of this many bytes from the start of the file
+#define MODEL_FILE_ALIGNMENT 64
+// Tensor names including the terminating zero
+#define MODEL_FILE_NAME_SIZE 32
+
+namespace lazyml {
+
+namespace models {
+
+namespace serialization {
+
+    // Training progress saved by checkpoints, enough to continue as if training never stopped
+    template<typename T>
+    struct training_state {
+        // Epochs trained so far
+        uint64_t epoch = 0;
+        // Random generator used for shuffling, in the text form of operator<<
+        std::string rng;
+        // Optimizer settings in the text form of optimizer::to_string, empty for plain SGD
+        std::string optimizer_config;
+        // Updates applied with the optimizer so far
+        uint64_t step = 0;
+        // Named optimizer tensors, such as one momentum buffer per parameter
+        std::map<std::string, std::vector<T>> optimizer;
+    };
+
+    // Everything needed to recreate a network, shared by all model backends
+    template<typename T>
+    struct network {
+        // Neurons per layer, the input counts as a layer
+        std::vector<uint32_t> neurons_per_layer;
+
+        // One [rows x cols] weight matrix and one bias vector per layer after the input
+        std::vector<std::vector<T>> weights, biases;
+
+        // models::activation of every layer after the input, empty means all sigmoid
+        std::vector<uint32_t> activations;
+
+        // Only present in checkpoints
+        std::optional<training_state<T>> state;
+    };
+
+    /**
+    * Model file, integers and tensors are in the byte order of the host that
+    * wrote it. Nothing is swapped on load, so files move between hosts of the
+    * same endianness only.
+    *
+    * header        magic, version, entry size, layers, tensors, table checksum
+    * layers        uint32 neurons of every layer
+    * tensor table  name, offset, size and checksum of every tensor
+    * tensors       raw data, every tensor aligned to MODEL_FILE_ALIGNMENT
+    *
+    * Tensors are "weights.<l>" and "biases.<l>" for every layer after the input
+    * and "activations" with a uint32 activation per layer after the input,
+    * checkpoints add "state.epoch", "state.rng", "state.step", "state.optimizer"
+    * and "optimizer.<name>". Checksums
+    * are utils::hash (FNV-1a) over the bytes, the table checksum covers the
+    * layers and the tensor table. Tensors are stored exactly as they are in
+    * memory, so a mapped file can be handed to the device as is.
+    */
+    struct file_header {
+        char magic[4];
+        uint32_t version;
+        uint32_t entry_size;
+        uint32_t layers;
+        uint32_t tensors;
+        uint32_t reserved;
+        uint64_t table_checksum;
+    };
+
+    struct tensor_entry {
+        char name[MODEL_FILE_NAME_SIZE];
+        uint64_t offset;
+        uint64_t size;
+        uint64_t checksum;
+        uint64_t reserved;
+    };
+
+    static_assert(sizeof(file_header) == 32 && sizeof(tensor_entry) == 64, "Model file structs must not be padded");
+
+    // FNV-1a over raw bytes, same as utils::hash on strings
+    inline uint64_t checksum(const uint8_t* data, size_t size, uint64_t seed = 0xcbf29ce484222325ULL) {
+        uint64_t h = seed;
+        for(size_t i = 0; i < size; i++) {
+            h ^= data[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // Name of state value k of the "weights" or "biases" of layer l, see optimizer::state_buffers
+    inline std::string optimizer_tensor(size_t k, const std::string &kind, size_t l) {
+        return std::to_string(k) + "." + kind + "." + std::to_string(l);
+    }
+
+    inline size_t align(size_t x) {
+        return (x + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT;
+    }
+
+    /**
+    * Read only view of a model file in the current format. The file is mapped,
+    * tensors are spans into the mapping and are never parsed or copied.
+    */
+    class model_file {
+        public:
+            // Empty optional if the file isn't a valid model file or a checksum doesn't match
+            static std::optional<model_file> open(const std::string &filename) {
+                std::shared_ptr<const utils::mapped_file> file = utils::mapped_file::open(filename);
+                if(!file || file->size() < sizeof(file_header)) return std::nullopt;
+
+                model_file model;
+                model._file = file;
+                std::memcpy(&model._header, file->data(), sizeof(file_header));
+
+                const file_header &h = model._header;
+                if(std::memcmp(h.magic, MODEL_FILE_MAGIC, 4) != 0) return std::nullopt;
+                if(h.version > MODEL_FILE_VERSION) {
+                    std::cout << filename << " is version " << h.version << ", newest known is " << MODEL_FILE_VERSION << std::endl;
+                    return std::nullopt;
+                }
+
+                size_t layers_offset = sizeof(file_header);
+                size_t table_offset = align(layers_offset + sizeof(uint32_t) * h.layers);
+                size_t table_end = table_offset + sizeof(tensor_entry) * h.tensors;
+                if(file->size() < table_end) return std::nullopt;
+
+                uint64_t table_checksum = checksum(file->data() + layers_offset, sizeof(uint32_t) * h.layers);
+                table_checksum = checksum(file->data() + table_offset, sizeof(tensor_entry) * h.tensors, table_checksum);
+                if(table_checksum != h.table_checksum) {
+                    std::cout << filename << ": corrupted tensor table" << std::endl;
+                    return std::nullopt;
+                }
+
+                model._neurons_per_layer.resize(h.layers);
+                std::memcpy(model._neurons_per_layer.data(), file->data() + layers_offset, sizeof(uint32_t) * h.layers);
+
+                for(uint32_t i = 0; i < h.tensors; i++) {
+                    tensor_entry entry;
+                    std::memcpy(&entry, file->data() + table_offset + i*sizeof(tensor_entry), sizeof(tensor_entry));
+                    entry.name[MODEL_FILE_NAME_SIZE-1] = 0;
+
+                    // Compared without adding, offset + size can wrap around
+                    if(entry.offset > file->size() || entry.size > file->size() - entry.offset) return std::nullopt;
+                    if(entry.offset % MODEL_FILE_ALIGNMENT != 0) return std::nullopt;
+
+                    std::span<const uint8_t> bytes = {file->data() + entry.offset, entry.size};
+                    if(checksum(bytes.data(), bytes.size()) != entry.checksum) {
+                        std::cout << filename << ": checksum of " << entry.name << " doesn't match" << std::endl;
+                        return std::nullopt;
+                    }
+
+                    model._tensors[entry.name] = bytes;
+                }
+
+                return model;
+            }
+
+            uint32_t version() const { return _header.version; }
+            uint32_t entry_size() const { return _header.entry_size; }
+            const std::vector<uint32_t>& neurons_per_layer() const { return _neurons_per_layer; }
+
+            bool has(const std::string &name) const { return _tensors.count(name) != 0; }
+
+            std::span<const uint8_t> bytes(const std::string &name) const {
+                auto it = _tensors.find(name);
+                if(it == _tensors.end()) return {};
+                return it->second;
+            }
+
+            template<typename T>
+            std::span<const T> tensor(const std::string &name) const {
+                std::span<const uint8_t> b = bytes(name);
+                return {reinterpret_cast<const T*>(b.data()), b.size() / sizeof(T)};
+            }
+
+            const std::map<std::string, std::span<const uint8_t>>& tensors() const { return _tensors; }
+
+        private:
+            std::shared_ptr<const utils::mapped_file> _file;
+            file_header _header;
+            std::vector<uint32_t> _neurons_per_layer;
+            std::map<std::string, std::span<const uint8_t>> _tensors;
+    };
+
+    // False if the file couldn't be written, the previous file of that name is left as it was
+    template<typename T>
+    [[nodiscard]] bool write(const std::string &filename, const network<T> &net) {
+        // Everything that ends up in the file, in order
+        std::vector<std::pair<std::string, std::span<const uint8_t>>> tensors;
+        auto add = [&](const std::string &name, const void* data, size_t size) {
+            assert(name.size() < MODEL_FILE_NAME_SIZE && "Tensor name too long");
+            tensors.emplace_back(name, std::span<const uint8_t>(static_cast<const uint8_t*>(data), size));
+        };
+
+        for(size_t l = 0; l + 1 < net.neurons_per_layer.size(); l++) {
+            add("weights." + std::to_string(l), net.weights[l].data(), sizeof(T) * net.weights[l].size());
+            add("biases." + std::to_string(l), net.biases[l].data(), sizeof(T) * net.biases[l].size());
+        }
+
+        if(!net.activations.empty()) {
+            assert(net.activations.size() + 1 == net.neurons_per_layer.size());
+            add("activations", net.activations.data(), sizeof(uint32_t) * net.activations.size());
+        }
+
+        if(net.state) {
+            const training_state<T> &state = net.state.value();
+            add("state.epoch", &state.epoch, sizeof(uint64_t));
+            add("state.rng", state.rng.data(), state.rng.size());
+            add("state.step", &state.step, sizeof(uint64_t));
+            add("state.optimizer", state.optimizer_config.data(), state.optimizer_config.size());
+            for(auto &[name, values] : state.optimizer) {
+                add("optimizer." + name, values.data(), sizeof(T) * values.size());
+            }
+        }
+
+        file_header header = {};
+        std::memcpy(header.magic, MODEL_FILE_MAGIC, 4);
+        header.version = MODEL_FILE_VERSION;
+        header.entry_size = sizeof(T);
+        header.layers = static_cast<uint32_t>(net.neurons_per_layer.size());
+        header.tensors = static_cast<uint32_t>(tensors.size());
+
+        size_t layers_offset = sizeof(file_header);
+        size_t table_offset = align(layers_offset + sizeof(uint32_t) * header.layers);
+        size_t offset = align(table_offset + sizeof(tensor_entry) * header.tensors);
+
+        std::vector<tensor_entry> table;
+        for(auto &[name, data] : tensors) {
+            tensor_entry entry = {};
+            std::strncpy(entry.name, name.c_str(), MODEL_FILE_NAME_SIZE - 1);
+            entry.offset = offset;
+            entry.size = data.size();
+            entry.checksum = checksum(data.data(), data.size());
+            table.push_back(entry);
+
+            offset = align(offset + data.size());
+        }
+
+        std::vector<unsigned char> bytes(offset, 0);
+        std::memcpy(bytes.data() + layers_offset, net.neurons_per_layer.data(), sizeof(uint32_t) * header.layers);
+        std::memcpy(bytes.data() + table_offset, table.data(), sizeof(tensor_entry) * table.size());
+        for(size_t i = 0; i < tensors.size(); i++) {
+            std::memcpy(bytes.data() + table[i].offset, tensors[i].second.data(), tensors[i].second.size());
+        }
+
+        header.table_checksum = checksum(bytes.data() + layers_offset, sizeof(uint32_t) * header.layers);
+        header.table_checksum = checksum(bytes.data() + table_offset, sizeof(tensor_entry) * table.size(), header.table_checksum);
+        std::memcpy(bytes.data(), &header, sizeof(file_header));
+
+        // Through a temporary file, a crash while checkpointing never destroys the previous checkpoint
+        if(utils::write_file(filename, bytes)) return true;
+
+        std::cout << "Could not write " << filename << std::endl;
+        return false;
+    }
+
+    /**
+    * Legacy file layout, still read but no longer written:
+    * uint16 size of a matrix entry in bytes
+    * uint16 number of layers
+    * uint32 neurons of every layer
+    * for every layer after the input: weights followed by biases
+    *
+    * Empty optional if the file is truncated or its entries have a different size.
+    */
+    template<typename T>
+    std::optional<network<T>> read_legacy(const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary | std::ios::in | std::ios::ate);
+        if(!in.is_open()) return std::nullopt;
+
+        // Every size in the file is checked against what is left of it before anything is allocated
+        uint64_t remaining = static_cast<uint64_t>(in.tellg());
+        in.seekg(0);
+        auto take = [&](uint64_t bytes) {
+            if(bytes > remaining) return false;
+            remaining -= bytes;
+            return true;
+        };
+
+        network<T> net;
+
+        uint16_t matrix_entry_size;
+        uint16_t number_of_layers;
+        if(!take(2 * sizeof(uint16_t))) return std::nullopt;
+        in.read(BYTE_PTR(matrix_entry_size), sizeof(uint16_t));
+        in.read(BYTE_PTR(number_of_layers), sizeof(uint16_t));
+
+        if(matrix_entry_size != sizeof(T)) return std::nullopt;
+        if(!take(uint64_t(sizeof(uint32_t)) * number_of_layers)) return std::nullopt;
+
+        net.neurons_per_layer.reserve(number_of_layers);
+        for(uint16_t i = 0; i < number_of_layers; i++) {
+            uint32_t neurons;
+            in.read(BYTE_PTR(neurons), sizeof(uint32_t));
+
+            net.neurons_per_layer.emplace_back(neurons);
+        }
+
+        for(uint16_t i = 1; i < number_of_layers; i++) {
+            uint64_t rows = net.neurons_per_layer[i-1];
+            uint64_t cols = net.neurons_per_layer[i];
+
+            // Divided instead of multiplied so the check itself can't overflow
+            if(cols != 0 && rows > remaining / sizeof(T) / cols) return std::nullopt;
+            if(!take(rows * cols * sizeof(T)) || !take(cols * sizeof(T))) return std::nullopt;
+
+            net.weights.emplace_back(rows * cols);
+            net.biases.emplace_back(cols);
+
+            in.read((byte*)net.weights.back().data(), rows * cols * sizeof(T));
+            in.read((byte*)net.biases.back().data(), cols * sizeof(T));
+        }
+
+        if(!in) return std::nullopt;
+        return net;
+    }
+
+    // True for files in the current format, false for legacy files and files that can't be opened
+    inline bool is_model_file(const std::string &filename) {
+        std::ifstream in(filename, std::ios::binary | std::ios::in);
+        if(!in.is_open()) return false;
+
+        char magic[4] = {};
+        in.read(magic, 4);
+        return std::memcmp(magic, MODEL_FILE_MAGIC, 4) == 0;
+    }
+
+    // Activations stored in the file, empty for files from before they were stored
+    inline std::vector<uint32_t> read_activations(const model_file &file) {
+        std::span<const uint32_t> activations = file.tensor<uint32_t>("activations");
+        return std::vector<uint32_t>(activations.begin(), activations.end());
+    }
+
+    template<typename T>
+    std::optional<training_state<T>> read_state(const model_file &file) {
+        if(!file.has("state.epoch")) return std::nullopt;
+        if(file.bytes("state.epoch").size() != sizeof(uint64_t)) return std::nullopt;
+        if(file.has("state.step") && file.bytes("state.step").size() != sizeof(uint64_t)) return std::nullopt;
+
+        training_state<T> state;
+        std::memcpy(&state.epoch, file.bytes("state.epoch").data(), sizeof(uint64_t));
+
+        std::span<const uint8_t> rng = file.bytes("state.rng");
+        state.rng = std::string(rng.begin(), rng.end());
+
+        // Checkpoints from before optimizers were added don't have these
+        if(file.has("state.step")) std::memcpy(&state.step, file.bytes("state.step").data(), sizeof(uint64_t));
+        std::span<const uint8_t> config = file.bytes("state.optimizer");
+        state.optimizer_config = std::string(config.begin(), config.end());
+
+        const std::string prefix = "optimizer.";
+        for(auto &[name, bytes] : file.tensors()) {
+            if(name.compare(0, prefix.size(), prefix) != 0) continue;
+            std::span<const T> values = file.tensor<T>(name);
+            state.optimizer[name.substr(prefix.size())] = std::vector<T>(values.begin(), values.end());
+        }
+
+        return state;
+    }
+
+    /**
+    * Opens a model file in the current format whose entries are T and checks
+    * that every tensor the models read has exactly the size of its layer:
+    * weights and biases of every layer, the activations if stored, the epoch
+    * and step counters and the optimizer tensors of a checkpoint.
+    * Empty optional otherwise, after printing what is wrong.
+    */
+    template<typename T>
+    std::optional<model_file> open_network(const std::string &filename) {
+        std::optional<model_file> file = model_file::open(filename);
+        if(!file) return std::nullopt;
+
+        if(file->entry_size() != sizeof(T)) {
+            std::cout << filename << " has " << file->entry_size() << " byte entries, this build uses " << sizeof(T) << std::endl;
+            return std::nullopt;
+        }
+
+        auto sized = [&](const std::string &name, uint64_t bytes, uint64_t count) {
+            if(file->has(name) && file->bytes(name).size() / bytes == count && file->bytes(name).size() % bytes == 0) return true;
+
+            std::cout << filename << ": " << name << (file->has(name) ? " has the wrong size" : " is missing") << std::endl;
+            return false;
+        };
+
+        // uint32 * uint32 always fits, the byte size of the tensor might not
+        const std::vector<uint32_t> &neurons = file->neurons_per_layer();
+        auto layer_tensors = [&](const std::string &weights, const std::string &biases, size_t l) {
+            return sized(weights, sizeof(T), uint64_t(neurons[l]) * neurons[l+1]) && sized(biases, sizeof(T), neurons[l+1]);
+        };
+
+        for(size_t l = 0; l + 1 < neurons.size(); l++) {
+            if(!layer_tensors("weights." + std::to_string(l), "biases." + std::to_string(l), l)) return std::nullopt;
+        }
+
+        if(file->has("activations") && !sized("activations", sizeof(uint32_t), neurons.size() - 1)) return std::nullopt;
+
+        if(!file->has("state.epoch")) return file;
+        if(!sized("state.epoch", 1, sizeof(uint64_t))) return std::nullopt;
+        if(file->has("state.step") && !sized("state.step", 1, sizeof(uint64_t))) return std::nullopt;
+
+        // Plain SGD and unknown optimizers keep no tensors, the models ignore them
+        std::span<const uint8_t> config = file->bytes("state.optimizer");
+        std::optional<optimizer> opt = optimizer::parse(std::string(config.begin(), config.end()));
+        for(size_t k = 0; opt && k < opt->state_buffers(); k++) {
+            for(size_t l = 0; l + 1 < neurons.size(); l++) {
+                std::string weights = "optimizer." + optimizer_tensor(k, "weights", l);
+                std::string biases = "optimizer." + optimizer_tensor(k, "biases", l);
+                if(!layer_tensors(weights, biases, l)) return std::nullopt;
+            }
+        }
+
+        return file;
+    }
+
+    // Reads both the current and the legacy format
+    template<typename T>
+    network<T> read(const std::string &filename) {
+        if(!is_model_file(filename)) return utils::value_or_panic(read_legacy<T>(filename), "Invalid model file " + filename);
+
+        model_file file = utils::value_or_panic(open_network<T>(filename), "Invalid model file " + filename);
+
+        network<T> net;
+        net.neurons_per_layer = file.neurons_per_layer();
+
+        for(size_t l = 0; l + 1 < net.neurons_per_layer.size(); l++) {
+            std::span<const T> weights = file.tensor<T>("weights." + std::to_string(l));
+            std::span<const T> biases = file.tensor<T>("biases." + std::to_string(l));
+
+            net.weights.emplace_back(weights.begin(), weights.end());
+            net.biases.emplace_back(biases.begin(), biases.end());
+        }
+
+        net.activations = read_activations(file);
+        net.state = read_state<T>(file);
+
+        return net;
+    }
+
+}
+
+}
+
+}
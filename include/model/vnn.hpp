@@ -1,81 +1,377 @@
 #pragma once
 
 #include "clwrapper.hpp"
+#include "autotune.hpp"
+#include "event_graph.hpp"
+#include "launch_plan.hpp"
+#include "activation.hpp"
 #include "model.hpp"
+#include "optimizer.hpp"
+#include "serialization.hpp"
+#include "data/dataset.hpp"
+#include "data/source.hpp"
 #include "math/math.hpp"
 #include "utils.hpp"
 #include <CL/opencl.hpp>
 #include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <span>
 
-#ifndef VNN_FLOAT_TYPE
-#define VNN_FLOAT_TYPE float
+// Largest number of samples pushed through the network in a single launch.
+// Batches larger than this are processed in chunks and their gradients are
+// accumulated before being applied.
+#ifndef VNN_MAX_BATCH_CHUNK
+#define VNN_MAX_BATCH_CHUNK 256
+#endif
+
+// Launch plans kept per pass, one for every batch size seen. All of them are
+// dropped once there are more, which only happens with many odd sized batches.
+#ifndef VNN_MAX_PLANS
+#define VNN_MAX_PLANS 8
+#endif
+
+// Chunks of a streamed data set that can be in flight at once, one is being
+// trained on while the next ones are decoded and uploaded
+#ifndef VNN_STREAM_SLOTS
+#define VNN_STREAM_SLOTS 2
 #endif
 
 namespace lazyml {
 
 namespace models {
 
+    class data_parallel;
+
 #define MAIN_CL_BUFFERS 0
 #define GRADIENT_CL_BUFFERS 1
 
     class vnn : model<VNN_FLOAT_TYPE> {
         public:
-        vnn(clwrapper::clcontext& con, std::vector<uint> &arch);
-        vnn(clwrapper::clcontext& con, const std::string &filename);
+        // Result of evaluating the network over a set of samples
+        struct evaluation {
+            // Mean squared error per output neuron, or mean cross entropy per sample for softmax outputs
+            VNN_FLOAT_TYPE cost;
+            // Fraction of samples where the largest output matches the largest target
+            VNN_FLOAT_TYPE accuracy;
+        };
+
+        // What a model loaded from a file is going to be used for
+        enum class mode {
+            // Parameters with a host copy, their gradients, and the activations and deltas of every layer
+            TRAINING,
+            // Only the parameters, on the device alone, two activation buffers the layers take
+            // turns reading and writing, and the targets of the output layer. run, run_batch
+            // and evaluate work, training and changing the optimizer don't.
+            INFERENCE
+        };
+
+        // activations holds the activation of every layer after the input, all sigmoid if empty
+        vnn(clwrapper::clcontext& con, std::vector<uint> &arch, const std::vector<activation> &activations = {});
+        // Inference only models ignore the optimizer state of checkpoints
+        vnn(clwrapper::clcontext& con, const std::string &filename, mode m = mode::TRAINING);
         ~vnn();
 
 
         std::vector<VNN_FLOAT_TYPE> run(clwrapper::memory<VNN_FLOAT_TYPE>& input);
         void run(clwrapper::memory<VNN_FLOAT_TYPE>& input, std::vector<VNN_FLOAT_TYPE> &output);
 
+        // Runs n samples at once, laid out one after another in inputs. Every layer is a
+        // batched matrix product and the [n x outputs] result comes back in a single read.
+        std::vector<VNN_FLOAT_TYPE> run_batch(std::span<const VNN_FLOAT_TYPE> inputs);
+        void run_batch(std::span<const VNN_FLOAT_TYPE> inputs, std::vector<VNN_FLOAT_TYPE> &outputs);
+        // Same for inputs that are already on the device, as one [n x inputs] buffer or one buffer per sample
+        void run_batch(clwrapper::memory<VNN_FLOAT_TYPE>& inputs, std::vector<VNN_FLOAT_TYPE> &outputs);
+        void run_batch(std::span<clwrapper::memory<VNN_FLOAT_TYPE>> inputs, std::vector<VNN_FLOAT_TYPE> &outputs);
+
+        // Non-blocking run_batch, returns as soon as everything is enqueued. inputs has to stay
+        // valid until the future is ready. Batches run in submission order, so several can be
+        // in flight while the host prepares the next one.
+        std::future<std::vector<VNN_FLOAT_TYPE>> run_batch_async(std::span<const VNN_FLOAT_TYPE> inputs);
+
+        // Full batch gradient descent, the gradient is applied once per epoch
         void train(
                 std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
                 std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output,
                 uint iterations,
                 VNN_FLOAT_TYPE learning_rate
         );
+        // Mini-batch stochastic gradient descent. The samples are shuffled
+        // every epoch and the gradient is applied after every batch_size samples
+        void train(
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size
+        );
         VNN_FLOAT_TYPE cost(
                 std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
                 std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output
         );
 
-        void serialize(const std::string &filename);
+        // Runs sample i of the data set
+        std::vector<VNN_FLOAT_TYPE> run(data::dataset<VNN_FLOAT_TYPE>& data, size_t i);
+
+        // Mini-batch stochastic gradient descent over a data set. Batches are
+        // contiguous ranges of samples, the order of the batches is shuffled every epoch
+        void train(
+                data::dataset<VNN_FLOAT_TYPE>& data,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size
+        );
+        VNN_FLOAT_TYPE cost(data::dataset<VNN_FLOAT_TYPE>& data);
+
+        // Streamed version of the data set overload for data that stays on the host.
+        // A producer thread reads the upcoming chunks into pinned memory and uploads
+        // them on the transfer queue while the current chunk is trained on.
+        void train(
+                data::source<VNN_FLOAT_TYPE>& data,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size
+        );
+
+        // Computes cost and accuracy on the device, the only host transfer is the final result
+        evaluation evaluate(
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output
+        );
+        evaluation evaluate(data::dataset<VNN_FLOAT_TYPE>& data);
+
+        // False if the file couldn't be written
+        bool serialize(const std::string &filename);
         bool deserialize(const std::string &filename);
 
+        // Like serialize, but also saves the epoch counter and the shuffling
+        // state. Loading a checkpoint continues training where it stopped.
+        bool checkpoint(const std::string &filename);
+        // Checkpoint to filename after every epochs epochs of training, 0 turns it off
+        void checkpoint_every(uint epochs, const std::string &filename);
+        // Where train prints the finished epochs, nullptr (the default) keeps it quiet
+        void report_progress_to(std::ostream* out) { _progress_out = out; }
+
+        // Copy of the parameters on the host, with the training state if with_state is set.
+        // Same contents as the file written by serialize/checkpoint.
+        serialization::network<VNN_FLOAT_TYPE> to_network(bool with_state = false);
+
+        // Epochs trained so far, including those of the file the model was loaded from
+        uint64_t epoch() const { return _epoch; }
+
+        const std::vector<activation>& activations() const { return _layer_activations; }
+
+        bool inference_only() const { return _inference; }
+
+        // Update rule used by train, plain SGD by default. Changing it resets the optimizer state.
+        void set_optimizer(const optimizer &opt);
+        const optimizer& get_optimizer() const { return _optimizer; }
+
+        // The launches of a forward pass and of a training step are recorded into a
+        // clwrapper::launch_plan per batch size the first time they are needed and
+        // replayed afterwards. Turning it off sets every argument before every launch.
+        // Contexts with an out-of-order queue never use plans, their launches are
+        // enqueued with the dependencies from an event graph instead.
+        void use_launch_plans(bool enabled);
+
         private:
+        // Drives the private training steps of its replicas
+        friend class data_parallel;
+
+        clwrapper::clcontext& _context;
+
         std::vector<cl_uint> _neurons_per_layer;
         size_t _layers;
+        // Activation of every layer after the input
+        std::vector<activation> _layer_activations;
+
+        // Loaded with mode::INFERENCE, there are no gradients and no deltas
+        bool _inference = false;
+
+        // All weights and biases live in one parameter arena in the storage type, see
+        // precision.hpp. Their gradients, always accumulated in VNN_FLOAT_TYPE, and the
+        // optimizer state are arenas with the same layout, so zeroing and applying the
+        // gradient are a single launch each and checkpoints a single transfer per arena.
+        std::optional<clwrapper::memory<VNN_STORAGE_TYPE>> _parameters_d;
+        std::optional<clwrapper::memory<VNN_FLOAT_TYPE>> _gradients_d;
+        // Offsets of the weights and biases of every layer in the arenas, and the size of the arenas
+        std::vector<size_t> _weight_offsets, _bias_offsets;
+        size_t _parameter_count;
 
-        // Index 0 = Actual weights, biases and activations(counting input, intermediate and output as activations)
+        // Sub-buffers of the arenas for the per layer kernels
+        std::vector<cl::Buffer> _weights_d, _biases_d;
+        std::vector<cl::Buffer> _weight_gradients_d, _bias_gradients_d;
+
+        // Index 0 = Activations(counting input, intermediate and output as activations)
         // Index 1 = Gradient. Activations gradient is used as buffers for some certain calculations in backpropagation
-        std::array<std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>, 2> _weights_d, _biases_d, _activations_d;
+        // Activations are [batch x neurons] row major matrices, one row per sample in the batch.
+        // Both are sub-buffers of a single activation arena. Inference only models alternate
+        // between two buffers sized for the widest layer and have no gradients, only the
+        // targets of the output layer for evaluate, the other entries of index 1 are null.
+        std::optional<clwrapper::memory<VNN_STORAGE_TYPE>> _activation_arena_d;
+        std::array<std::vector<cl::Buffer>, 2> _activations_d;
+
+        // Number of samples the activation buffers currently have room for
+        cl_uint _batch_capacity;
+
+        // Inputs and gathered outputs of run_batch, room for _batch_io_capacity samples
+        cl::Buffer _batch_inputs_d, _batch_outputs_d;
+        size_t _batch_io_capacity = 0;
+
+        // Used for shuffling the samples between epochs
+        std::mt19937 _rng;
+
+        uint64_t _epoch;
+        uint _checkpoint_interval;
+        std::string _checkpoint_file;
+        std::ostream* _progress_out = nullptr;
+
+        optimizer _optimizer;
+        // Number of updates applied with the current optimizer, Adam's t
+        uint64_t _step = 0;
+        // Per parameter optimizer state arenas, index k is the k-th state value of optimizer::state_buffers
+        std::array<std::optional<clwrapper::memory<VNN_FLOAT_TYPE>>, 2> _state_d;
 
         // Maybe use singleton pattern for this and only instantiate if get function is called?
         // Multiple instances of vnn can rely on same program. There might be delay though 
         cl::Program _program;
 
-        cl::Kernel _cost_kernel;
-        cl::Kernel _forward_kernel;
-        cl::Kernel _backprop_init_kernel, _backprop_step_kernel, _apply_gradient_kernel, _zero_kernel, _copy_kernel;
+        // Specialized for the activation of the output layer
+        cl::Kernel _cost_kernel, _softmax_kernel, _backprop_init_kernel;
+        // Index l is specialized for the activation of layer l+1, the output of weight matrix l
+        std::vector<cl::Kernel> _forward_kernels, _backprop_step_kernels;
+        cl::Kernel _backprop_gradient_kernel, _bias_gradient_kernel;
+        cl::Kernel _apply_gradient_kernel, _apply_momentum_kernel, _apply_adam_kernel;
+        cl::Kernel _zero_kernel, _reduce_sum_kernel, _to_real_kernel;
+        cl::Kernel _copy_u8_kernel, _one_hot_kernel;
+
+        // Tile parameters the GEMM kernels were built with
+        kernels::gemm_config _gemm;
+        // Local sizes of the element wise kernels picked by clwrapper::autotuner, 0 leaves it to the driver
+        struct {
+            size_t zero = 0, apply_gradient = 0, apply_momentum = 0, apply_adam = 0;
+            size_t backprop_init = 0, softmax = 0, to_real = 0, copy_u8 = 0, one_hot = 0;
+            // Per weight matrix
+            std::vector<size_t> bias_gradient;
+        } _local;
+
+        // Orders the loads and the launches of training steps on an out-of-order queue,
+        // empty for in-order queues
+        std::optional<clwrapper::event_graph> _graph;
+
+        bool _use_plans = true;
+        // Keyed by batch size, bound to the current activation buffers
+        std::map<cl_uint, clwrapper::launch_plan> _forward_plans, _step_plans;
+
+        // Copies a single sample into row b of the input/target activation matrices
+        void load_sample(clwrapper::memory<VNN_FLOAT_TYPE>& input, cl_uint b);
+        void load_target(clwrapper::memory<VNN_FLOAT_TYPE>& output, cl_uint b);
+
+        // Copies a range of samples into the first rows of the input/target activation matrices
+        void load_samples(const data::slice& input);
+        void load_targets(const data::slice& output);
+
+        // Copies the slice into dest, decoding compact slices on the way. width is the
+        // number of values per sample once decoded
+        void load_slice(const data::slice& source, cl::Buffer& dest, cl_uint width, const std::string& name);
+
+        // Copies n VNN_FLOAT_TYPE values into storage, converting them if the storage type
+        // differs. Offsets are in elements, wait and done are those of clcontext::enqueue_copy.
+        void copy_to_storage(
+            const cl::Buffer& src, size_t src_offset, cl::Buffer& dest, size_t dest_offset, size_t n,
+            const std::string& name, const std::vector<cl::Event>* wait = nullptr, cl::Event* done = nullptr
+        );
+
+        // Blocking read of the first rows of the output activations into out
+        void read_output(cl_uint rows, VNN_FLOAT_TYPE* out);
+        // Same for the first rows of any buffer of outputs in the storage type
+        void read_output(const cl::Buffer& buffer, size_t rows, VNN_FLOAT_TYPE* out);
 
-        cl::NDRange _kernel_range;
+        void reserve_batch_io(size_t n);
 
-        void forward(cl::Buffer &input);
-        void backprop(cl::Buffer &output);
+        // Uploads the samples of inputs into _batch_inputs_d without blocking and returns their number
+        size_t upload_batch(std::span<const VNN_FLOAT_TYPE> inputs);
 
-        void apply_gradient(cl_uint n, cl_float learning_rate);
-        void zero_gradient_activations();
+        // Shared by the run_batch overloads. Runs n samples in chunks, load has the same meaning
+        // as for train, and returns the buffer holding the [n x outputs] result in the storage type
+        const cl::Buffer& forward_batch(size_t n, const std::function<void(size_t, cl_uint)>& load);
+        // load for samples that are in _batch_inputs_d
+        void load_batch_inputs(size_t first, cl_uint count);
+
+        // [first, last) of a batch, last - first is at most the batch size
+        using batch_range = std::pair<size_t, size_t>;
+
+        // Shared training loop. batches() is called at the start of every epoch and returns
+        // the batches of the epoch in the order they are trained, load(first, count) has to
+        // load the samples at [first, first + count) of one of them into the batch
+        void train(
+                size_t n,
+                uint iterations,
+                VNN_FLOAT_TYPE learning_rate,
+                uint batch_size,
+                const std::function<std::vector<batch_range>()>& batches,
+                const std::function<void(size_t, cl_uint)>& load
+        );
+
+        // Operate on the first batch rows of the activation matrices. A training step
+        // is a forward pass followed by backpropagation.
+        void forward(cl_uint batch);
+        void train_step(cl_uint batch);
+
+        // Takes a kernel, its ranges, profiler name and layer, the buffers it uses and a function
+        // binding its arguments, and either launches it right away or adds it to a launch plan
+        using launcher = std::function<void(
+            const cl::Kernel&, const cl::NDRange&, const cl::NDRange&, const std::string&, int,
+            const clwrapper::buffer_access&, const std::function<void(cl::Kernel&)>&
+        )>;
+        launcher direct_launcher();
+        // The plan for batch in plans, recorded with record if there is none yet
+        clwrapper::launch_plan& plan(
+            std::map<cl_uint, clwrapper::launch_plan> &plans, cl_uint batch, const std::string &name,
+            const std::function<void(const launcher&)> &record
+        );
+
+        // Every launch of a forward pass and of backpropagation
+        void record_forward(cl_uint batch, const launcher &launch);
+        void record_backprop(cl_uint batch, const launcher &launch);
+
+        // Through the event graph if there is one, with access as its dependencies
+        void enqueue_kernel(
+            const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+            const std::string &name, int layer, const clwrapper::buffer_access &access
+        );
+
+        // Shared evaluation loop, load has the same meaning as for train
+        evaluation evaluate(size_t n, const std::function<void(size_t, cl_uint)>& load);
+
+        void apply_gradient(cl_uint n, VNN_FLOAT_TYPE learning_rate);
         void zero_gradient();
 
+        // Grows the activation matrices so they can hold at least batch samples
+        void reserve_batch(cl_uint batch);
+
         void init();
-        void add_matrix_pairs(
-            std::array<std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>, 2> &out,
-            cl_uint n, bool shouldRandomize
-        );
+        // Fills _local, timing the kernels on scratch buffers the first time on a device
+        void tune();
+        // Offsets of the weights and biases in the arenas, once _neurons_per_layer is known
+        void lay_out();
+        // Allocates the parameter arena holding parameters, which is laid out by lay_out, the
+        // gradient arena unless inference only, and the activations of a single sample
+        void allocate(std::span<const VNN_STORAGE_TYPE> parameters);
 
         void read_from_device();
         void write_to_device();
 
+        // Replaces the parameters with those of net, which has to have the same architecture
+        void set_parameters(const serialization::network<VNN_FLOAT_TYPE> &net);
+
+        // Shared by serialize and checkpoint
+        bool write_model(const std::string &filename, bool with_state);
+
     };
 
 }
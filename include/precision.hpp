@@ -0,0 +1,85 @@
+#pragma once
+
+#include "math/half.hpp"
+#include <CL/cl_platform.h>
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+/**
+* Element type of the OpenCL models, chosen when building the library with
+* -DVNN_PRECISION=<one of the values below> (LAZYML_PRECISION in CMake).
+*
+* FLOAT   everything is float
+* HALF    weights, biases and activations are stored as half on the device,
+*         halving their memory and bandwidth. Kernels convert with
+*         vload_half/vstore_half and compute, accumulate, and keep gradients and
+*         optimizer state in float. The host side stays float.
+* DOUBLE  everything is double, for validating the float kernels. Needs a
+*         device with cl_khr_fp64.
+*
+* VNN_FLOAT_TYPE is the type the host and the arithmetic work with,
+* VNN_STORAGE_TYPE the type of the parameter and activation buffers.
+*/
+#define VNN_PRECISION_FLOAT 0
+#define VNN_PRECISION_HALF 1
+#define VNN_PRECISION_DOUBLE 2
+
+#ifndef VNN_PRECISION
+#define VNN_PRECISION VNN_PRECISION_FLOAT
+#endif
+
+#ifndef VNN_FLOAT_TYPE
+#if VNN_PRECISION == VNN_PRECISION_DOUBLE
+#define VNN_FLOAT_TYPE double
+#else
+#define VNN_FLOAT_TYPE float
+#endif
+#endif
+
+#if VNN_PRECISION == VNN_PRECISION_HALF
+#define VNN_STORAGE_TYPE cl_half
+#else
+#define VNN_STORAGE_TYPE VNN_FLOAT_TYPE
+#endif
+
+static_assert(
+    std::is_same_v<VNN_FLOAT_TYPE, double> == (VNN_PRECISION == VNN_PRECISION_DOUBLE),
+    "VNN_FLOAT_TYPE has to be double exactly when VNN_PRECISION is VNN_PRECISION_DOUBLE"
+);
+
+namespace lazyml {
+
+    // Build options selecting REAL (storage) and ACCUM (arithmetic) in the kernels
+    inline std::string precision_options() {
+#if VNN_PRECISION == VNN_PRECISION_HALF
+        return "-DREAL_HALF";
+#elif VNN_PRECISION == VNN_PRECISION_DOUBLE
+        return "-DREAL_DOUBLE";
+#else
+        return "";
+#endif
+    }
+
+    // True when the storage type differs from VNN_FLOAT_TYPE and data has to be converted on its way
+    constexpr bool converted_storage = !std::is_same_v<VNN_STORAGE_TYPE, VNN_FLOAT_TYPE>;
+
+    // Host values to the device storage type and back
+    inline void to_storage(const VNN_FLOAT_TYPE* src, VNN_STORAGE_TYPE* dst, size_t n) {
+#if VNN_PRECISION == VNN_PRECISION_HALF
+        for(size_t i = 0; i < n; i++) dst[i] = math::float_to_half(src[i]);
+#else
+        std::copy(src, src + n, dst);
+#endif
+    }
+
+    inline void from_storage(const VNN_STORAGE_TYPE* src, VNN_FLOAT_TYPE* dst, size_t n) {
+#if VNN_PRECISION == VNN_PRECISION_HALF
+        for(size_t i = 0; i < n; i++) dst[i] = math::half_to_float(src[i]);
+#else
+        std::copy(src, src + n, dst);
+#endif
+    }
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <CL/opencl.hpp>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Events are resolved and released once this many are waiting, keeps memory bounded on long runs
+#define PROFILER_MAX_PENDING 16384
+
+namespace lazyml {
+
+namespace clwrapper {
+
+    // What a recorded command did
+    enum class command_kind {
+        KERNEL,
+        WRITE,   // host -> device
+        READ,    // device -> host
+        COPY,    // device -> device
+        MAP,     // device -> host mapping of pinned or zero copy memory
+        UNMAP,   // and back
+        FILL     // device only, a pattern repeated over a buffer
+    };
+
+    /**
+    * Collects OpenCL profiling events of kernel launches and transfers.
+    * Times are aggregated per command name and per (name, layer), bytes are
+    * counted per transfer direction. Individual commands are only kept when
+    * a Chrome trace has been requested.
+    */
+    class profiler {
+        public:
+            // Times in nanoseconds
+            struct stats {
+                size_t count = 0;
+                uint64_t queued = 0;   // queued -> submit
+                uint64_t submit = 0;   // submit -> start
+                uint64_t execute = 0;  // start -> end
+                uint64_t bytes = 0;
+            };
+
+            profiler();
+
+            // Returns the event the command has to be enqueued with, valid until the next call
+            cl::Event* record(command_kind kind, const std::string &name, int layer = -1, size_t bytes = 0);
+
+            // Host time spent enqueueing commands, the part the device never sees
+            void add_host_time(std::chrono::nanoseconds t) { _host_time += t; }
+            // Host time the models spend issuing their launches, setting arguments included, see dispatch_timer
+            void add_dispatch_time(std::chrono::nanoseconds t) { _dispatch_time += t; }
+
+            // Keep every command so a Chrome trace can be written to filename by report()
+            void trace(const std::string &filename) { _trace_file = filename; }
+
+            // Waits for all recorded commands and folds them into the statistics
+            void resolve();
+
+            // Prints a summary, writes the trace if requested and starts over
+            void report(std::ostream &out);
+            void reset();
+
+            // Where finish() prints its summary. With nullptr the statistics keep
+            // accumulating until the caller reads them through by_name()/by_layer()
+            void report_to(std::ostream* out) { _report_out = out; }
+
+            // Called by the models when train/cost are done
+            void finish();
+
+            const std::map<std::string, stats>& by_name() const { return _by_name; }
+            std::chrono::nanoseconds host_time() const { return _host_time; }
+            std::chrono::nanoseconds dispatch_time() const { return _dispatch_time; }
+            const std::map<std::pair<std::string, int>, stats>& by_layer() const { return _by_layer; }
+
+        private:
+            struct command {
+                command_kind kind;
+                std::string name;
+                int layer;
+                size_t bytes;
+                cl::Event event;
+            };
+
+            struct traced_command {
+                command_kind kind;
+                std::string name;
+                int layer;
+                uint64_t start, end;
+            };
+
+            std::vector<command> _pending;
+            std::vector<traced_command> _traced;
+
+            std::map<std::string, stats> _by_name;
+            std::map<std::pair<std::string, int>, stats> _by_layer;
+            std::map<command_kind, uint64_t> _bytes;
+
+            std::chrono::nanoseconds _host_time, _dispatch_time;
+            std::optional<std::string> _trace_file;
+            std::ostream* _report_out;
+
+            void write_trace(const std::string &filename);
+    };
+
+}
+
+}
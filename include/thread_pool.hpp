@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lazyml {
+
+namespace utils {
+
+    // Fixed set of worker threads for data parallel loops
+    class thread_pool {
+        public:
+            // 0 threads = one per hardware thread
+            explicit thread_pool(size_t threads = 0);
+            ~thread_pool();
+
+            thread_pool(const thread_pool&) = delete;
+            thread_pool& operator=(const thread_pool&) = delete;
+
+            /**
+            * Splits [0, n) into contiguous ranges and calls fn(begin, end) for
+            * each of them, the calling thread takes part as well.
+            * Returns once every range is done. Ranges are never smaller than
+            * min_range, so small loops don't pay for waking up every thread.
+            */
+            void parallel_for(size_t n, const std::function<void(size_t, size_t)>& fn, size_t min_range = 1);
+
+            size_t size() const { return _workers.size() + 1; }
+
+        private:
+            std::vector<std::thread> _workers;
+
+            std::mutex _mutex;
+            std::condition_variable _work_ready, _work_done;
+
+            // Current job, valid while _pending > 0
+            const std::function<void(size_t, size_t)>* _job;
+            size_t _n, _range, _next, _pending;
+
+            // Incremented for every job so sleeping workers can tell a new job apart
+            size_t _generation;
+            bool _stop;
+
+            void worker();
+            // Runs ranges of the current job until none are left, expects the lock to be held
+            void run_ranges(std::unique_lock<std::mutex>& lock);
+    };
+
+}
+
+}
@@ -1,7 +1,10 @@
 #pragma once
 
 #include<string>
+#include<vector>
+#include<cstdint>
 #include<optional>
+#include<memory>
 #include<iostream>
 #include<cassert>
 
@@ -33,6 +36,38 @@ namespace utils {
     std::string file_to_string(const std::string &filepath);
     bool file_exists(const std::string &filepath);
 
+    // Writes the bytes to filepath through a temporary file, so readers never see a partial file
+    bool write_file(const std::string &filepath, const std::vector<unsigned char> &bytes);
+
+    // 64 bit FNV-1a hash, seed allows chaining several strings into one hash
+    uint64_t hash(const std::string &str, uint64_t seed = 0xcbf29ce484222325ULL);
+    std::string to_hex(uint64_t x);
+
+    // Directory for files cached between runs, such as compiled kernel programs.
+    // $LAZYML_CACHE_DIR, $XDG_CACHE_HOME/lazyml or ~/.cache/lazyml in that order.
+    // The subdirectory is created if needed, empty optional if that isn't possible.
+    std::optional<std::string> cache_directory(const std::string &subdirectory);
+
+    // Read only memory mapping of a whole file, unmapped when the last reference goes away
+    class mapped_file {
+        public:
+            // nullptr if the file can't be opened or mapped
+            static std::shared_ptr<const mapped_file> open(const std::string &filepath);
+            ~mapped_file();
+
+            mapped_file(const mapped_file&) = delete;
+            mapped_file& operator=(const mapped_file&) = delete;
+
+            const uint8_t* data() const { return _data; }
+            size_t size() const { return _size; }
+
+        private:
+            mapped_file(const uint8_t* data, size_t size) : _data(data), _size(size) {}
+
+            const uint8_t* _data;
+            size_t _size;
+    };
+
     template<typename T>
     T value_or_panic(const std::optional<T>& opt, const std::string& msg) {
         if(opt) {
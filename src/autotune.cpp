@@ -0,0 +1,247 @@
+#include "autotune.hpp"
+#include "precision.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+using namespace lazyml;
+using namespace lazyml::clwrapper;
+
+// Shape of the layer the GEMM candidates are timed on, batch x rows times rows x cols
+#define AUTOTUNE_GEMM_BATCH 256
+#define AUTOTUNE_GEMM_ROWS 512
+#define AUTOTUNE_GEMM_COLS 512
+
+// Candidate GEMM tile sizes and work per thread, the default first
+static const kernels::gemm_config gemm_candidates[] = {
+    {GEMM_TILE_SIZE, GEMM_WORK_PER_THREAD},
+    {16, 2}, {16, 4}, {32, 2}, {64, 4}, {64, 8}
+};
+
+autotuner::autotuner(clcontext &context) :
+    _context(context)
+{
+    const char* env = std::getenv("LAZYML_AUTOTUNE");
+    _enabled = !(env && std::string(env) == "0");
+    if(!_enabled) return;
+
+    auto dir = utils::cache_directory("tuning");
+    if(!dir) return;
+
+    uint64_t key = utils::hash(TUNING_CACHE_VERSION);
+    key = utils::hash(_context._device.getInfo<CL_DEVICE_NAME>(), key);
+    key = utils::hash(_context._device.getInfo<CL_DEVICE_VERSION>(), key);
+    key = utils::hash(_context._device.getInfo<CL_DRIVER_VERSION>(), key);
+    key = utils::hash(precision_options(), key);
+    _path = dir.value() + "/" + utils::to_hex(key) + ".txt";
+
+    load();
+}
+
+size_t autotuner::local_size(const cl::Kernel &kernel, size_t n, const std::function<void(cl::Kernel&)> &bind) {
+    if(!_enabled || n == 0) return 0;
+
+    std::string name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+    std::string key = "local/" + name + "/" + std::to_string(utils::nearest_power_of_two(static_cast<uint>(n)));
+
+    auto it = _results.find(key);
+    if(it != _results.end()) return std::stoul(it->second);
+
+    cl::Kernel k = kernel;
+    bind(k);
+
+    size_t max = k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(_context._device);
+    size_t multiple = std::max<size_t>(1, k.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(_context._device));
+
+    // No point in work groups larger than the padded range
+    size_t limit = std::min(max, (n + multiple - 1) / multiple * multiple);
+
+    size_t best = 0;
+    double best_time = time([&]() { _context.enqueue_kernel(k, cl::NDRange(n), cl::NullRange, "autotune"); });
+
+    for(size_t local = multiple; local <= limit; local *= 2) {
+        double t = time([&]() { _context.enqueue_kernel(k, global_range(n, local), local_range(local), "autotune"); });
+        if(t < best_time) {
+            best = local;
+            best_time = t;
+        }
+    }
+
+    _results[key] = std::to_string(best);
+    save();
+    return best;
+}
+
+kernels::gemm_config autotuner::gemm() {
+    kernels::gemm_config fallback;
+    if(!_enabled) return fallback;
+
+    auto it = _results.find("gemm");
+    if(it != _results.end()) {
+        kernels::gemm_config cached;
+        std::istringstream(it->second) >> cached.tile >> cached.work_per_thread;
+        return fits(cached) ? cached : fallback;
+    }
+
+    cl_uint batch = AUTOTUNE_GEMM_BATCH, rows = AUTOTUNE_GEMM_ROWS, cols = AUTOTUNE_GEMM_COLS;
+
+    // Every matrix argument gets the same zeroed scratch buffer, only the time matters
+    size_t elements = std::max({size_t(rows) * cols, size_t(batch) * rows, size_t(batch) * cols});
+    std::vector<unsigned char> zeros(elements * sizeof(VNN_FLOAT_TYPE), 0);
+    cl::Buffer scratch(_context._context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, zeros.size(), zeros.data());
+
+    kernels::gemm_config best = fallback;
+    double best_time = std::numeric_limits<double>::infinity();
+
+    for(const kernels::gemm_config &candidate : gemm_candidates) {
+        if(!fits(candidate)) continue;
+
+        cl::Kernel kernel = _context.get_vnn_kernels("", candidate).get().forward_kernel;
+
+        // Register heavy tiles can need more than the device gives a work group of this kernel
+        size_t group = size_t(candidate.group_size()) * candidate.group_size();
+        if(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(_context._device) < group) continue;
+
+        // Same arguments as vnn::record_forward
+        kernel.setArg(0, scratch);
+        kernel.setArg(1, scratch);
+        kernel.setArg(2, scratch);
+        kernel.setArg(3, sizeof(cl_uint), &rows);
+        kernel.setArg(4, sizeof(cl_uint), &cols);
+        kernel.setArg(5, scratch);
+        kernel.setArg(6, sizeof(cl_uint), &batch);
+
+        size_t g = candidate.group_size();
+        cl::NDRange global((cols + candidate.tile - 1) / candidate.tile * g, (batch + candidate.tile - 1) / candidate.tile * g);
+        double t = time([&]() { _context.enqueue_kernel(kernel, global, cl::NDRange(g, g), "autotune"); });
+
+        if(t < best_time) {
+            best = candidate;
+            best_time = t;
+        }
+    }
+
+    _results["gemm"] = std::to_string(best.tile) + " " + std::to_string(best.work_per_thread);
+    save();
+    return best;
+}
+
+double autotuner::throughput(const std::vector<uint> &shape) {
+    assert(shape.size() >= 2);
+
+    std::string key = "throughput";
+    for(uint n : shape) key += "/" + std::to_string(n);
+
+    auto it = _results.find(key);
+    if(it != _results.end()) return std::stod(it->second);
+
+    kernels::gemm_config gemm;
+    cl::Kernel kernel = _context.get_vnn_kernels("", gemm).get().forward_kernel;
+    size_t g = gemm.group_size();
+
+    cl_uint batch = THROUGHPUT_BATCH;
+    size_t widest = *std::max_element(ALL(shape));
+
+    // Zeroed weights of the widest layer, which the biases share, and two activation
+    // buffers the layers alternate between
+    std::vector<VNN_STORAGE_TYPE> zeros(widest * std::max<size_t>(widest, batch), VNN_STORAGE_TYPE(0));
+    size_t bytes = zeros.size() * sizeof(VNN_STORAGE_TYPE);
+    cl::Buffer weights(_context._context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes, zeros.data());
+    cl::Buffer activations[2] = {
+        cl::Buffer(_context._context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes, zeros.data()),
+        cl::Buffer(_context._context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes, zeros.data())
+    };
+
+    auto pass = [&]() {
+        _context.enqueue_write(
+            activations[0], false, 0, size_t(batch) * shape.front() * sizeof(VNN_STORAGE_TYPE), zeros.data(), "throughput"
+        );
+
+        // Same arguments as vnn::record_forward
+        for(size_t l = 0; l + 1 < shape.size(); l++) {
+            cl_uint rows = shape[l], cols = shape[l+1];
+            kernel.setArg(0, weights);
+            kernel.setArg(1, weights);
+            kernel.setArg(2, activations[l % 2]);
+            kernel.setArg(3, sizeof(cl_uint), &rows);
+            kernel.setArg(4, sizeof(cl_uint), &cols);
+            kernel.setArg(5, activations[(l + 1) % 2]);
+            kernel.setArg(6, sizeof(cl_uint), &batch);
+
+            cl::NDRange global((cols + gemm.tile - 1) / gemm.tile * g, (batch + gemm.tile - 1) / gemm.tile * g);
+            _context.enqueue_kernel(kernel, global, cl::NDRange(g, g), "throughput");
+        }
+    };
+
+    // A few passes tell how many fit in THROUGHPUT_SECONDS, those are the ones that count
+    double once = time(pass);
+    int runs = static_cast<int>(std::clamp(THROUGHPUT_SECONDS / once, 1.0, 1000.0));
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < runs; i++) pass();
+    _context._queue.finish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    double score = double(batch) * runs / seconds;
+    _results[key] = std::to_string(score);
+    save();
+    return score;
+}
+
+cl::NDRange autotuner::global_range(size_t n, size_t local) {
+    if(local == 0) return cl::NDRange(n);
+    return cl::NDRange((n + local - 1) / local * local);
+}
+
+cl::NDRange autotuner::local_range(size_t local) {
+    if(local == 0) return cl::NullRange;
+    return cl::NDRange(local);
+}
+
+// One key=value pair per line
+void autotuner::load() {
+    std::ifstream in(_path.value());
+    std::string line;
+    while(std::getline(in, line)) {
+        size_t eq = line.find('=');
+        if(eq != std::string::npos) _results[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+}
+
+void autotuner::save() {
+    if(!_path) return;
+
+    std::string contents;
+    for(auto &[key, value] : _results) contents += key + "=" + value + "\n";
+    utils::write_file(_path.value(), std::vector<unsigned char>(ALL(contents)));
+}
+
+double autotuner::time(const std::function<void()> &launch) {
+    launch();
+    _context._queue.finish();
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < AUTOTUNE_RUNS; i++) launch();
+    _context._queue.finish();
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / AUTOTUNE_RUNS;
+}
+
+bool autotuner::fits(const kernels::gemm_config &gemm) {
+    if(gemm.tile == 0 || gemm.work_per_thread == 0) return false;
+    if(gemm.tile % 4 != 0 || gemm.tile % gemm.work_per_thread != 0) return false;
+
+    size_t group = size_t(gemm.group_size()) * gemm.group_size();
+    if(group > _context._device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()) return false;
+
+    // Two padded tiles in local memory, see GEMM_LTS
+    size_t local_bytes = 2 * size_t(gemm.tile) * (gemm.tile + 1) * sizeof(VNN_FLOAT_TYPE);
+    return local_bytes <= _context._device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+}
@@ -1,72 +1,269 @@
 
 #include "clwrapper.hpp"
+#include "autotune.hpp"
+#include "utils.hpp"
 #include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
 
 using namespace lazyml;
 using namespace lazyml::clwrapper;
 
-bool less(cl::Device a, cl::Device b, SearchBy searchBy) {
-    cl_int x;
+// Network THROUGHPUT is measured on when the filter gives no shape, a mid sized classifier
+static const std::vector<uint> default_shape = {512, 512, 512, 10};
+
+// Strictly less, so the first of several equal devices wins
+static bool less(const cl::Device &a, const cl::Device &b, SearchBy searchBy) {
     switch(searchBy) {
-            case SearchBy::VRAM: 
-            return a.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &x) <= b.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &x);
-            case SearchBy::FREQ: 
-            return a.getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &x) <= b.getInfo(CL_DEVICE_MAX_CLOCK_FREQUENCY, &x);
+        case SearchBy::VRAM:
+            return a.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() < b.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+        case SearchBy::FREQ:
+            return a.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>() < b.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+        case SearchBy::THROUGHPUT:
+            break;
     }
 
-    // All cases covered by switch, we will never hit this case.
-    // Doesn't mean the compiler won't complain about it though.
+    // THROUGHPUT needs a benchmark and is compared by getBestDevice itself
     return false;
 }
 
-std::optional<cl::Device> getMaxByMemory(std::vector<cl::Device> &devices) {
-    auto max_it = std::max_element(devices.begin(), devices.end(), [&](cl::Device &a, cl::Device &b) {
-        return less(a, b, SearchBy::VRAM);
-    });
-    return *max_it;
+// LAZYML_DEVICE pins the device, either by its index in all_devices() or by part of its name
+static std::optional<cl::Device> pinned_device() {
+    const char* env = std::getenv("LAZYML_DEVICE");
+    if(!env || std::string(env).empty()) return std::nullopt;
+
+    std::string pin(env);
+    std::vector<cl::Device> devices = all_devices();
+
+    if(std::all_of(ALL(pin), [](unsigned char c) { return std::isdigit(c); })) {
+        size_t index = std::stoul(pin);
+        if(index < devices.size()) return devices[index];
+    } else {
+        for(const cl::Device &device : devices) {
+            if(device.getInfo<CL_DEVICE_NAME>().find(pin) != std::string::npos) return device;
+        }
+    }
+
+    std::cout << "LAZYML_DEVICE=" << pin << " matches no device, ignoring it\n";
+    return std::nullopt;
 }
 
-std::optional<cl::Device> getMaxByFrequency(std::vector<cl::Device> &devices) {
-    auto max_it = std::max_element(devices.begin(), devices.end(), [&](cl::Device &a, cl::Device &b) {
-        return less(a, b, SearchBy::FREQ);
+std::vector<cl::Device> clwrapper::all_devices(cl_device_type type) {
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+
+    std::vector<cl::Device> devices;
+    for(const cl::Platform &platform : platforms) {
+        // Left alone by platforms without a device of the type
+        std::vector<cl::Device> tmp;
+        platform.getDevices(type, &tmp);
+        devices.insert(devices.end(), tmp.begin(), tmp.end());
+    }
+
+    return devices;
+}
+
+std::optional<cl::Device> clwrapper::getBestDevice(SearchBy searchBy, const device_filter &filter) {
+    std::optional<cl::Device> pinned = pinned_device();
+    if(pinned) return pinned;
+
+    std::vector<cl::Device> candidates = all_devices(filter.type);
+    std::erase_if(candidates, [&](const cl::Device &device) {
+        return device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() < filter.min_memory;
     });
+    if(candidates.empty()) return std::nullopt;
+
+    if(searchBy != SearchBy::THROUGHPUT) {
+        return *std::max_element(ALL(candidates), [&](const cl::Device &a, const cl::Device &b) {
+            return less(a, b, searchBy);
+        });
+    }
 
-    return *max_it;
+    // Every device is benchmarked once per driver and shape, later runs read the score from the tuning cache
+    const std::vector<uint> &shape = filter.shape.empty() ? default_shape : filter.shape;
+    std::vector<double> scores;
+    for(const cl::Device &device : candidates) {
+        clcontext con(device);
+        scores.push_back(autotuner(con).throughput(shape));
+    }
+
+    return candidates[std::max_element(ALL(scores)) - scores.begin()];
 }
 
-std::optional<cl::Device> clwrapper::getBestDevice(SearchBy searchBy) {
+std::vector<cl::Device> clwrapper::split_device(cl::Device device, size_t parts) {
+    std::vector<cl::Device> sub_devices;
+    if(device.getInfo<CL_DEVICE_PARTITION_MAX_SUB_DEVICES>() < 2) return sub_devices;
 
-    // Fetch all OpenCL platforms
-    std::vector<cl::Platform> all_platforms;
-    cl::Platform::get(&all_platforms);
+    if(parts == 0) {
+        const cl_device_partition_property properties[] = {
+            CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+        };
+        if(device.createSubDevices(properties, &sub_devices) != CL_SUCCESS) sub_devices.clear();
+        return sub_devices;
+    }
 
+    cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    if(parts < 2 || parts > units) return sub_devices;
 
-    // Holds all devices for current platform
-    std::vector<cl::Device> all_devices;
+    const cl_device_partition_property properties[] = {
+        CL_DEVICE_PARTITION_EQUALLY, static_cast<cl_device_partition_property>(units / parts), 0
+    };
+    if(device.createSubDevices(properties, &sub_devices) != CL_SUCCESS) sub_devices.clear();
 
-    std::optional<cl::Device> candidate = std::nullopt;
-    for(const cl::Platform& platform : all_platforms) {
-        platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
-        if(all_devices.size() == 0) continue;
+    // Leftover compute units end up in one more, smaller sub-device, which is left out
+    if(sub_devices.size() > parts) sub_devices.resize(parts);
+    return sub_devices;
+}
 
-        std::optional<cl::Device> tmp;
-        switch(searchBy) {
-            case SearchBy::VRAM: 
-                tmp = getMaxByMemory(all_devices);
-                break;
-            case SearchBy::FREQ: 
-                tmp = getMaxByFrequency(all_devices);
-                break;
-        }
+cl_command_queue_properties clcontext::queue_properties(const cl::Device &device, bool profiling, bool out_of_order) {
+    cl_command_queue_properties properties = profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    if(!out_of_order) return properties;
+
+    // Queried through the C API, the bindings name the property differently depending on the OpenCL version
+    cl_command_queue_properties supported = 0;
+    clGetDeviceInfo(device(), CL_DEVICE_QUEUE_ON_HOST_PROPERTIES, sizeof(supported), &supported, nullptr);
+    return properties | (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+}
+
+// A barrier before a command without a wait list makes it wait for everything
+// enqueued so far, one after it makes everything enqueued later wait for it.
+// Back to back fenced commands share the barrier between them.
+bool clcontext::begin_command(const std::vector<cl::Event>* wait) {
+    if(!_out_of_order) return false;
+
+    if(wait) {
+        _fenced = false;
+        return false;
+    }
+
+    if(!_fenced) barrier();
+    return true;
+}
+
+void clcontext::end_command(bool fenced) {
+    if(fenced) barrier();
+}
 
-        if(!candidate.has_value()) candidate = tmp;
-        else if(tmp.has_value() && less(tmp.value(), candidate.value(), searchBy)) candidate = tmp;
+void clcontext::barrier() {
+    _queue.enqueueBarrierWithWaitList();
+    _fenced = true;
+    _barriers++;
+}
+
+// Times the enqueue call itself when profiling, the host side cost of a command
+template<typename F>
+static void timed(std::optional<profiler> &prof, F enqueue) {
+    if(!prof) {
+        enqueue();
+        return;
     }
 
-    all_platforms.clear();
-    all_devices.clear();
+    auto start = std::chrono::steady_clock::now();
+    enqueue();
+    prof->add_host_time(std::chrono::steady_clock::now() - start);
+}
+
+void clcontext::enqueue_kernel(
+    const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+    const std::string &name, int layer,
+    const std::vector<cl::Event>* wait, cl::Event* done
+) {
+    bool fenced = begin_command(wait);
+    cl::Event* event = _profiler ? _profiler->record(command_kind::KERNEL, name, layer) : done;
+    timed(_profiler, [&]() {
+        _queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, wait, event);
+    });
+    end_command(fenced);
+
+    if(_profiler && done) *done = *event;
+}
 
-    return candidate;
+void clcontext::enqueue_write(
+    const cl::Buffer &buffer, bool blocking, size_t offset, size_t bytes, const void* ptr,
+    const std::string &name
+) {
+    bool fenced = begin_command(nullptr);
+    cl::Event* event = _profiler ? _profiler->record(command_kind::WRITE, name, -1, bytes) : nullptr;
+    timed(_profiler, [&]() {
+        // Need to convert std bool to cl_bool
+        _queue.enqueueWriteBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, offset, bytes, ptr, nullptr, event);
+    });
+    end_command(fenced);
 }
 
+void clcontext::enqueue_read(
+    const cl::Buffer &buffer, bool blocking, size_t offset, size_t bytes, void* ptr,
+    const std::string &name, cl::Event* done
+) {
+    bool fenced = begin_command(nullptr);
+    cl::Event* event = _profiler ? _profiler->record(command_kind::READ, name, -1, bytes) : done;
+    timed(_profiler, [&]() {
+        _queue.enqueueReadBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, offset, bytes, ptr, nullptr, event);
+    });
+    end_command(fenced);
+
+    if(_profiler && done) *done = *event;
+}
+
+void* clcontext::enqueue_map(
+    const cl::Buffer &buffer, bool blocking, cl_map_flags flags, size_t offset, size_t bytes,
+    const std::string &name
+) {
+    void* ptr = nullptr;
+    bool fenced = begin_command(nullptr);
+    cl::Event* event = _profiler ? _profiler->record(command_kind::MAP, name, -1, bytes) : nullptr;
+    timed(_profiler, [&]() {
+        ptr = _queue.enqueueMapBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, flags, offset, bytes, nullptr, event);
+    });
+    end_command(fenced);
+
+    return ptr;
+}
 
+void clcontext::enqueue_unmap(const cl::Buffer &buffer, void* ptr, const std::string &name, cl::Event* done) {
+    bool fenced = begin_command(nullptr);
+    cl::Event* event = _profiler ? _profiler->record(command_kind::UNMAP, name) : done;
+    timed(_profiler, [&]() {
+        _queue.enqueueUnmapMemObject(buffer, ptr, nullptr, event);
+    });
+    end_command(fenced);
+
+    if(_profiler && done) *done = *event;
+}
+
+const kernels::gemm_config& clcontext::gemm_config() {
+    if(!_gemm) _gemm = autotuner(*this).gemm();
+    return _gemm.value();
+}
+
+bool clcontext::shares_host_memory() const {
+    if(_device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) return true;
+
+    // Deprecated in OpenCL 2.0 and not exposed by the C++ bindings, but still reported by the drivers
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(_device(), CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, nullptr);
+    return unified == CL_TRUE;
+}
+
+size_t clcontext::base_address_alignment() const {
+    // Reported in bits
+    return _device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+}
+
+void clcontext::enqueue_copy(
+    const cl::Buffer &src, const cl::Buffer &dst, size_t src_offset, size_t dst_offset, size_t bytes,
+    const std::string &name,
+    const std::vector<cl::Event>* wait, cl::Event* done
+) {
+    bool fenced = begin_command(wait);
+    cl::Event* event = _profiler ? _profiler->record(command_kind::COPY, name, -1, bytes) : done;
+    timed(_profiler, [&]() {
+        _queue.enqueueCopyBuffer(src, dst, src_offset, dst_offset, bytes, wait, event);
+    });
+    end_command(fenced);
+
+    if(_profiler && done) *done = *event;
+}
@@ -0,0 +1,80 @@
+#include "data/idx.hpp"
+
+#include <iostream>
+
+using namespace lazyml;
+using namespace lazyml::data;
+
+// Size in bytes of every IDX data type
+static size_t element_size(uint8_t type) {
+    switch(type) {
+        case 0x08: // unsigned byte
+        case 0x09: // signed byte
+            return 1;
+        case 0x0B: // short
+            return 2;
+        case 0x0C: // int
+        case 0x0D: // float
+            return 4;
+        case 0x0E: // double
+            return 8;
+    }
+
+    return 0;
+}
+
+// The IDX format is big endian, the computer this is running on might not be
+static uint32_t read_big_endian(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+std::optional<idx_file> idx_file::open(const std::string &filepath) {
+    std::shared_ptr<const utils::mapped_file> file = utils::mapped_file::open(filepath);
+    if(!file) {
+        std::cout << "Could not open " << filepath << std::endl;
+        return std::nullopt;
+    }
+
+    const uint8_t* p = file->data();
+    size_t size = file->size();
+
+    // First two bytes of the magic number are always zero
+    if(size < 4 || p[0] != 0 || p[1] != 0 || element_size(p[2]) == 0 || p[3] == 0) {
+        std::cout << filepath << " is not an IDX file" << std::endl;
+        return std::nullopt;
+    }
+
+    idx_file idx;
+    idx._file = file;
+    idx._type = p[2];
+
+    size_t dimensions = p[3];
+    size_t header = 4 + 4*dimensions;
+    if(size < header) {
+        std::cout << filepath << " is truncated" << std::endl;
+        return std::nullopt;
+    }
+
+    size_t n = 1;
+    for(size_t i = 0; i < dimensions; i++) {
+        idx._dimensions.push_back(read_big_endian(p + 4 + 4*i));
+        n *= idx._dimensions.back();
+    }
+
+    if(idx._dimensions[0] == 0) {
+        std::cout << filepath << " contains no samples" << std::endl;
+        return std::nullopt;
+    }
+
+    // The header has to describe exactly the payload that follows it
+    size_t payload = n * element_size(idx._type);
+    if(size != header + payload) {
+        std::cout << filepath << ": header describes " << payload << " bytes, file has " << size - header << std::endl;
+        return std::nullopt;
+    }
+
+    idx._sample_size = n / idx._dimensions[0];
+    idx._bytes = {p + header, payload};
+
+    return idx;
+}
@@ -0,0 +1,57 @@
+#include "event_graph.hpp"
+
+using namespace lazyml;
+using namespace lazyml::clwrapper;
+
+void event_graph::enqueue_kernel(
+    const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+    const std::string &name, int layer, const buffer_access &access,
+    const std::vector<cl::Event>* wait
+) {
+    std::vector<cl::Event> deps = dependencies(access, wait);
+    cl::Event done;
+    _context.enqueue_kernel(kernel, global, local, name, layer, &deps, &done);
+    record(access, done);
+}
+
+std::vector<cl::Event> event_graph::dependencies(const buffer_access &access, const std::vector<cl::Event>* wait) {
+    prune();
+
+    std::vector<cl::Event> deps;
+    auto writer = [&](cl_mem buffer) {
+        auto it = _buffers.find(buffer);
+        if(it != _buffers.end() && it->second.writer()) deps.push_back(it->second.writer);
+        return it;
+    };
+
+    // Read after write
+    for(cl_mem buffer : access.reads) writer(buffer);
+
+    // Write after write and write after read
+    for(cl_mem buffer : access.writes) {
+        auto it = writer(buffer);
+        if(it != _buffers.end()) deps.insert(deps.end(), it->second.readers.begin(), it->second.readers.end());
+    }
+
+    if(wait) deps.insert(deps.end(), wait->begin(), wait->end());
+    return deps;
+}
+
+void event_graph::record(const buffer_access &access, const cl::Event &done) {
+    prune();
+
+    for(cl_mem buffer : access.reads) _buffers[buffer].readers.push_back(done);
+
+    for(cl_mem buffer : access.writes) {
+        buffer_state &state = _buffers[buffer];
+        state.writer = done;
+        state.readers.clear();
+    }
+}
+
+void event_graph::prune() {
+    if(_context.barrier_count() == _barriers) return;
+
+    _buffers.clear();
+    _barriers = _context.barrier_count();
+}
@@ -1,35 +1,91 @@
 
 #include "kernels.hpp"
 
+#include "precision.hpp"
 #include "utils.hpp"
 #include <functional>
 #include <optional>
 #include <cassert>
 #include <unistd.h>
 
+#ifdef LAZYML_EMBEDDED_KERNELS
+#include "cl_sources.hpp"
+#endif
+
 using namespace lazyml;
 using namespace kernels;
 
+static std::string vnn_source() {
+#ifdef LAZYML_EMBEDDED_KERNELS
+    return embedded::vanilla_nn_kernel;
+#else
+    return utils::file_to_string(KERNEL_VNN_SOURCE_PATH);
+#endif
+}
+
+static std::string utils_source() {
+#ifdef LAZYML_EMBEDDED_KERNELS
+    return embedded::utils;
+#else
+    return utils::file_to_string(KERNEL_UTILS_SOURCE_PATH);
+#endif
+}
+
+static std::string quantized_source() {
+#ifdef LAZYML_EMBEDDED_KERNELS
+    return embedded::quantized_kernel;
+#else
+    return utils::file_to_string(KERNEL_QUANTIZED_SOURCE_PATH);
+#endif
+}
+
+static std::string precision_source() {
+#ifdef LAZYML_EMBEDDED_KERNELS
+    return embedded::precision;
+#else
+    return utils::file_to_string(KERNEL_PRECISION_SOURCE_PATH);
+#endif
+}
+
+// Path of the cached binary for this device, source and build options
+static std::optional<std::string> cached_binary_path(
+    cl::Device device, const std::string &source, const std::string &options
+) {
+    auto dir = utils::cache_directory("programs");
+    if(!dir) return std::nullopt;
+
+    uint64_t key = utils::hash(PROGRAM_CACHE_VERSION);
+    key = utils::hash(device.getInfo<CL_DEVICE_NAME>(), key);
+    key = utils::hash(device.getInfo<CL_DEVICE_VERSION>(), key);
+    key = utils::hash(device.getInfo<CL_DRIVER_VERSION>(), key);
+    key = utils::hash(options, key);
+    key = utils::hash(source, key);
+
+    return dir.value() + "/" + utils::to_hex(key) + ".bin";
+}
+
 kernelloader::kernelloader() 
-:   _vnn(std::nullopt),
-    _utils(std::nullopt)
+:   _utils(std::nullopt)
 {}
 
 std::reference_wrapper<utils_kernels> kernelloader::get_utils_kernels(cl::Context context, cl::Device device) {
     if(!_utils.has_value()) {
         utils_kernels new_kernels = {};
 
-        std::string source = utils::file_to_string(KERNEL_UTILS_SOURCE_PATH);
+        std::string source = utils_source();
         assert(source.size() != 0 && "Could not find source");
 
-        new_kernels.program = cl::Program(context, source);
-
-        compile(new_kernels.program, device);
+        new_kernels.program = build(context, device, source, "");
 
         // ---
         new_kernels.zero = cl::Kernel(new_kernels.program, "zero");
         new_kernels.copy = cl::Kernel(new_kernels.program, "copy");
+        new_kernels.add = cl::Kernel(new_kernels.program, "add");
+        new_kernels.to_real = cl::Kernel(new_kernels.program, "to_real");
+        new_kernels.copy_u8 = cl::Kernel(new_kernels.program, "copy_u8");
+        new_kernels.one_hot = cl::Kernel(new_kernels.program, "one_hot");
         new_kernels.rand = cl::Kernel(new_kernels.program, "rand_buffer");
+        new_kernels.reduce_sum = cl::Kernel(new_kernels.program, "reduce_sum");
 
         _utils = new_kernels;
     }
@@ -37,34 +93,77 @@ std::reference_wrapper<utils_kernels> kernelloader::get_utils_kernels(cl::Contex
     return _utils.value();
 }
 
-std::reference_wrapper<vnn_kernels> kernelloader::get_vnn_kernels(cl::Context context, cl::Device device) {
-    if(!_vnn.has_value()) {
+std::string gemm_config::options() const {
+    return "-DGEMM_TS=" + std::to_string(tile) + " -DGEMM_WPT=" + std::to_string(work_per_thread);
+}
+
+std::reference_wrapper<vnn_kernels> kernelloader::get_vnn_kernels(
+    cl::Context context, cl::Device device, const std::string &extra_options, const gemm_config &gemm
+) {
+    std::string options = gemm.options();
+    if(!extra_options.empty()) options += " " + extra_options;
+
+    auto it = _vnn.find(options);
+    if(it == _vnn.end()) {
         vnn_kernels new_kernels = {};
 
-        std::string source = utils::file_to_string(KERNEL_VNN_SOURCE_PATH);
+        std::string source = vnn_source();
         assert(source.size() != 0 && "Could not find source");
 
-        new_kernels.program = cl::Program(context, source);
-
-        compile(new_kernels.program, device);
+        new_kernels.program = build(context, device, source, options);
 
         // ---
-        new_kernels.forward_kernel = cl::Kernel(new_kernels.program, "forward");
+        new_kernels.forward_kernel = cl::Kernel(new_kernels.program, "gemm_forward");
         new_kernels.cost_kernel = cl::Kernel(new_kernels.program, "cost");
+        new_kernels.softmax_kernel = cl::Kernel(new_kernels.program, "softmax");
 
         // Backprop kernels
         new_kernels.backprop_init_kernel = cl::Kernel(new_kernels.program, "backprop_delta_init");
-        new_kernels.backprop_step_kernel = cl::Kernel(new_kernels.program, "backprop_step");
+        new_kernels.backprop_step_kernel = cl::Kernel(new_kernels.program, "gemm_backprop");
+        new_kernels.backprop_gradient_kernel = cl::Kernel(new_kernels.program, "gemm_weight_gradient");
+        new_kernels.bias_gradient_kernel = cl::Kernel(new_kernels.program, "bias_gradient");
+
+        // Optimizers
         new_kernels.apply_gradient_kernel = cl::Kernel(new_kernels.program, "apply_gradient");
+        new_kernels.apply_momentum_kernel = cl::Kernel(new_kernels.program, "apply_momentum");
+        new_kernels.apply_adam_kernel = cl::Kernel(new_kernels.program, "apply_adam");
 
-        _vnn = new_kernels;
+        it = _vnn.emplace(options, new_kernels).first;
     }
 
-    return _vnn.value();
+    return it->second;
 }
 
-void kernelloader::compile(cl::Program program, cl::Device device) {
-    int status = program.build(device);
+std::reference_wrapper<quantized_kernels> kernelloader::get_quantized_kernels(
+    cl::Context context, cl::Device device, const std::string &extra_options
+) {
+    auto it = _quantized.find(extra_options);
+    if(it == _quantized.end()) {
+        quantized_kernels new_kernels = {};
+
+        // activate() and the activation defines come from the vnn source
+        std::string source = vnn_source() + "\n" + quantized_source();
+        assert(source.size() != 0 && "Could not find source");
+
+        std::string options = "-DQGEMM_TS=" + std::to_string(QGEMM_TILE_SIZE);
+        if(!extra_options.empty()) options += " " + extra_options;
+
+        new_kernels.program = build(context, device, source, options);
+
+        // ---
+        new_kernels.quantize_kernel = cl::Kernel(new_kernels.program, "quantize");
+        new_kernels.forward_kernel = cl::Kernel(new_kernels.program, "qgemm_forward");
+        new_kernels.output_kernel = cl::Kernel(new_kernels.program, "qgemm_output");
+        new_kernels.softmax_kernel = cl::Kernel(new_kernels.program, "qsoftmax");
+
+        it = _quantized.emplace(extra_options, new_kernels).first;
+    }
+
+    return it->second;
+}
+
+void kernelloader::compile(cl::Program program, cl::Device device, const std::string &options) {
+    int status = program.build(device, options.c_str());
 
     if(status != CL_SUCCESS) {
         std::cout << "Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
@@ -73,3 +172,45 @@ void kernelloader::compile(cl::Program program, cl::Device device) {
 
 }
 
+cl::Program kernelloader::build(
+    cl::Context context, cl::Device device,
+    const std::string &program_source, const std::string &program_options
+) {
+#if VNN_PRECISION == VNN_PRECISION_DOUBLE
+    if(device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_fp64") == std::string::npos) {
+        std::cout << "Double precision kernels need cl_khr_fp64, which " << device.getInfo<CL_DEVICE_NAME>() << " doesn't support\n";
+        std::exit(-1);
+    }
+#endif
+
+    const std::string source = precision_source() + "\n" + program_source;
+    const std::string options = precision_options().empty() ? program_options : precision_options() + " " + program_options;
+
+    std::optional<std::string> cache_path = cached_binary_path(device, source, options);
+
+    if(cache_path && utils::file_exists(cache_path.value())) {
+        std::string bytes = utils::file_to_string(cache_path.value());
+        cl::Program::Binaries binaries = { std::vector<unsigned char>(ALL(bytes)) };
+
+        // A driver update can make an old binary invalid, in that case it is simply rebuilt
+        std::vector<cl_int> binary_status;
+        cl_int err = CL_SUCCESS;
+        cl::Program program(context, {device}, binaries, &binary_status, &err);
+
+        if(err == CL_SUCCESS && program.build(device, options.c_str()) == CL_SUCCESS) {
+            return program;
+        }
+    }
+
+    cl::Program program(context, source);
+    compile(program, device, options);
+
+    if(cache_path) {
+        auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+        if(binaries.size() == 1 && binaries[0].size() > 0) {
+            utils::write_file(cache_path.value(), binaries[0]);
+        }
+    }
+
+    return program;
+}
@@ -0,0 +1,178 @@
+#include "launch_plan.hpp"
+#include <CL/cl_ext.h>
+
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+using namespace lazyml;
+using namespace lazyml::clwrapper;
+
+#ifdef cl_khr_command_buffer
+
+// Entry points of cl_khr_command_buffer, they have to be looked up per platform
+struct command_buffer_api {
+    clCreateCommandBufferKHR_fn create;
+    clCommandNDRangeKernelKHR_fn ndrange_kernel;
+    clFinalizeCommandBufferKHR_fn finalize;
+    clEnqueueCommandBufferKHR_fn enqueue;
+    clReleaseCommandBufferKHR_fn release;
+};
+
+template<typename F>
+static F lookup(cl_platform_id platform, const char* name) {
+    return reinterpret_cast<F>(clGetExtensionFunctionAddressForPlatform(platform, name));
+}
+
+// Empty if the device doesn't have the extension or it was turned off with LAZYML_COMMAND_BUFFER=0
+static std::optional<command_buffer_api> command_buffers(const cl::Device &device) {
+    const char* env = std::getenv("LAZYML_COMMAND_BUFFER");
+    if(env && std::string(env) == "0") return std::nullopt;
+
+    if(device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_command_buffer") == std::string::npos) return std::nullopt;
+
+    static std::mutex mutex;
+    static std::map<cl_platform_id, std::optional<command_buffer_api>> apis;
+
+    cl_platform_id platform = device.getInfo<CL_DEVICE_PLATFORM>();
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = apis.find(platform);
+    if(it != apis.end()) return it->second;
+
+    command_buffer_api api = {
+        lookup<clCreateCommandBufferKHR_fn>(platform, "clCreateCommandBufferKHR"),
+        lookup<clCommandNDRangeKernelKHR_fn>(platform, "clCommandNDRangeKernelKHR"),
+        lookup<clFinalizeCommandBufferKHR_fn>(platform, "clFinalizeCommandBufferKHR"),
+        lookup<clEnqueueCommandBufferKHR_fn>(platform, "clEnqueueCommandBufferKHR"),
+        lookup<clReleaseCommandBufferKHR_fn>(platform, "clReleaseCommandBufferKHR")
+    };
+
+    bool complete = api.create && api.ndrange_kernel && api.finalize && api.enqueue && api.release;
+    return apis[platform] = complete ? std::optional(api) : std::nullopt;
+}
+
+#endif
+
+launch_plan::launch_plan(clcontext &context, const std::string &name) :
+    _context(context),
+    _name(name)
+{}
+
+launch_plan::launch_plan(launch_plan &&other) noexcept :
+    _context(other._context),
+    _name(std::move(other._name)),
+    _launches(std::move(other._launches)),
+    _finalized(other._finalized),
+    _command_buffer(std::exchange(other._command_buffer, nullptr))
+{}
+
+launch_plan::~launch_plan() {
+#ifdef cl_khr_command_buffer
+    std::optional<command_buffer_api> api = _command_buffer ? command_buffers(_context._device) : std::nullopt;
+    if(api) api->release(static_cast<cl_command_buffer_khr>(_command_buffer));
+#endif
+}
+
+cl::Kernel& launch_plan::add(
+    const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+    const std::string &name, int layer
+) {
+    assert(!_finalized && "Launches can't be added to a finalized plan");
+
+    // A new kernel object from the same program, the arguments of the shared one stay untouched
+    cl::Kernel instance(kernel.getInfo<CL_KERNEL_PROGRAM>(), kernel.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str());
+    _launches.push_back({instance, global, local, name, layer});
+
+    return _launches.back().kernel;
+}
+
+void launch_plan::finalize() {
+    if(_finalized) return;
+    _finalized = true;
+
+    record_command_buffer();
+}
+
+void launch_plan::replay() {
+    assert(_finalized && "A plan has to be finalized before it is replayed");
+
+    if(_command_buffer && replay_command_buffer()) return;
+
+    for(const launch &l : _launches) {
+        _context.enqueue_kernel(l.kernel, l.global, l.local, l.name, l.layer);
+    }
+}
+
+void launch_plan::record_command_buffer() {
+#ifdef cl_khr_command_buffer
+    // Without sync points the commands of a buffer recorded on an out-of-order queue
+    // may run in any order, such plans replay their launches one by one
+    if(_context.out_of_order()) return;
+
+    std::optional<command_buffer_api> api = command_buffers(_context._device);
+    if(!api || _launches.empty()) return;
+
+    // Training enqueues the same plan again before the previous replay is done,
+    // which needs simultaneous use where the device can do it
+    cl_device_command_buffer_capabilities_khr capabilities = 0;
+    clGetDeviceInfo(
+        _context._device(), CL_DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR, sizeof(capabilities), &capabilities, nullptr
+    );
+    cl_command_buffer_properties_khr flags = 0;
+    if(capabilities & CL_COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR) flags = CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR;
+    cl_command_buffer_properties_khr properties[] = {CL_COMMAND_BUFFER_FLAGS_KHR, flags, 0};
+
+    cl_int err = CL_SUCCESS;
+    cl_command_queue queue = _context._queue();
+    cl_command_buffer_khr buffer = api->create(1, &queue, properties, &err);
+    if(err != CL_SUCCESS) return;
+
+    // Launches are recorded in order, the command buffer runs them in order like an in-order queue.
+    // Any failure leaves the plan replaying the launches one by one.
+    for(const launch &l : _launches) {
+        const size_t* local = l.local.dimensions() ? l.local.get() : nullptr;
+        err = api->ndrange_kernel(
+            buffer, nullptr, nullptr, l.kernel(), static_cast<cl_uint>(l.global.dimensions()),
+            nullptr, l.global.get(), local, 0, nullptr, nullptr, nullptr
+        );
+        if(err != CL_SUCCESS) break;
+    }
+
+    if(err == CL_SUCCESS) err = api->finalize(buffer);
+    if(err != CL_SUCCESS) {
+        api->release(buffer);
+        return;
+    }
+
+    _command_buffer = buffer;
+#endif
+}
+
+bool launch_plan::replay_command_buffer() {
+#ifdef cl_khr_command_buffer
+    std::optional<command_buffer_api> api = command_buffers(_context._device);
+    cl_command_queue queue = _context._queue();
+    cl::Event done;
+
+    auto start = std::chrono::steady_clock::now();
+    cl_int err = api->enqueue(
+        1, &queue, static_cast<cl_command_buffer_khr>(_command_buffer), 0, nullptr, _context.profiling() ? &done() : nullptr
+    );
+
+    if(_context.profiling()) {
+        _context.get_profiler().add_host_time(std::chrono::steady_clock::now() - start);
+        if(err == CL_SUCCESS) *_context.get_profiler().record(command_kind::KERNEL, _name) = done;
+    }
+
+    // Devices without simultaneous use refuse a command buffer that is still pending
+    return err == CL_SUCCESS;
+#else
+    return false;
+#endif
+}
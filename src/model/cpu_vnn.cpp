@@ -0,0 +1,613 @@
+#include "model/cpu_vnn.hpp"
+#include "model/serialization.hpp"
+#include "math/gemm.hpp"
+#include "math/math.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <type_traits>
+
+using namespace lazyml;
+using namespace lazyml::models;
+
+typedef VNN_FLOAT_TYPE T;
+
+static inline T sigmoid(T x) {
+    return T(1) / (T(1) + std::exp(-x));
+}
+
+// Note that the expected argument is sigmoid(x) and not x
+static inline T sigmoid_lazy_prime(T sigmoid_x) {
+    return sigmoid_x * (T(1) - sigmoid_x);
+}
+
+// Host versions of activate and activate_lazy_prime in cl/vanilla_nn_kernel.cl
+template<activation A>
+static inline T activate(T x) {
+    if constexpr(A == activation::SIGMOID) return sigmoid(x);
+    else if constexpr(A == activation::RELU) return x > 0 ? x : T(0);
+    else if constexpr(A == activation::LEAKY_RELU) return x > 0 ? x : T(LEAKY_RELU_SLOPE)*x;
+    else if constexpr(A == activation::TANH) return std::tanh(x);
+    else return x;
+}
+
+// The expected argument is activate(x) and not x
+template<activation A>
+static inline T activate_lazy_prime(T y) {
+    if constexpr(A == activation::SIGMOID) return sigmoid_lazy_prime(y);
+    else if constexpr(A == activation::RELU) return y > 0 ? T(1) : T(0);
+    else if constexpr(A == activation::LEAKY_RELU) return y > 0 ? T(1) : T(LEAKY_RELU_SLOPE);
+    else if constexpr(A == activation::TANH) return T(1) - y*y;
+    else return T(1);
+}
+
+// Calls f with the activation as a compile time constant, like the kernels
+// the loops over the neurons are specialized and have no branch on it
+template<typename F>
+static void dispatch(activation a, F &&f) {
+    switch(a) {
+        case activation::SIGMOID: f(std::integral_constant<activation, activation::SIGMOID>()); break;
+        case activation::RELU: f(std::integral_constant<activation, activation::RELU>()); break;
+        case activation::LEAKY_RELU: f(std::integral_constant<activation, activation::LEAKY_RELU>()); break;
+        case activation::TANH: f(std::integral_constant<activation, activation::TANH>()); break;
+        case activation::LINEAR: f(std::integral_constant<activation, activation::LINEAR>()); break;
+        case activation::SOFTMAX: f(std::integral_constant<activation, activation::SOFTMAX>()); break;
+    }
+}
+
+// Numerically stable softmax of a row, in place
+static void softmax(T* a, size_t n) {
+    T m = *std::max_element(a, a + n);
+
+    T sum = 0;
+    for(size_t j = 0; j < n; j++) {
+        a[j] = std::exp(a[j] - m);
+        sum += a[j];
+    }
+
+    for(size_t j = 0; j < n; j++) a[j] /= sum;
+}
+
+cpu_vnn::cpu_vnn(std::vector<uint> &arch, size_t threads)
+: cpu_vnn(arch, {}, threads) {}
+
+cpu_vnn::cpu_vnn(std::vector<uint> &arch, const std::vector<activation> &activations, size_t threads)
+: _neurons_per_layer(arch), _layers(arch.size()), _batch_capacity(0), _pool(threads), _rng(std::rand()),
+  _epoch(0), _checkpoint_interval(0) {
+    assert(_layers > 1);
+
+    _layer_activations = resolve_activations(activations, _layers);
+    assert((_layer_activations.back() != activation::SOFTMAX || arch.back() > 1) && "Softmax needs more than one output");
+
+    this->allocate();
+
+    // Same initialization as the device buffers of vnn
+    for(auto &w : _weights) for(T &x : w) x = math::rand_float();
+    for(auto &b : _biases) for(T &x : b) x = math::rand_float();
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        initialize_layer(_layer_activations[l], arch[l], arch[l+1], _weights[l].data(), _biases[l].data());
+    }
+}
+
+cpu_vnn::cpu_vnn(const std::string &filename, size_t threads)
+: cpu_vnn(serialization::read<T>(filename), threads) {}
+
+cpu_vnn::cpu_vnn(const serialization::network<T> &net, size_t threads)
+: _batch_capacity(0), _pool(threads), _rng(std::rand()), _epoch(0), _checkpoint_interval(0) {
+    _neurons_per_layer = std::vector<uint>(ALL(net.neurons_per_layer));
+    _layers = _neurons_per_layer.size();
+    _layer_activations = resolve_activations(net.activations, _layers);
+
+    this->allocate();
+
+    _weights = net.weights;
+    _biases = net.biases;
+
+    if(net.state) {
+        _epoch = net.state->epoch;
+        std::istringstream(net.state->rng) >> _rng;
+
+        std::optional<optimizer> opt = optimizer::parse(net.state->optimizer_config);
+        if(opt) {
+            this->set_optimizer(opt.value());
+            _step = net.state->step;
+
+            for(size_t k = 0; k < opt->state_buffers(); k++) {
+                for(size_t l = 0; l < _layers-1; l++) {
+                    _weights_state[k][l] = net.state->optimizer.at(serialization::optimizer_tensor(k, "weights", l));
+                    _biases_state[k][l] = net.state->optimizer.at(serialization::optimizer_tensor(k, "biases", l));
+                    assert(_weights_state[k][l].size() == _weights[l].size() && _biases_state[k][l].size() == _biases[l].size());
+                }
+            }
+        }
+    }
+}
+
+void cpu_vnn::allocate() {
+    for(size_t l = 1; l < _layers; l++) {
+        assert(_neurons_per_layer[l] != 0 && "Neuron layer cannot have 0 neurons");
+
+        size_t rows = _neurons_per_layer[l-1];
+        size_t cols = _neurons_per_layer[l];
+
+        _weights.emplace_back(rows * cols, 0);
+        _weight_gradients.emplace_back(rows * cols, 0);
+        _biases.emplace_back(cols, 0);
+        _bias_gradients.emplace_back(cols, 0);
+    }
+
+    _activations.resize(_layers);
+    _deltas.resize(_layers);
+    this->reserve_batch(1);
+}
+
+void cpu_vnn::reserve_batch(size_t batch) {
+    if(batch <= _batch_capacity) return;
+
+    for(size_t l = 0; l < _layers; l++) {
+        _activations[l].resize(batch * _neurons_per_layer[l]);
+        _deltas[l].resize(batch * _neurons_per_layer[l]);
+    }
+
+    _batch_capacity = batch;
+}
+
+void cpu_vnn::run(std::span<const T> input, std::vector<T> &output) {
+    assert(input.size() == _neurons_per_layer[0]);
+
+    std::copy(ALL(input), _activations[0].begin());
+    this->forward(1);
+
+    size_t output_sz = _neurons_per_layer[_layers-1];
+    output.assign(_activations[_layers-1].begin(), _activations[_layers-1].begin() + output_sz);
+}
+
+void cpu_vnn::run(clwrapper::memory<T>& input, std::vector<T> &output) {
+    this->run(std::span<const T>(input.host_data(), input.size()), output);
+}
+
+std::vector<T> cpu_vnn::run(clwrapper::memory<T>& input) {
+    std::vector<T> output;
+    this->run(input, output);
+    return output;
+}
+
+void cpu_vnn::train(
+    std::span<const T> inputs,
+    std::span<const T> targets,
+    uint iterations,
+    T learning_rate,
+    uint batch_size
+) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t output_sz = _neurons_per_layer[_layers-1];
+
+    size_t n = inputs.size() / input_sz;
+    assert(inputs.size() == n * input_sz);
+    assert(targets.size() == n * output_sz);
+
+    auto input = [&](size_t i) { return inputs.data() + i*input_sz; };
+    auto target = [&](size_t i) { return targets.data() + i*output_sz; };
+
+    this->train(n, input, target, iterations, learning_rate, batch_size);
+}
+
+void cpu_vnn::train(
+    std::vector<clwrapper::memory<T>>& input,
+    std::vector<clwrapper::memory<T>>& output,
+    uint iterations,
+    T learning_rate
+) {
+    assert(input.size() == output.size());
+
+    auto in = [&](size_t i) { return (const T*)input[i].host_data(); };
+    auto out = [&](size_t i) { return (const T*)output[i].host_data(); };
+
+    // One batch containing the entire data set
+    this->train(input.size(), in, out, iterations, learning_rate, static_cast<uint>(input.size()));
+}
+
+void cpu_vnn::train(
+    data::dataset<T>& data,
+    uint iterations,
+    T learning_rate,
+    uint batch_size
+) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+    assert(data.output_size() == _neurons_per_layer[_layers-1]);
+
+    if(data.compact()) {
+        auto [inputs, targets] = decode(data);
+        this->train(inputs, targets, iterations, learning_rate, batch_size);
+        return;
+    }
+
+    auto in = [&](size_t i) { return (const T*)data.input(i).data(); };
+    auto out = [&](size_t i) { return (const T*)data.target(i).data(); };
+
+    this->train(data.size(), in, out, iterations, learning_rate, batch_size);
+}
+
+// Unlike vnn's dataset overload, gathering samples is free on the host,
+// so the samples are always shuffled individually
+void cpu_vnn::train(
+    size_t n,
+    const sample_source& input,
+    const sample_source& target,
+    uint iterations,
+    T learning_rate,
+    uint batch_size
+) {
+    assert(n > 0);
+    assert(batch_size > 0);
+
+    size_t chunk_size = std::min<size_t>({batch_size, n, CPU_VNN_MAX_BATCH_CHUNK});
+    this->reserve_batch(chunk_size);
+
+    std::vector<size_t> order(n);
+    std::iota(ALL(order), 0);
+
+    std::vector<const T*> targets(chunk_size);
+
+    for(uint epoch = 1; epoch <= iterations; epoch++) {
+        if(batch_size < n) std::shuffle(ALL(order), _rng);
+
+        for(size_t batch_start = 0; batch_start < n; batch_start += batch_size) {
+            size_t batch_end = std::min<size_t>(batch_start + batch_size, n);
+
+            this->zero_gradient();
+
+            for(size_t chunk_start = batch_start; chunk_start < batch_end; chunk_start += chunk_size) {
+                size_t chunk = std::min(chunk_size, batch_end - chunk_start);
+
+                this->load(input, order, chunk_start, chunk);
+                for(size_t b = 0; b < chunk; b++) targets[b] = target(order[chunk_start + b]);
+
+                this->forward(chunk);
+                this->backprop(chunk, targets);
+            }
+
+            this->apply_gradient(batch_end - batch_start, learning_rate);
+        }
+
+        if(_progress_out) *_progress_out << epoch << "/" << iterations << "\n";
+
+        _epoch++;
+        if(_checkpoint_interval != 0 && _epoch % _checkpoint_interval == 0) this->checkpoint(_checkpoint_file);
+    }
+}
+
+T cpu_vnn::cost(std::vector<clwrapper::memory<T>>& input, std::vector<clwrapper::memory<T>>& output) {
+    assert(input.size() == output.size());
+
+    auto in = [&](size_t i) { return (const T*)input[i].host_data(); };
+    auto out = [&](size_t i) { return (const T*)output[i].host_data(); };
+
+    return this->evaluate(input.size(), in, out).cost;
+}
+
+T cpu_vnn::cost(data::dataset<T>& data) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+    assert(data.output_size() == _neurons_per_layer[_layers-1]);
+
+    if(data.compact()) {
+        auto [inputs, targets] = decode(data);
+        return this->evaluate(inputs, targets).cost;
+    }
+
+    auto in = [&](size_t i) { return (const T*)data.input(i).data(); };
+    auto out = [&](size_t i) { return (const T*)data.target(i).data(); };
+
+    return this->evaluate(data.size(), in, out).cost;
+}
+
+cpu_vnn::evaluation cpu_vnn::evaluate(std::span<const T> inputs, std::span<const T> targets) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t output_sz = _neurons_per_layer[_layers-1];
+
+    size_t n = inputs.size() / input_sz;
+    assert(inputs.size() == n * input_sz);
+    assert(targets.size() == n * output_sz);
+
+    auto input = [&](size_t i) { return inputs.data() + i*input_sz; };
+    auto target = [&](size_t i) { return targets.data() + i*output_sz; };
+
+    return this->evaluate(n, input, target);
+}
+
+void cpu_vnn::trace(std::span<const T> inputs, const layer_visitor& visit) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t n = inputs.size() / input_sz;
+    assert(n > 0 && inputs.size() == n * input_sz);
+
+    size_t chunk_size = std::min<size_t>(n, CPU_VNN_MAX_BATCH_CHUNK);
+    this->reserve_batch(chunk_size);
+
+    for(size_t first = 0; first < n; first += chunk_size) {
+        size_t count = std::min(chunk_size, n - first);
+
+        std::copy(inputs.begin() + first*input_sz, inputs.begin() + (first + count)*input_sz, _activations[0].begin());
+        this->forward(count);
+
+        for(size_t l = 0; l < _layers; l++) {
+            visit(l, std::span<const T>(_activations[l].data(), count * _neurons_per_layer[l]));
+        }
+    }
+}
+
+cpu_vnn::evaluation cpu_vnn::evaluate(size_t n, const sample_source& input, const sample_source& target) {
+    assert(n > 0);
+
+    size_t chunk_size = std::min<size_t>(n, CPU_VNN_MAX_BATCH_CHUNK);
+    this->reserve_batch(chunk_size);
+
+    std::vector<size_t> order(n);
+    std::iota(ALL(order), 0);
+
+    size_t output_sz = _neurons_per_layer[_layers-1];
+    double err = 0;
+    size_t correct = 0;
+
+    const bool cross_entropy = _layer_activations.back() == activation::SOFTMAX;
+
+    for(size_t first = 0; first < n; first += chunk_size) {
+        size_t chunk = std::min(chunk_size, n - first);
+
+        this->load(input, order, first, chunk);
+        this->forward(chunk);
+
+        // Same rules as the cost kernel of vnn
+        for(size_t b = 0; b < chunk; b++) {
+            const T* a = _activations[_layers-1].data() + b*output_sz;
+            const T* y = target(first + b);
+
+            size_t a_max = 0, y_max = 0;
+            for(size_t j = 0; j < output_sz; j++) {
+                if(cross_entropy) {
+                    err -= y[j] * std::log(std::max(a[j], std::numeric_limits<T>::min()));
+                } else {
+                    T diff = a[j] - y[j];
+                    err += diff*diff;
+                }
+
+                if(a[j] > a[a_max]) a_max = j;
+                if(y[j] > y[y_max]) y_max = j;
+            }
+
+            if(output_sz == 1) correct += (a[0] >= T(0.5)) == (y[0] >= T(0.5));
+            else correct += a_max == y_max;
+        }
+    }
+
+    return {
+        static_cast<T>(err / static_cast<double>(n) / (cross_entropy ? 1.0 : static_cast<double>(output_sz))),
+        static_cast<T>(correct) / static_cast<T>(n)
+    };
+}
+
+std::pair<std::vector<T>, std::vector<T>> cpu_vnn::decode(data::dataset<T>& data) {
+    std::vector<T> inputs(data.size() * data.input_size());
+    std::vector<T> targets(data.size() * data.output_size());
+
+    for(size_t i = 0; i < data.size(); i++) {
+        data.decode_input(i, inputs.data() + i*data.input_size());
+        data.decode_target(i, targets.data() + i*data.output_size());
+    }
+
+    return {std::move(inputs), std::move(targets)};
+}
+
+void cpu_vnn::load(const sample_source& input, const std::vector<size_t>& order, size_t first, size_t count) {
+    size_t input_sz = _neurons_per_layer[0];
+
+    _pool.parallel_for(count, [&](size_t b0, size_t b1) {
+        for(size_t b = b0; b < b1; b++) {
+            const T* x = input(order[first + b]);
+            std::copy(x, x + input_sz, _activations[0].begin() + b*input_sz);
+        }
+    }, 16);
+}
+
+void cpu_vnn::forward(size_t batch) {
+    assert(batch <= _batch_capacity);
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        size_t rows = _neurons_per_layer[l];
+        size_t cols = _neurons_per_layer[l+1];
+
+        const T* A = _activations[l].data();
+        const T* W = _weights[l].data();
+        const T* B = _biases[l].data();
+        T* out = _activations[l+1].data();
+
+        // out = activate(A * W + B), every thread gets a range of samples
+        dispatch(_layer_activations[l], [&](auto a) {
+            _pool.parallel_for(batch, [&](size_t b0, size_t b1) {
+                math::gemm_nn(b0, b1, cols, rows, A, W, out, false);
+
+                for(size_t b = b0; b < b1; b++) {
+                    for(size_t j = 0; j < cols; j++) out[b*cols + j] = activate<a>(out[b*cols + j] + B[j]);
+                    if constexpr(a == activation::SOFTMAX) softmax(out + b*cols, cols);
+                }
+            });
+        });
+    }
+}
+
+void cpu_vnn::backprop(size_t batch, const std::vector<const T*>& targets) {
+    assert(batch <= _batch_capacity);
+
+    // Deltas of the output layer: 2 * (aL - y) * activate'(aL), or aL - y for softmax with cross entropy
+    dispatch(_layer_activations.back(), [&](auto act) {
+        size_t cols = _neurons_per_layer[_layers-1];
+        const T* A = _activations[_layers-1].data();
+        T* D = _deltas[_layers-1].data();
+
+        for(size_t b = 0; b < batch; b++) {
+            const T* y = targets[b];
+            for(size_t j = 0; j < cols; j++) {
+                T a = A[b*cols + j];
+                if constexpr(act == activation::SOFTMAX) D[b*cols + j] = a - y[j];
+                else D[b*cols + j] = T(2) * (a - y[j]) * activate_lazy_prime<act>(a);
+            }
+        }
+    });
+
+    for(size_t l = _layers-1; l > 0; l--) {
+        size_t cols = _neurons_per_layer[l];
+        size_t rows = _neurons_per_layer[l-1];
+
+        const T* prevA = _activations[l-1].data();
+        const T* D = _deltas[l].data();
+        const T* W = _weights[l-1].data();
+        T* gW = _weight_gradients[l-1].data();
+        T* gB = _bias_gradients[l-1].data();
+
+        // gW += prevA^T * delta, every thread gets a range of weight rows
+        _pool.parallel_for(rows, [&](size_t k0, size_t k1) {
+            math::gemm_tn(k0, k1, cols, batch, rows, prevA, D, gW, true);
+        });
+
+        // gB += sum of the deltas over the batch
+        for(size_t b = 0; b < batch; b++) {
+            for(size_t j = 0; j < cols; j++) gB[j] += D[b*cols + j];
+        }
+
+        // The input layer has no use for its deltas
+        if(l == 1) break;
+
+        // prevDelta = (delta * W^T) (.) activate'(prevA), with the activation of the previous layer
+        T* prevD = _deltas[l-1].data();
+        dispatch(_layer_activations[l-2], [&](auto a) {
+            _pool.parallel_for(batch, [&](size_t b0, size_t b1) {
+                math::gemm_nt(b0, b1, rows, cols, D, W, prevD, false);
+
+                for(size_t b = b0; b < b1; b++) {
+                    for(size_t k = 0; k < rows; k++) prevD[b*rows + k] *= activate_lazy_prime<a>(prevA[b*rows + k]);
+                }
+            });
+        });
+    }
+}
+
+void cpu_vnn::apply_gradient(size_t n, T learning_rate) {
+    _step++;
+
+    const T scale = T(1) / static_cast<T>(n);
+    const T lr = _optimizer.kind == optimizer_kind::ADAM ? _optimizer.adam_learning_rate(learning_rate, _step) : learning_rate;
+
+    const T mu = _optimizer.momentum;
+    const T beta1 = _optimizer.beta1, beta2 = _optimizer.beta2, epsilon = _optimizer.epsilon;
+    const optimizer_kind kind = _optimizer.kind;
+
+    // Same update as the kernels of vnn, element i of P with gradient G and state S0/S1
+    auto update = [&](T* P, const T* G, T* S0, T* S1, size_t i0, size_t i1) {
+        for(size_t i = i0; i < i1; i++) {
+            const T g = G[i] * scale;
+
+            switch(kind) {
+                case optimizer_kind::SGD:
+                    P[i] -= lr * g;
+                    break;
+
+                case optimizer_kind::MOMENTUM:
+                case optimizer_kind::NESTEROV:
+                    S0[i] = mu*S0[i] + g;
+                    P[i] -= lr * (kind == optimizer_kind::NESTEROV ? g + mu*S0[i] : S0[i]);
+                    break;
+
+                case optimizer_kind::ADAM:
+                    S0[i] = beta1*S0[i] + (T(1) - beta1)*g;
+                    S1[i] = beta2*S1[i] + (T(1) - beta2)*g*g;
+                    P[i] -= lr * S0[i] / (std::sqrt(S1[i]) + epsilon);
+                    break;
+            }
+        }
+    };
+
+    auto state = [&](auto &buffers, size_t k, size_t l) -> T* {
+        return k < _optimizer.state_buffers() ? buffers[k][l].data() : nullptr;
+    };
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        T* W = _weights[l].data();
+        const T* gW = _weight_gradients[l].data();
+        T* SW0 = state(_weights_state, 0, l);
+        T* SW1 = state(_weights_state, 1, l);
+
+        _pool.parallel_for(_weights[l].size(), [&](size_t i0, size_t i1) {
+            update(W, gW, SW0, SW1, i0, i1);
+        }, 4096);
+
+        update(_biases[l].data(), _bias_gradients[l].data(), state(_biases_state, 0, l), state(_biases_state, 1, l), 0, _biases[l].size());
+    }
+}
+
+void cpu_vnn::set_optimizer(const optimizer &opt) {
+    _optimizer = opt;
+    _step = 0;
+
+    for(size_t k = 0; k < _weights_state.size(); k++) {
+        _weights_state[k].clear();
+        _biases_state[k].clear();
+        if(k >= opt.state_buffers()) continue;
+
+        for(size_t l = 0; l < _layers-1; l++) {
+            _weights_state[k].emplace_back(_weights[l].size(), 0);
+            _biases_state[k].emplace_back(_biases[l].size(), 0);
+        }
+    }
+}
+
+void cpu_vnn::zero_gradient() {
+    for(auto &g : _weight_gradients) std::fill(ALL(g), T(0));
+    for(auto &g : _bias_gradients) std::fill(ALL(g), T(0));
+}
+
+bool cpu_vnn::serialize(const std::string &filename) {
+    return write_model(filename, false);
+}
+
+bool cpu_vnn::checkpoint(const std::string &filename) {
+    return write_model(filename, true);
+}
+
+void cpu_vnn::checkpoint_every(uint epochs, const std::string &filename) {
+    _checkpoint_interval = epochs;
+    _checkpoint_file = filename;
+}
+
+bool cpu_vnn::write_model(const std::string &filename, bool with_state) {
+    serialization::network<T> net;
+    net.neurons_per_layer = std::vector<uint32_t>(ALL(_neurons_per_layer));
+    for(activation a : _layer_activations) net.activations.push_back(static_cast<uint32_t>(a));
+    net.weights = _weights;
+    net.biases = _biases;
+
+    if(with_state) {
+        serialization::training_state<T> state;
+        state.epoch = _epoch;
+
+        std::ostringstream rng;
+        rng << _rng;
+        state.rng = rng.str();
+
+        state.optimizer_config = _optimizer.to_string();
+        state.step = _step;
+        for(size_t k = 0; k < _optimizer.state_buffers(); k++) {
+            for(size_t l = 0; l < _layers-1; l++) {
+                state.optimizer[serialization::optimizer_tensor(k, "weights", l)] = _weights_state[k][l];
+                state.optimizer[serialization::optimizer_tensor(k, "biases", l)] = _biases_state[k][l];
+            }
+        }
+
+        net.state = state;
+    }
+
+    return serialization::write(filename, net);
+}
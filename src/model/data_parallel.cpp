@@ -0,0 +1,269 @@
+#include "model/data_parallel.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <numeric>
+
+using namespace lazyml;
+using namespace lazyml::models;
+
+using clock_type = std::chrono::steady_clock;
+
+static double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+data_parallel::data_parallel(
+    std::vector<std::reference_wrapper<clwrapper::clcontext>> contexts,
+    std::vector<uint> &arch, const std::vector<activation> &activations
+) :
+    _contexts(std::move(contexts)),
+    _peer(false),
+    _rng(std::rand())
+{
+    assert(!_contexts.empty());
+
+    for(clwrapper::clcontext &con : _contexts) _replicas.push_back(std::make_unique<vnn>(con, arch, activations));
+    broadcast_parameters();
+
+    // Copies between the devices need every buffer in the same context, and a single
+    // add over the whole arena needs the same layout on every device
+    vnn &first = model();
+    cl::Context shared = _contexts.front().get()._context;
+    _peer = _replicas.size() > 1 && std::all_of(ALL(_replicas), [&](const std::unique_ptr<vnn> &r) {
+        return r->_context._context() == shared()
+            && r->_parameter_count == first._parameter_count
+            && r->_weight_offsets == first._weight_offsets
+            && r->_bias_offsets == first._bias_offsets;
+    });
+
+    if(_peer) {
+        for(size_t r = 1; r < _replicas.size(); r++) {
+            _scratch_d.emplace_back(shared, CL_MEM_READ_WRITE, sizeof(VNN_FLOAT_TYPE) * first._parameter_count);
+        }
+        _add_kernel = first._context.get_utils_kernels().get().add;
+
+        // Tuned on the scratch buffer, adding it to itself
+        cl_uint n = static_cast<cl_uint>(first._parameter_count);
+        _add_local = clwrapper::autotuner(first._context).local_size(_add_kernel, n, [&](cl::Kernel &kernel) {
+            kernel.setArg(0, _scratch_d.front());
+            kernel.setArg(1, _scratch_d.front());
+            kernel.setArg(2, sizeof(cl_uint), &n);
+        });
+    } else {
+        for(const std::unique_ptr<vnn> &r : _replicas) _host_gradients.emplace_back(r->_parameter_count);
+    }
+}
+
+void data_parallel::set_data(std::span<const VNN_FLOAT_TYPE> inputs, std::span<const VNN_FLOAT_TYPE> targets) {
+    vnn &first = model();
+    size_t input_size = first._neurons_per_layer.front();
+    size_t output_size = first._neurons_per_layer.back();
+
+    _data.clear();
+    for(clwrapper::clcontext &con : _contexts) _data.emplace_back(con, inputs, targets, input_size, output_size);
+}
+
+void data_parallel::set_optimizer(const optimizer &opt) {
+    for(std::unique_ptr<vnn> &r : _replicas) r->set_optimizer(opt);
+}
+
+data_parallel::report data_parallel::train(uint iterations, VNN_FLOAT_TYPE learning_rate, uint batch_size) {
+    assert(!_data.empty() && "set_data has to be called before training");
+    assert(batch_size > 0);
+
+    const size_t k = _replicas.size();
+    const size_t n = _data.front().size();
+    report result = {k, n * iterations, 0, 0};
+
+    // Every replica gets at most a k-th of a batch, pushed through in chunks like vnn::train
+    size_t shard_size = (batch_size + k - 1) / k;
+    cl_uint chunk_size = static_cast<cl_uint>(std::min<size_t>({shard_size, n, VNN_MAX_BATCH_CHUNK}));
+    for(std::unique_ptr<vnn> &r : _replicas) r->reserve_batch(chunk_size);
+
+    // Batches are contiguous ranges of the data set, their order is reshuffled every epoch
+    std::vector<size_t> order((n + batch_size - 1) / batch_size);
+    std::iota(ALL(order), 0);
+
+    auto start = clock_type::now();
+
+    for(uint epoch = 1; epoch <= iterations; epoch++) {
+        std::shuffle(ALL(order), _rng);
+
+        for(size_t b : order) {
+            size_t batch_start = b * batch_size;
+            size_t batch_end = std::min<size_t>(batch_start + batch_size, n);
+            size_t samples = batch_end - batch_start;
+
+            for(size_t r = 0; r < k; r++) {
+                vnn &replica = *_replicas[r];
+                size_t shard_start = batch_start + samples * r / k;
+                size_t shard_end = batch_start + samples * (r + 1) / k;
+
+                replica.zero_gradient();
+
+                for(size_t chunk_start = shard_start; chunk_start < shard_end; chunk_start += chunk_size) {
+                    cl_uint chunk = static_cast<cl_uint>(std::min<size_t>(chunk_size, shard_end - chunk_start));
+
+                    replica.load_samples(_data[r].input_slice(chunk_start, chunk));
+                    replica.load_targets(_data[r].target_slice(chunk_start, chunk));
+                    replica.train_step(chunk);
+                }
+
+                // Every device starts on its shard before the host waits for any of them
+                replica._context._queue.flush();
+            }
+
+            auto reduce_start = clock_type::now();
+            all_reduce();
+            result.reduce_seconds += seconds_since(reduce_start);
+
+            // Every replica applies the sum of all shards, scaled by the whole batch
+            for(std::unique_ptr<vnn> &r : _replicas) r->apply_gradient(static_cast<cl_uint>(samples), learning_rate);
+        }
+
+        if(_progress_out) *_progress_out << epoch << "/" << iterations << "\n";
+        for(std::unique_ptr<vnn> &r : _replicas) r->_epoch++;
+    }
+
+    for(clwrapper::clcontext &con : _contexts) con._queue.finish();
+    result.seconds = seconds_since(start);
+
+    // The updates are the same everywhere but rounding may differ between devices,
+    // the first replica is the one that counts
+    broadcast_parameters();
+
+    for(clwrapper::clcontext &con : _contexts) con.report();
+    return result;
+}
+
+void data_parallel::all_reduce() {
+    if(_replicas.size() == 1) return;
+
+    if(_peer) peer_all_reduce();
+    else host_all_reduce();
+}
+
+void data_parallel::peer_all_reduce() {
+    vnn &first = model();
+    clwrapper::clcontext &root = first._context;
+    cl_uint n = static_cast<cl_uint>(first._parameter_count);
+    size_t bytes = sizeof(VNN_FLOAT_TYPE) * first._parameter_count;
+
+    // Gather: the gradients of every other replica are added into the first one's
+    // on its device, once the replica is done computing them
+    for(size_t r = 1; r < _replicas.size(); r++) {
+        vnn &replica = *_replicas[r];
+
+        cl::Event computed;
+        replica._context._queue.enqueueMarkerWithWaitList(nullptr, &computed);
+        replica._context._queue.flush();
+        std::vector<cl::Event> wait = {computed};
+
+        root.enqueue_copy(replica._gradients_d->get(), _scratch_d[r-1], 0, 0, bytes, "gather_gradient", &wait);
+
+        _add_kernel.setArg(0, first._gradients_d->get());
+        _add_kernel.setArg(1, _scratch_d[r-1]);
+        _add_kernel.setArg(2, sizeof(cl_uint), &n);
+        root.enqueue_kernel(
+            _add_kernel, clwrapper::autotuner::global_range(n, _add_local), clwrapper::autotuner::local_range(_add_local),
+            "add_gradient"
+        );
+    }
+
+    cl::Event reduced;
+    root._queue.enqueueMarkerWithWaitList(nullptr, &reduced);
+    root._queue.flush();
+
+    // Scatter: the sum goes back to every other replica on its own queue, so its
+    // update and next batch come after it
+    std::vector<cl::Event> wait = {reduced};
+    std::vector<cl::Event> scattered(_replicas.size() - 1);
+    for(size_t r = 1; r < _replicas.size(); r++) {
+        vnn &replica = *_replicas[r];
+        replica._context.enqueue_copy(
+            first._gradients_d->get(), replica._gradients_d->get(), 0, 0, bytes, "scatter_gradient", &wait, &scattered[r-1]
+        );
+        replica._context._queue.flush();
+    }
+
+    // The first replica zeroes its gradients for the next batch only once every copy has read them
+    root._queue.enqueueBarrierWithWaitList(&scattered);
+}
+
+// Adds the gradients of every layer of b into those of a, the arenas may be laid out differently
+static void add_tensors(
+    VNN_FLOAT_TYPE* a, const std::vector<size_t> &a_offsets,
+    const VNN_FLOAT_TYPE* b, const std::vector<size_t> &b_offsets,
+    const std::vector<size_t> &sizes
+) {
+    for(size_t t = 0; t < sizes.size(); t++) {
+        for(size_t i = 0; i < sizes[t]; i++) a[a_offsets[t] + i] += b[b_offsets[t] + i];
+    }
+}
+
+void data_parallel::host_all_reduce() {
+    // Offsets of every weight and bias tensor of a replica, weights first
+    auto offsets = [](const vnn &r) {
+        std::vector<size_t> o = r._weight_offsets;
+        o.insert(o.end(), ALL(r._bias_offsets));
+        return o;
+    };
+
+    vnn &first = model();
+    std::vector<size_t> sizes;
+    for(size_t l = 0; l < first._layers-1; l++) {
+        sizes.push_back(static_cast<size_t>(first._neurons_per_layer[l]) * first._neurons_per_layer[l+1]);
+    }
+    for(size_t l = 0; l < first._layers-1; l++) sizes.push_back(first._neurons_per_layer[l+1]);
+
+    // All reads are in flight at once, each one waits for its replica's backprop
+    std::vector<cl::Event> read(_replicas.size());
+    for(size_t r = 0; r < _replicas.size(); r++) {
+        vnn &replica = *_replicas[r];
+        replica._context.enqueue_read(
+            replica._gradients_d->get(), false, 0, sizeof(VNN_FLOAT_TYPE) * replica._parameter_count,
+            _host_gradients[r].data(), "read_gradient", &read[r]
+        );
+        replica._context._queue.flush();
+    }
+    cl::Event::waitForEvents(read);
+
+    std::vector<size_t> first_offsets = offsets(first);
+    for(size_t r = 1; r < _replicas.size(); r++) {
+        add_tensors(_host_gradients[0].data(), first_offsets, _host_gradients[r].data(), offsets(*_replicas[r]), sizes);
+    }
+
+    // The sum is written back in every replica's own layout. The writes don't block,
+    // the next reduce reads into the host copies only after they are done.
+    for(size_t r = 0; r < _replicas.size(); r++) {
+        vnn &replica = *_replicas[r];
+
+        if(r > 0) {
+            std::vector<size_t> replica_offsets = offsets(replica);
+            for(size_t t = 0; t < sizes.size(); t++) {
+                std::copy_n(
+                    _host_gradients[0].data() + first_offsets[t], sizes[t], _host_gradients[r].data() + replica_offsets[t]
+                );
+            }
+        }
+
+        replica._context.enqueue_write(
+            replica._gradients_d->get(), false, 0, sizeof(VNN_FLOAT_TYPE) * replica._parameter_count,
+            _host_gradients[r].data(), "write_gradient"
+        );
+    }
+}
+
+void data_parallel::broadcast_parameters() {
+    if(_replicas.size() == 1) return;
+
+    serialization::network<VNN_FLOAT_TYPE> net = model().to_network();
+    for(size_t r = 1; r < _replicas.size(); r++) _replicas[r]->set_parameters(net);
+}
+
+double data_parallel::scaling_efficiency(const report &single, const report &parallel) {
+    return parallel.samples_per_second() / single.samples_per_second() / parallel.replicas;
+}
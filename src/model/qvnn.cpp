@@ -0,0 +1,312 @@
+#include "model/qvnn.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+using namespace lazyml;
+using namespace lazyml::models;
+
+typedef VNN_FLOAT_TYPE T;
+
+static size_t argmax(const T* x, size_t n) {
+    return std::max_element(x, x + n) - x;
+}
+
+static size_t round_up(size_t x, size_t multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+qvnn::qvnn(clwrapper::clcontext& con, const serialization::network<T> &net, std::span<const T> calibration)
+: _context(con), _batch_capacity(0) {
+    this->quantize(net, calibration);
+    this->init();
+}
+
+qvnn::qvnn(clwrapper::clcontext& con, vnn &model, std::span<const T> calibration)
+: qvnn(con, model.to_network(), calibration) {}
+
+qvnn::qvnn(clwrapper::clcontext& con, const std::string &filename, std::span<const T> calibration)
+: qvnn(con, serialization::read<T>(filename), calibration) {}
+
+void qvnn::quantize(const serialization::network<T> &net, std::span<const T> calibration) {
+    _neurons_per_layer = std::vector<cl_uint>(ALL(net.neurons_per_layer));
+    _layers = _neurons_per_layer.size();
+    assert(_layers > 1);
+    _layer_activations = resolve_activations(net.activations, _layers);
+
+    // Range of the input of every weight layer over the calibration samples
+    std::vector<T> lo(_layers - 1, 0), hi(_layers - 1, 0);
+    cpu_vnn reference(net);
+    reference.trace(calibration, [&](size_t l, std::span<const T> a) {
+        if(l + 1 >= _layers) return;
+
+        auto [min, max] = std::minmax_element(ALL(a));
+        lo[l] = std::min(lo[l], *min);
+        hi[l] = std::max(hi[l], *max);
+    });
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        size_t rows = _neurons_per_layer[l];
+        size_t cols = _neurons_per_layer[l+1];
+        size_t k = padded(rows);
+
+        // The range always contains 0, so 0 is exactly representable and the zero point fits a byte
+        T input_scale = (hi[l] - lo[l]) / T(255);
+        if(input_scale <= 0) input_scale = 1;
+        cl_int zero_point = static_cast<cl_int>(std::clamp<long>(std::lround(-lo[l] / input_scale), 0, 255));
+
+        // Filled once on the host, mapped in place where the device shares its memory
+        clwrapper::memory_mode mode = clwrapper::preferred_memory_mode(_context);
+        layer q = {
+            clwrapper::memory<cl_char>(_context, false, cols * k, mode),
+            clwrapper::memory<cl_int>(_context, false, cols, mode),
+            clwrapper::memory<T>(_context, false, cols, mode),
+            clwrapper::memory<T>(_context, false, cols, mode),
+            input_scale,
+            zero_point
+        };
+
+        // Symmetric per neuron scales, the largest weight of a neuron maps to +-127
+        const T* W = net.weights[l].data();
+        for(size_t j = 0; j < cols; j++) {
+            T m = 0;
+            for(size_t r = 0; r < rows; r++) m = std::max(m, std::abs(W[r*cols + j]));
+            T weight_scale = m > 0 ? m / T(127) : T(1);
+
+            cl_int sum = 0;
+            for(size_t r = 0; r < rows; r++) {
+                cl_char w = static_cast<cl_char>(std::clamp<long>(std::lround(W[r*cols + j] / weight_scale), -127, 127));
+                q.weights[j*k + r] = w;
+                sum += w;
+            }
+
+            q.weight_sums[j] = sum;
+            q.scales[j] = input_scale * weight_scale;
+            q.biases[j] = net.biases[l][j];
+        }
+
+        q.weights.write_to_device(false);
+        q.weight_sums.write_to_device(false);
+        q.scales.write_to_device(false);
+        q.biases.write_to_device(false);
+
+        _layer_data.push_back(std::move(q));
+    }
+}
+
+void qvnn::init() {
+    // Like vnn, layers with the same activation share a program
+    for(activation a : _layer_activations) {
+        kernels::quantized_kernels &k = _context.get_quantized_kernels(activation_options(a)).get();
+        _forward_kernels.push_back(k.forward_kernel);
+        _output_kernels.push_back(k.output_kernel);
+    }
+
+    kernels::quantized_kernels &output = _context.get_quantized_kernels(activation_options(_layer_activations.back())).get();
+    _quantize_kernel = output.quantize_kernel;
+    _softmax_kernel = output.softmax_kernel;
+
+    _integer_dot = _context._device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_integer_dot_product") != std::string::npos;
+
+    this->reserve_batch(1);
+}
+
+void qvnn::reserve_batch(cl_uint batch) {
+    if(batch <= _batch_capacity) return;
+
+    // Make sure nothing is still using the old buffers
+    _context._queue.finish();
+
+    _activations_d.clear();
+    for(size_t l = 0; l < _layers-1; l++) {
+        _activations_d.emplace_back(
+            clwrapper::memory<cl_uchar>(_context, false, size_t(batch) * padded(_neurons_per_layer[l]), clwrapper::memory_mode::DEVICE)
+        );
+    }
+
+    _input_d.emplace(_context, false, size_t(batch) * _neurons_per_layer[0], clwrapper::memory_mode::DEVICE);
+    _output_d.emplace(_context, false, size_t(batch) * _neurons_per_layer[_layers-1], clwrapper::memory_mode::DEVICE);
+
+    _batch_capacity = batch;
+}
+
+void qvnn::forward(cl_uint batch) {
+    assert(batch <= _batch_capacity);
+
+    cl_uint input_sz = _neurons_per_layer[0];
+    cl_uint stride = padded(input_sz);
+    T inv_scale = T(1) / _layer_data[0].input_scale;
+    _quantize_kernel.setArg(0, _activations_d[0].get());
+    _quantize_kernel.setArg(1, sizeof(cl_uint), &stride);
+    _quantize_kernel.setArg(2, _input_d->get());
+    _quantize_kernel.setArg(3, sizeof(cl_uint), &input_sz);
+    _quantize_kernel.setArg(4, sizeof(cl_uint), &batch);
+    _quantize_kernel.setArg(5, sizeof(T), &inv_scale);
+    _quantize_kernel.setArg(6, sizeof(cl_int), &_layer_data[0].input_zero_point);
+    _context.enqueue_kernel(_quantize_kernel, cl::NDRange(input_sz, batch), cl::NullRange, "quantize");
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        layer &q = _layer_data[l];
+        bool last = l == _layers-2;
+        cl::Kernel &kernel = last ? _output_kernels[l] : _forward_kernels[l];
+
+        cl_uint rows = _neurons_per_layer[l];
+        cl_uint cols = _neurons_per_layer[l+1];
+        cl_uint k4 = padded(rows) / 4;
+
+        kernel.setArg(0, q.weights.get());
+        kernel.setArg(1, q.weight_sums.get());
+        kernel.setArg(2, q.scales.get());
+        kernel.setArg(3, q.biases.get());
+        kernel.setArg(4, _activations_d[l].get());
+        kernel.setArg(5, sizeof(cl_uint), &k4);
+        kernel.setArg(6, sizeof(cl_uint), &cols);
+        kernel.setArg(7, sizeof(cl_uint), &batch);
+        kernel.setArg(8, sizeof(cl_int), &q.input_zero_point);
+
+        if(last) {
+            kernel.setArg(9, _output_d->get());
+        } else {
+            layer &next = _layer_data[l+1];
+            cl_uint out_stride = padded(cols);
+            T out_inv_scale = T(1) / next.input_scale;
+            kernel.setArg(9, _activations_d[l+1].get());
+            kernel.setArg(10, sizeof(cl_uint), &out_stride);
+            kernel.setArg(11, sizeof(T), &out_inv_scale);
+            kernel.setArg(12, sizeof(cl_int), &next.input_zero_point);
+        }
+
+        cl::NDRange global(round_up(cols, QGEMM_TILE_SIZE), round_up(batch, QGEMM_TILE_SIZE));
+        cl::NDRange local(QGEMM_TILE_SIZE, QGEMM_TILE_SIZE);
+        _context.enqueue_kernel(kernel, global, local, last ? "qgemm_output" : "qgemm_forward", static_cast<int>(l));
+    }
+
+    if(_layer_activations.back() == activation::SOFTMAX) {
+        cl_uint cols = _neurons_per_layer[_layers-1];
+        _softmax_kernel.setArg(0, _output_d->get());
+        _softmax_kernel.setArg(1, sizeof(cl_uint), &cols);
+        _softmax_kernel.setArg(2, sizeof(cl_uint), &batch);
+        _context.enqueue_kernel(_softmax_kernel, cl::NDRange(batch), cl::NullRange, "softmax", static_cast<int>(_layers-2));
+    }
+}
+
+void qvnn::run(std::span<const T> inputs, std::vector<T> &outputs) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t output_sz = _neurons_per_layer[_layers-1];
+
+    size_t n = inputs.size() / input_sz;
+    assert(n > 0 && inputs.size() == n * input_sz);
+    outputs.resize(n * output_sz);
+
+    cl_uint chunk_size = static_cast<cl_uint>(std::min<size_t>(n, VNN_MAX_BATCH_CHUNK));
+    this->reserve_batch(chunk_size);
+
+    for(size_t first = 0; first < n; first += chunk_size) {
+        cl_uint count = static_cast<cl_uint>(std::min<size_t>(chunk_size, n - first));
+
+        // The blocking read at the end of the chunk also waits for the upload
+        _context.enqueue_write(
+            _input_d->get(), false, 0, sizeof(T) * count * input_sz, inputs.data() + first * input_sz, "write_input"
+        );
+        this->forward(count);
+        _context.enqueue_read(
+            _output_d->get(), true, 0, sizeof(T) * count * output_sz, outputs.data() + first * output_sz, "read_output"
+        );
+    }
+}
+
+std::vector<T> qvnn::run(clwrapper::memory<T>& input) {
+    assert(input.size() == _neurons_per_layer[0]);
+
+    size_t output_sz = _neurons_per_layer[_layers-1];
+    std::vector<T> output(output_sz);
+
+    _context.enqueue_copy(input.get(), _input_d->get(), 0, 0, sizeof(T) * input.size(), "copy_input");
+    this->forward(1);
+    _context.enqueue_read(_output_d->get(), true, 0, sizeof(T) * output_sz, output.data(), "read_output");
+
+    return output;
+}
+
+qvnn::report qvnn::compare(cpu_vnn &reference, std::span<const T> inputs, std::span<const T> targets) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t output_sz = _neurons_per_layer[_layers-1];
+
+    size_t n = inputs.size() / input_sz;
+    assert(n > 0 && inputs.size() == n * input_sz);
+    assert(targets.size() == n * output_sz);
+
+    std::vector<T> quantized;
+    this->run(inputs, quantized);
+
+    std::vector<T> expected;
+    expected.reserve(n * output_sz);
+    reference.trace(inputs, [&](size_t l, std::span<const T> a) {
+        if(l + 1 == _layers) expected.insert(expected.end(), ALL(a));
+    });
+
+    report r = {};
+    r.samples = n;
+
+    size_t reference_correct = 0, quantized_correct = 0, agree = 0;
+    double error_sum = 0;
+    for(size_t i = 0; i < n; i++) {
+        const T* y = targets.data() + i*output_sz;
+        const T* e = expected.data() + i*output_sz;
+        const T* q = quantized.data() + i*output_sz;
+
+        size_t label = argmax(y, output_sz);
+        size_t e_label = argmax(e, output_sz);
+        size_t q_label = argmax(q, output_sz);
+        reference_correct += e_label == label;
+        quantized_correct += q_label == label;
+        agree += e_label == q_label;
+
+        for(size_t j = 0; j < output_sz; j++) {
+            T error = std::abs(e[j] - q[j]);
+            r.max_error = std::max(r.max_error, error);
+            error_sum += error;
+        }
+    }
+
+    r.reference_accuracy = T(reference_correct) / T(n);
+    r.quantized_accuracy = T(quantized_correct) / T(n);
+    r.agreement = T(agree) / T(n);
+    r.mean_error = static_cast<T>(error_sum / double(n * output_sz));
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        r.reference_bytes += sizeof(T) * (size_t(_neurons_per_layer[l]) * _neurons_per_layer[l+1] + _neurons_per_layer[l+1]);
+    }
+    r.quantized_bytes = this->parameter_bytes();
+
+    return r;
+}
+
+qvnn::report qvnn::compare(cpu_vnn &reference, data::dataset<T>& data, size_t samples) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+    assert(data.output_size() == _neurons_per_layer[_layers-1]);
+
+    size_t n = samples == 0 ? data.size() : std::min(samples, data.size());
+    std::vector<T> inputs(n * data.input_size());
+    std::vector<T> targets(n * data.output_size());
+
+    for(size_t i = 0; i < n; i++) {
+        data.decode_input(i, inputs.data() + i*data.input_size());
+        data.decode_target(i, targets.data() + i*data.output_size());
+    }
+
+    return this->compare(reference, inputs, targets);
+}
+
+size_t qvnn::parameter_bytes() const {
+    size_t bytes = 0;
+    for(const layer &q : _layer_data) {
+        bytes += sizeof(cl_char) * q.weights.size() + sizeof(cl_int) * q.weight_sums.size();
+        bytes += sizeof(T) * (q.scales.size() + q.biases.size());
+    }
+
+    return bytes;
+}
@@ -1,102 +1,152 @@
 
 #include "model/vnn.hpp"
+#include "model/serialization.hpp"
 #include "utils.hpp"
 #include <CL/cl.h>
 #include <CL/cl_platform.h>
 #include <CL/opencl.hpp>
 
 #include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <fstream>
 #include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <thread>
 
 using namespace lazyml;
 using namespace lazyml::models;
 
-vnn::vnn(clwrapper::clcontext& con, std::vector<uint> &arch) 
-: model(con) {
+// Global range of a GEMM kernel computing a [rows x cols] output,
+// every work group covers a gemm.tile x gemm.tile block
+static cl::NDRange gemm_global_range(const kernels::gemm_config &gemm, size_t rows, size_t cols) {
+    size_t row_groups = (rows + gemm.tile - 1) / gemm.tile;
+    size_t col_groups = (cols + gemm.tile - 1) / gemm.tile;
+    return cl::NDRange(col_groups * gemm.group_size(), row_groups * gemm.group_size());
+}
+
+static cl::NDRange gemm_local_range(const kernels::gemm_config &gemm) {
+    return cl::NDRange(gemm.group_size(), gemm.group_size());
+}
+
+// Every batch_size samples of n from the start, the last batch may be shorter
+static std::vector<std::pair<size_t, size_t>> contiguous_batches(size_t n, uint batch_size) {
+    std::vector<std::pair<size_t, size_t>> batches;
+    for(size_t first = 0; first < n; first += batch_size) batches.emplace_back(first, std::min<size_t>(first + batch_size, n));
+    return batches;
+}
+
+// Ranges of an element wise launch over n items with a local size from vnn::tune
+static cl::NDRange global_range(size_t n, size_t local) { return clwrapper::autotuner::global_range(n, local); }
+static cl::NDRange local_range(size_t local) { return clwrapper::autotuner::local_range(local); }
+
+vnn::vnn(clwrapper::clcontext& con, std::vector<uint> &arch, const std::vector<activation> &activations) 
+: _context(con), _batch_capacity(0), _rng(std::rand()), _epoch(0), _checkpoint_interval(0) {
 
     const size_t n = arch.size();
     assert(n > 1);
     _layers = n;
 
     _neurons_per_layer = arch;
+    _layer_activations = resolve_activations(activations, n);
+    assert((_layer_activations.back() != activation::SOFTMAX || arch.back() > 1) && "Softmax needs more than one output");
 
     // n = total number of layers where input is also counted as a layer
+    for(size_t i = 0; i < n; i++) assert(arch[i] != 0 && "Neuron layer cannot have 0 neurons");
 
-    // n-1, since there isn't a weight matrix or bias column vector for the inputs
-    std::for_each(ALL(_biases_d), [n](auto &v){v.reserve(n-1);});
-    std::for_each(ALL(_weights_d), [n](auto &v){v.reserve(n-1);});
-
-    // n, since input is counted as a layer
-    std::for_each(ALL(_activations_d), [n](auto &v){v.reserve(n);});
-
-    bool shouldRandomize = true;
-
-    // Add input activation column vector
-    this->add_matrix_pairs(_activations_d, shouldRandomize, _neurons_per_layer[0]);
+    this->lay_out();
 
+    // The initial parameters are drawn on the host in VNN_FLOAT_TYPE, in the same
+    // order as cpu_vnn, and only then converted to the storage type
+    std::vector<std::vector<VNN_FLOAT_TYPE>> weights, biases;
     for(size_t i = 1; i < n; i++) {
-        assert(arch[i] != 0 && "Neuron layer cannot have 0 neurons");
+        weights.emplace_back(arch[i-1] * arch[i]);
+        biases.emplace_back(arch[i]);
+    }
 
-        // Add new weight matrix and randomize the initial weights
-        // Number of rows corresponds to the number of columns in the previous activation column vector
-        // Number of columns corresponds to the number of neurons in the current layer
-        size_t rows = arch[i-1];
-        size_t cols = arch[i];
-        size_t n = rows * cols;
-        this->add_matrix_pairs(_weights_d, n, shouldRandomize);
+    for(auto &w : weights) for(VNN_FLOAT_TYPE &x : w) x = math::rand_float();
+    for(auto &b : biases) for(VNN_FLOAT_TYPE &x : b) x = math::rand_float();
 
-        // Add new bias and randomize the initial biases
-        // Bias is a column vector with size corresponding to number of neurons in the current layer
-        this->add_matrix_pairs(_biases_d, cols, shouldRandomize);
+    std::vector<VNN_STORAGE_TYPE> parameters(_parameter_count, VNN_STORAGE_TYPE(0));
+    for(size_t l = 0; l < n-1; l++) {
+        initialize_layer(_layer_activations[l], arch[l], arch[l+1], weights[l].data(), biases[l].data());
 
-        // Activation is a column vector
-        // Same dimensions as bias
-        this->add_matrix_pairs(_activations_d, cols, shouldRandomize);
+        to_storage(weights[l].data(), parameters.data() + _weight_offsets[l], weights[l].size());
+        to_storage(biases[l].data(), parameters.data() + _bias_offsets[l], biases[l].size());
     }
 
+    this->allocate(parameters);
     this->init();
     this->write_to_device();
 }
 
-vnn::vnn(clwrapper::clcontext& con, const std::string &filename) : model(con) {
+vnn::vnn(clwrapper::clcontext& con, const std::string &filename, mode m)
+: _context(con), _inference(m == mode::INFERENCE), _batch_capacity(0), _rng(std::rand()), _epoch(0), _checkpoint_interval(0) {
     _context._queue.finish();
 
-    std::ifstream in(filename, std::ios::binary | std::ios::in);
-
-    uint16_t matrix_entry_size;
-    in.read(BYTE_PTR(matrix_entry_size), sizeof(uint16_t));
-
-    assert(matrix_entry_size == sizeof(VNN_FLOAT_TYPE));
-
-    uint16_t number_of_layers;
-    in.read(BYTE_PTR(number_of_layers), sizeof(uint16_t));
-    _layers = static_cast<size_t>(number_of_layers);
-
-    _neurons_per_layer.reserve(number_of_layers);
-    for(uint16_t i = 0; i < number_of_layers; i++) {
-        cl_uint output;
-        in.read(BYTE_PTR(output), sizeof(cl_uint));
-
-        _neurons_per_layer.emplace_back(output);
+    // Files in the current format are mapped and their tensors copied straight
+    // out of the mapping, legacy files still have to be read field by field
+    std::optional<serialization::model_file> file;
+    serialization::network<VNN_FLOAT_TYPE> legacy;
+    if(serialization::is_model_file(filename)) {
+        file = utils::value_or_panic(serialization::open_network<VNN_FLOAT_TYPE>(filename), "Invalid model file " + filename);
+    } else {
+        legacy = utils::value_or_panic(serialization::read_legacy<VNN_FLOAT_TYPE>(filename), "Invalid model file " + filename);
     }
 
-    bool shouldRandomize = false;
+    const std::vector<uint32_t> &neurons = file ? file->neurons_per_layer() : legacy.neurons_per_layer;
+    _layers = neurons.size();
+    _neurons_per_layer = std::vector<cl_uint>(ALL(neurons));
+    _layer_activations = resolve_activations(file ? serialization::read_activations(file.value()) : legacy.activations, _layers);
 
-    this->add_matrix_pairs(_activations_d, _neurons_per_layer[0], shouldRandomize);
+    this->lay_out();
 
-    for(uint16_t i = 1; i < number_of_layers; i++) {
+    std::vector<VNN_STORAGE_TYPE> parameters(_parameter_count, VNN_STORAGE_TYPE(0));
+    for(size_t i = 1; i < _layers; i++) {
         cl_uint rows = _neurons_per_layer[i-1];
         cl_uint cols = _neurons_per_layer[i];
         cl_uint n = rows * cols;
 
-        this->add_matrix_pairs(_weights_d, n, shouldRandomize);
-        this->add_matrix_pairs(_biases_d, cols, shouldRandomize);
-        this->add_matrix_pairs(_activations_d, cols, shouldRandomize);
+        std::span<const VNN_FLOAT_TYPE> weights = file
+            ? file->tensor<VNN_FLOAT_TYPE>("weights." + std::to_string(i-1)) : legacy.weights[i-1];
+        std::span<const VNN_FLOAT_TYPE> biases = file
+            ? file->tensor<VNN_FLOAT_TYPE>("biases." + std::to_string(i-1)) : legacy.biases[i-1];
 
-        in.read((char*)_weights_d[MAIN_CL_BUFFERS][i-1].host_data(), n * sizeof(VNN_FLOAT_TYPE));
-        in.read((char*)_biases_d[MAIN_CL_BUFFERS][i-1].host_data(), cols * sizeof(VNN_FLOAT_TYPE));
+        to_storage(weights.data(), parameters.data() + _weight_offsets[i-1], n);
+        to_storage(biases.data(), parameters.data() + _bias_offsets[i-1], cols);
+    }
 
+    this->allocate(parameters);
+
+    // Checkpoints continue with the same epoch count and shuffling order
+    if(file) {
+        std::optional<serialization::training_state<VNN_FLOAT_TYPE>> state = serialization::read_state<VNN_FLOAT_TYPE>(file.value());
+        if(state) {
+            _epoch = state->epoch;
+            std::istringstream(state->rng) >> _rng;
+
+            std::optional<optimizer> opt = optimizer::parse(state->optimizer_config);
+            if(opt && !_inference) {
+                this->set_optimizer(opt.value());
+                _step = state->step;
+
+                for(size_t k = 0; k < opt->state_buffers(); k++) {
+                    VNN_FLOAT_TYPE* arena = _state_d[k]->host_data();
+                    for(size_t l = 0; l < _layers-1; l++) {
+                        // Present with the layer's sizes, checked by open_network
+                        const std::vector<VNN_FLOAT_TYPE> &w = state->optimizer.at(serialization::optimizer_tensor(k, "weights", l));
+                        const std::vector<VNN_FLOAT_TYPE> &b = state->optimizer.at(serialization::optimizer_tensor(k, "biases", l));
+
+                        std::copy(ALL(w), arena + _weight_offsets[l]);
+                        std::copy(ALL(b), arena + _bias_offsets[l]);
+                    }
+                    _state_d[k]->write_to_device(true);
+                    _state_d[k]->release_host();
+                }
+            }
+        }
     }
 
     this->init();
@@ -104,28 +154,117 @@ vnn::vnn(clwrapper::clcontext& con, const std::string &filename) : model(con) {
 }
 
 void vnn::init() {
+    // The programs below are built with these tile parameters
+    _gemm = _context.gemm_config();
+
+    // Every activation in use gets its own program, layers with the same activation share it
+    for(activation a : _layer_activations) {
+        kernels::vnn_kernels &k = _context.get_vnn_kernels(activation_options(a)).get();
+        _forward_kernels.push_back(k.forward_kernel);
+        _backprop_step_kernels.push_back(k.backprop_step_kernel);
+    }
 
-    // Set the NDRange of the kernel to the width of the widest matrix
-    // This is to ensure that there are enough threads to compute each matrix in parallel
-    uint max_column = *std::max_element(_neurons_per_layer.begin() + 1, _neurons_per_layer.end());
-    _kernel_range = cl::NDRange(max_column);
-
-    _cost_kernel = _context.get_vnn_kernels().get().cost_kernel;
-    _forward_kernel = _context.get_vnn_kernels().get().forward_kernel;
+    kernels::vnn_kernels &output = _context.get_vnn_kernels(activation_options(_layer_activations.back())).get();
+    _cost_kernel = output.cost_kernel;
+    _softmax_kernel = output.softmax_kernel;
+    _backprop_init_kernel = output.backprop_init_kernel;
 
-    _backprop_init_kernel = _context.get_vnn_kernels().get().backprop_init_kernel;
-    _backprop_step_kernel = _context.get_vnn_kernels().get().backprop_step_kernel;
+    _backprop_gradient_kernel = _context.get_vnn_kernels().get().backprop_gradient_kernel;
+    _bias_gradient_kernel = _context.get_vnn_kernels().get().bias_gradient_kernel;
 
     _apply_gradient_kernel = _context.get_vnn_kernels().get().apply_gradient_kernel;
+    _apply_momentum_kernel = _context.get_vnn_kernels().get().apply_momentum_kernel;
+    _apply_adam_kernel = _context.get_vnn_kernels().get().apply_adam_kernel;
     _zero_kernel = _context.get_utils_kernels().get().zero;
-    _copy_kernel = _context.get_utils_kernels().get().copy;
+    _reduce_sum_kernel = _context.get_utils_kernels().get().reduce_sum;
+    _copy_u8_kernel = _context.get_utils_kernels().get().copy_u8;
+    _one_hot_kernel = _context.get_utils_kernels().get().one_hot;
+    _to_real_kernel = _context.get_utils_kernels().get().to_real;
+
+    if(_context.out_of_order()) _graph.emplace(_context);
+
+    this->tune();
+}
 
+void vnn::tune() {
+    clwrapper::autotuner tuner(_context);
+
+    // Every buffer argument gets the same zeroed scratch buffer, large enough for
+    // the parameter arena and for a chunk of any layer's activations
+    size_t chunk = VNN_MAX_BATCH_CHUNK;
+    size_t widest = *std::max_element(ALL(_neurons_per_layer));
+    size_t elements = std::max(_parameter_count, widest * chunk);
+    std::vector<unsigned char> zeros(elements * sizeof(VNN_FLOAT_TYPE), 0);
+    cl::Buffer scratch(_context._context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, zeros.size(), zeros.data());
+
+    // Binds the first buffers arguments to the scratch buffer, followed by the unsigned
+    // and then the floating point values. The floats are 1 so that no update divides by zero.
+    auto bind = [&](cl_uint buffers, std::vector<cl_uint> uints, cl_uint floats) {
+        return [&scratch, buffers, uints, floats](cl::Kernel &kernel) {
+            cl_uint arg = 0;
+            for(cl_uint i = 0; i < buffers; i++) kernel.setArg(arg++, scratch);
+            for(cl_uint u : uints) kernel.setArg(arg++, sizeof(cl_uint), &u);
+            VNN_FLOAT_TYPE one = 1;
+            for(cl_uint i = 0; i < floats; i++) kernel.setArg(arg++, sizeof(VNN_FLOAT_TYPE), &one);
+        };
+    };
+
+    cl_uint n_parameters = static_cast<cl_uint>(_parameter_count);
+    cl_uint batch = static_cast<cl_uint>(chunk);
+    cl_uint inputs = _neurons_per_layer[0] * batch;
+    cl_uint outputs = _neurons_per_layer[_layers-1] * batch;
+
+    _local.zero = tuner.local_size(_zero_kernel, n_parameters, bind(1, {n_parameters}, 0));
+    if(_layer_activations.back() == activation::SOFTMAX) {
+        _local.softmax = tuner.local_size(_softmax_kernel, batch, bind(1, {_neurons_per_layer[_layers-1], batch}, 0));
+    }
+
+    // Loads of a chunk of samples, to_real is only used when the storage type differs
+    if constexpr(converted_storage) {
+        _local.to_real = tuner.local_size(_to_real_kernel, inputs, [&](cl::Kernel &kernel) {
+            cl_uint zero = 0;
+            kernel.setArg(0, scratch);
+            kernel.setArg(1, sizeof(cl_uint), &zero);
+            kernel.setArg(2, scratch);
+            kernel.setArg(3, sizeof(cl_uint), &zero);
+            kernel.setArg(4, sizeof(cl_uint), &inputs);
+        });
+    }
+    _local.copy_u8 = tuner.local_size(_copy_u8_kernel, inputs, bind(2, {0, inputs}, 1));
+    _local.one_hot = tuner.local_size(
+        _one_hot_kernel, outputs, bind(2, {0, _neurons_per_layer[_layers-1], outputs}, 0)
+    );
+
+    // The rest is only launched by training
+    if(_inference) return;
+
+    _local.apply_gradient = tuner.local_size(_apply_gradient_kernel, n_parameters, bind(2, {n_parameters}, 2));
+
+    // apply_momentum ends with the nesterov flag, apply_adam has its four scalars after n
+    _local.apply_momentum = tuner.local_size(_apply_momentum_kernel, n_parameters, [&](cl::Kernel &kernel) {
+        bind(3, {n_parameters}, 3)(kernel);
+        cl_uint nesterov = 0;
+        kernel.setArg(7, sizeof(cl_uint), &nesterov);
+    });
+    _local.apply_adam = tuner.local_size(_apply_adam_kernel, n_parameters, bind(4, {n_parameters}, 5));
+
+    _local.backprop_init = tuner.local_size(_backprop_init_kernel, outputs, bind(2, {outputs}, 0));
+
+    _local.bias_gradient.clear();
+    for(size_t l = 1; l < _layers; l++) {
+        cl_uint cols = _neurons_per_layer[l];
+        _local.bias_gradient.push_back(tuner.local_size(_bias_gradient_kernel, cols, bind(2, {cols, batch}, 0)));
+    }
 }
 
 vnn::~vnn() {}
 
 void vnn::run(clwrapper::memory<VNN_FLOAT_TYPE>& input, std::vector<VNN_FLOAT_TYPE> &output) {
-    forward(input.get());
+    assert(input.size() == _neurons_per_layer[0]);
+
+    // A single sample is a batch of one, its output is the first row of the output activations
+    load_sample(input, 0);
+    forward(1);
 
     size_t output_sz = static_cast<size_t>(_neurons_per_layer[_layers-1]);
 
@@ -133,9 +272,7 @@ void vnn::run(clwrapper::memory<VNN_FLOAT_TYPE>& input, std::vector<VNN_FLOAT_TY
     while(output.size() < output_sz) output.emplace_back(0);
 
     // Read output from last activation layer
-    _context._queue.enqueueReadBuffer(
-        _activations_d[MAIN_CL_BUFFERS][_layers-1].get(), CL_TRUE, 0, sizeof(VNN_FLOAT_TYPE)*output_sz, output.data()
-    );
+    read_output(1, output.data());
 }
 
 std::vector<VNN_FLOAT_TYPE> vnn::run(clwrapper::memory<VNN_FLOAT_TYPE>& input) {
@@ -153,6 +290,17 @@ void vnn::train(
     std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output,
     uint iterations,
     VNN_FLOAT_TYPE learning_rate
+) {
+    // One batch containing the entire data set
+    this->train(input, output, iterations, learning_rate, static_cast<uint>(input.size()));
+}
+
+void vnn::train(
+    std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
+    std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& output,
+    uint iterations,
+    VNN_FLOAT_TYPE learning_rate,
+    uint batch_size
 ) {
     assert(input.size() == output.size());
 
@@ -165,28 +313,422 @@ void vnn::train(
         assert(output[i].size() == output_sz);
     }
 
+    // Order in which the samples are visited, reshuffled every epoch
+    std::vector<size_t> order(n);
+    std::iota(ALL(order), 0);
+
+    // The samples are shuffled, the batches are contiguous ranges of positions in order
+    std::vector<batch_range> batches = contiguous_batches(n, batch_size);
+    auto shuffle = [&]() {
+        if(batch_size < n) std::shuffle(ALL(order), _rng);
+        return batches;
+    };
+
+    // Every sample is its own buffer, so they are copied into the batch one by one
+    auto load = [&](size_t position, cl_uint count) {
+        for(cl_uint b = 0; b < count; b++) {
+            this->load_sample(input[order[position + b]], b);
+            this->load_target(output[order[position + b]], b);
+        }
+    };
+
+    this->train(n, iterations, learning_rate, batch_size, shuffle, load);
+}
+
+void vnn::train(
+    data::dataset<VNN_FLOAT_TYPE>& data,
+    uint iterations,
+    VNN_FLOAT_TYPE learning_rate,
+    uint batch_size
+) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+    assert(data.output_size() == _neurons_per_layer[_layers-1]);
+    assert(batch_size > 0);
+
+    size_t n = data.size();
+
+    // Batches are contiguous ranges of the data set, visited in a different order every
+    // epoch. Only the last one may be shorter, wherever it ends up in the order.
+    std::vector<batch_range> batches = contiguous_batches(n, batch_size);
+    auto shuffle = [&]() {
+        std::shuffle(ALL(batches), _rng);
+        return batches;
+    };
+
+    // A chunk never crosses a batch boundary, so it is a contiguous range of
+    // the data set and can be loaded with a single copy
+    auto load = [&](size_t first, cl_uint count) {
+        this->load_samples(data.input_slice(first, count));
+        this->load_targets(data.target_slice(first, count));
+    };
+
+    this->train(n, iterations, learning_rate, batch_size, shuffle, load);
+}
+
+// Chunk of a streamed data set on its way to the device. The producer reads
+// into the pinned host memory and uploads it to inputs/targets, the training
+// loop then copies it into the activations.
+struct staging_slot {
+    cl::Buffer pinned_inputs, pinned_targets;
+    VNN_FLOAT_TYPE* host_inputs;
+    VNN_FLOAT_TYPE* host_targets;
+
+    cl::Buffer inputs, targets;
+
+    // The pinned memory can be reused once both uploads are done
+    cl::Event inputs_uploaded, targets_uploaded;
+    // The device buffers can be reused once both copies into the activations are done
+    cl::Event consumed;
+
+    // Samples [first, first + count) of the data set
+    size_t first;
+    cl_uint count;
+};
+
+void vnn::train(
+    data::source<VNN_FLOAT_TYPE>& data,
+    uint iterations,
+    VNN_FLOAT_TYPE learning_rate,
+    uint batch_size
+) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+    assert(data.output_size() == _neurons_per_layer[_layers-1]);
+    assert(batch_size > 0);
+
+    size_t n = data.size();
+    assert(n > 0);
+
+    // Has to match the chunks of the shared training loop
+    cl_uint chunk_size = static_cast<cl_uint>(std::min<size_t>({batch_size, n, VNN_MAX_BATCH_CHUNK}));
+    size_t input_bytes = sizeof(VNN_FLOAT_TYPE) * chunk_size * _neurons_per_layer[0];
+    size_t target_bytes = sizeof(VNN_FLOAT_TYPE) * chunk_size * _neurons_per_layer[_layers-1];
+
+    cl::CommandQueue &transfer = _context._transfer_queue;
+
+    // CL_MEM_ALLOC_HOST_PTR buffers stay mapped for the whole run, writes from
+    // them can be DMA'd without the driver staging them first
+    std::array<staging_slot, VNN_STREAM_SLOTS> slots;
+    for(staging_slot &slot : slots) {
+        slot.pinned_inputs = cl::Buffer(_context._context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, input_bytes);
+        slot.pinned_targets = cl::Buffer(_context._context, CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY, target_bytes);
+        slot.host_inputs = static_cast<VNN_FLOAT_TYPE*>(
+            transfer.enqueueMapBuffer(slot.pinned_inputs, CL_TRUE, CL_MAP_WRITE, 0, input_bytes)
+        );
+        slot.host_targets = static_cast<VNN_FLOAT_TYPE*>(
+            transfer.enqueueMapBuffer(slot.pinned_targets, CL_TRUE, CL_MAP_WRITE, 0, target_bytes)
+        );
+
+        slot.inputs = cl::Buffer(_context._context, CL_MEM_READ_ONLY, input_bytes);
+        slot.targets = cl::Buffer(_context._context, CL_MEM_READ_ONLY, target_bytes);
+    }
+
+    // Chunks handed out by the producer and taken by the training loop
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t produced = 0, consumed = 0;
+
+    // Batches are contiguous ranges visited in a shuffled order like the dataset overload.
+    // The producer and the training loop shuffle with copies of the same generator, so
+    // they walk the same batches and the producer's chunks are the ones the loop asks for.
+    std::vector<batch_range> batches = contiguous_batches(n, batch_size);
+    std::mt19937 producer_rng(_rng());
+    std::mt19937 consumer_rng = producer_rng;
+
+    std::thread producer([&, batches]() mutable {
+        size_t k = 0;
+        for(uint epoch = 1; epoch <= iterations; epoch++) {
+            std::shuffle(ALL(batches), producer_rng);
+
+            for(auto [batch_start, batch_end] : batches) {
+                for(size_t position = batch_start; position < batch_end; position += chunk_size, k++) {
+                    staging_slot &slot = slots[k % VNN_STREAM_SLOTS];
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [&]() { return k - consumed < VNN_STREAM_SLOTS; });
+                    }
+
+                    if(slot.targets_uploaded()) {
+                        slot.inputs_uploaded.wait();
+                        slot.targets_uploaded.wait();
+                    }
+
+                    slot.first = position;
+                    slot.count = static_cast<cl_uint>(std::min<size_t>(chunk_size, batch_end - position));
+                    data.read(slot.first, slot.count, slot.host_inputs, slot.host_targets);
+
+                    std::vector<cl::Event> wait;
+                    if(slot.consumed()) wait.push_back(slot.consumed);
+
+                    size_t in_bytes = sizeof(VNN_FLOAT_TYPE) * slot.count * _neurons_per_layer[0];
+                    size_t out_bytes = sizeof(VNN_FLOAT_TYPE) * slot.count * _neurons_per_layer[_layers-1];
+                    transfer.enqueueWriteBuffer(slot.inputs, CL_FALSE, 0, in_bytes, slot.host_inputs, &wait, &slot.inputs_uploaded);
+                    transfer.enqueueWriteBuffer(slot.targets, CL_FALSE, 0, out_bytes, slot.host_targets, &wait, &slot.targets_uploaded);
+                    transfer.flush();
+
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        produced = k + 1;
+                    }
+                    cv.notify_all();
+                }
+            }
+        }
+    });
+
+    auto load = [&]([[maybe_unused]] size_t first, cl_uint count) {
+        staging_slot &slot = slots[consumed % VNN_STREAM_SLOTS];
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return produced > consumed; });
+        }
+        assert(slot.first == first && slot.count == count);
+
+        // The uploads ran on the transfer queue, the profiler only sees commands of this thread
+        size_t in_bytes = sizeof(VNN_FLOAT_TYPE) * count * _neurons_per_layer[0];
+        size_t out_bytes = sizeof(VNN_FLOAT_TYPE) * count * _neurons_per_layer[_layers-1];
+        if(_context.profiling()) {
+            *_context.get_profiler().record(clwrapper::command_kind::WRITE, "stream_input", -1, in_bytes) = slot.inputs_uploaded;
+            *_context.get_profiler().record(clwrapper::command_kind::WRITE, "stream_target", -1, out_bytes) = slot.targets_uploaded;
+        }
+
+        // The uploads are the last writers of the slot's buffers, so on an out-of-order queue
+        // anything the event graph orders after them waits for the transfer queue as well
+        if(_graph) {
+            _graph->record({{}, {slot.inputs()}}, slot.inputs_uploaded);
+            _graph->record({{}, {slot.targets()}}, slot.targets_uploaded);
+        }
+
+        // Both copies wait for both uploads, and the slot is free once both copies are done
+        std::vector<cl::Event> uploaded = {slot.inputs_uploaded, slot.targets_uploaded};
+        std::vector<cl::Event> copied(2);
+        copy_to_storage(
+            slot.inputs, 0, _activations_d[MAIN_CL_BUFFERS][0], 0, count * _neurons_per_layer[0], "copy_input",
+            &uploaded, &copied[0]
+        );
+        copy_to_storage(
+            slot.targets, 0, _activations_d[GRADIENT_CL_BUFFERS][_layers-1], 0, count * _neurons_per_layer[_layers-1],
+            "copy_target", &uploaded, &copied[1]
+        );
+        _context._queue.enqueueMarkerWithWaitList(&copied, &slot.consumed);
+
+        // The producer's next upload into this slot waits on the copy, it has to reach the device
+        _context._queue.flush();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            consumed++;
+        }
+        cv.notify_all();
+    };
+
+    auto shuffle = [&]() {
+        std::shuffle(ALL(batches), consumer_rng);
+        return batches;
+    };
+    this->train(n, iterations, learning_rate, batch_size, shuffle, load);
+
+    producer.join();
+
+    for(staging_slot &slot : slots) {
+        transfer.enqueueUnmapMemObject(slot.pinned_inputs, slot.host_inputs);
+        transfer.enqueueUnmapMemObject(slot.pinned_targets, slot.host_targets);
+    }
+    transfer.finish();
+}
+
+void vnn::train(
+    size_t n,
+    uint iterations,
+    VNN_FLOAT_TYPE learning_rate,
+    uint batch_size,
+    const std::function<std::vector<batch_range>()>& batches,
+    const std::function<void(size_t, cl_uint)>& load
+) {
+    assert(batch_size > 0);
+    assert(n > 0);
+
+    // Batches larger than the chunk size are pushed through the network in
+    // several launches, the gradient keeps accumulating until the batch is done
+    cl_uint chunk_size = static_cast<cl_uint>(std::min<size_t>({batch_size, n, VNN_MAX_BATCH_CHUNK}));
+    this->reserve_batch(chunk_size);
 
     for(uint epoch = 1; epoch <= iterations; epoch++) {
-        this->zero_gradient();
+        for(auto [batch_start, batch_end] : batches()) {
+            assert(batch_start < batch_end && batch_end <= n && batch_end - batch_start <= batch_size);
+
+            this->zero_gradient();
 
-        for(size_t i = 0; i < n; i++) {
-            this->zero_gradient_activations();
-            this->forward(input[i].get());
-            this->backprop(output[i].get());
+            for(size_t chunk_start = batch_start; chunk_start < batch_end; chunk_start += chunk_size) {
+                cl_uint chunk = static_cast<cl_uint>(std::min<size_t>(chunk_size, batch_end - chunk_start));
+
+                load(chunk_start, chunk);
+
+                this->train_step(chunk);
+            }
+
+            cl_uint samples = static_cast<cl_uint>(batch_end - batch_start);
+            this->apply_gradient(samples, learning_rate);
         }
 
-        this->apply_gradient( static_cast<cl_uint>(n), static_cast<cl_float>(learning_rate) );
-        std::cout << epoch << "/" << iterations << "\n";
+        if(_progress_out) *_progress_out << epoch << "/" << iterations << "\n";
+
+        _epoch++;
+        if(_checkpoint_interval != 0 && _epoch % _checkpoint_interval == 0) this->checkpoint(_checkpoint_file);
     }
 
     _context._queue.finish();
+    _context.report();
 }
 
 VNN_FLOAT_TYPE vnn::cost(
                 std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
                 std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& expected_output
 ) {
-    //assert(input.cols() == _neurons_per_layer[0] && output.cols() == _neurons_per_layer[_layers-1]);
+    return this->evaluate(input, expected_output).cost;
+}
+
+std::vector<VNN_FLOAT_TYPE> vnn::run_batch(std::span<const VNN_FLOAT_TYPE> inputs) {
+    std::vector<VNN_FLOAT_TYPE> outputs;
+    this->run_batch(inputs, outputs);
+    return outputs;
+}
+
+void vnn::run_batch(std::span<const VNN_FLOAT_TYPE> inputs, std::vector<VNN_FLOAT_TYPE> &outputs) {
+    size_t n = upload_batch(inputs);
+    outputs.resize(n * _neurons_per_layer[_layers-1]);
+
+    const cl::Buffer &result = forward_batch(n, [this](size_t first, cl_uint count) { load_batch_inputs(first, count); });
+    read_output(result, n, outputs.data());
+}
+
+void vnn::run_batch(clwrapper::memory<VNN_FLOAT_TYPE>& inputs, std::vector<VNN_FLOAT_TYPE> &outputs) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t n = inputs.size() / input_sz;
+    assert(n > 0 && inputs.size() == n * input_sz);
+    outputs.resize(n * _neurons_per_layer[_layers-1]);
+
+    const cl::Buffer &result = forward_batch(n, [&](size_t first, cl_uint count) {
+        copy_to_storage(inputs.get(), first * input_sz, _activations_d[MAIN_CL_BUFFERS][0], 0, count * input_sz, "copy_input");
+    });
+    read_output(result, n, outputs.data());
+}
+
+void vnn::run_batch(std::span<clwrapper::memory<VNN_FLOAT_TYPE>> inputs, std::vector<VNN_FLOAT_TYPE> &outputs) {
+    size_t n = inputs.size();
+    assert(n > 0);
+    outputs.resize(n * _neurons_per_layer[_layers-1]);
+
+    const cl::Buffer &result = forward_batch(n, [&](size_t first, cl_uint count) {
+        for(cl_uint b = 0; b < count; b++) load_sample(inputs[first + b], b);
+    });
+    read_output(result, n, outputs.data());
+}
+
+std::future<std::vector<VNN_FLOAT_TYPE>> vnn::run_batch_async(std::span<const VNN_FLOAT_TYPE> inputs) {
+    size_t n = upload_batch(inputs);
+    size_t values = n * _neurons_per_layer[_layers-1];
+
+    const cl::Buffer &result = forward_batch(n, [this](size_t first, cl_uint count) { load_batch_inputs(first, count); });
+
+    // The read lands in memory owned by the future, moving a vector keeps its data where it is
+    cl::Event done;
+    std::vector<VNN_STORAGE_TYPE> stored(values);
+    _context.enqueue_read(result, false, 0, sizeof(VNN_STORAGE_TYPE) * values, stored.data(), "read_output", &done);
+    _context._queue.flush();
+
+    return std::async(std::launch::deferred, [done, stored = std::move(stored)]() mutable {
+        done.wait();
+
+        if constexpr(!converted_storage) {
+            return std::move(stored);
+        } else {
+            std::vector<VNN_FLOAT_TYPE> outputs(stored.size());
+            from_storage(stored.data(), outputs.data(), stored.size());
+            return outputs;
+        }
+    });
+}
+
+void vnn::reserve_batch_io(size_t n) {
+    if(n <= _batch_io_capacity) return;
+
+    // Make sure nothing is still using the old buffers
+    _context._queue.finish();
+
+    _batch_inputs_d = cl::Buffer(_context._context, CL_MEM_READ_ONLY, sizeof(VNN_FLOAT_TYPE) * n * _neurons_per_layer[0]);
+    _batch_outputs_d = cl::Buffer(_context._context, CL_MEM_READ_WRITE, sizeof(VNN_STORAGE_TYPE) * n * _neurons_per_layer[_layers-1]);
+    _batch_io_capacity = n;
+}
+
+size_t vnn::upload_batch(std::span<const VNN_FLOAT_TYPE> inputs) {
+    size_t input_sz = _neurons_per_layer[0];
+    size_t n = inputs.size() / input_sz;
+    assert(n > 0 && inputs.size() == n * input_sz);
+
+    reserve_batch_io(n);
+    _context.enqueue_write(_batch_inputs_d, false, 0, sizeof(VNN_FLOAT_TYPE) * inputs.size(), inputs.data(), "write_input");
+
+    return n;
+}
+
+void vnn::load_batch_inputs(size_t first, cl_uint count) {
+    size_t input_sz = _neurons_per_layer[0];
+    copy_to_storage(_batch_inputs_d, first * input_sz, _activations_d[MAIN_CL_BUFFERS][0], 0, count * input_sz, "copy_input");
+}
+
+const cl::Buffer& vnn::forward_batch(size_t n, const std::function<void(size_t, cl_uint)>& load) {
+    assert(n > 0);
+
+    cl_uint chunk_size = static_cast<cl_uint>(std::min<size_t>(n, VNN_MAX_BATCH_CHUNK));
+    this->reserve_batch(chunk_size);
+
+    // A single chunk is read straight from the output activations
+    cl::Buffer &output = _activations_d[MAIN_CL_BUFFERS][_layers-1];
+    if(n == chunk_size) {
+        load(0, chunk_size);
+        this->forward(chunk_size);
+        return output;
+    }
+
+    // Larger batches gather the outputs of every chunk on the device, so the host still reads once
+    reserve_batch_io(n);
+    size_t row_bytes = sizeof(VNN_STORAGE_TYPE) * _neurons_per_layer[_layers-1];
+
+    for(size_t first = 0; first < n; first += chunk_size) {
+        cl_uint count = static_cast<cl_uint>(std::min<size_t>(chunk_size, n - first));
+
+        load(first, count);
+        this->forward(count);
+        _context.enqueue_copy(output, _batch_outputs_d, 0, first * row_bytes, count * row_bytes, "gather_output");
+    }
+
+    return _batch_outputs_d;
+}
+
+std::vector<VNN_FLOAT_TYPE> vnn::run(data::dataset<VNN_FLOAT_TYPE>& data, size_t i) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+
+    size_t output_sz = static_cast<size_t>(_neurons_per_layer[_layers-1]);
+    std::vector<VNN_FLOAT_TYPE> output(output_sz);
+
+    load_samples(data.input_slice(i, 1));
+    forward(1);
+
+    read_output(1, output.data());
+
+    return output;
+}
+
+VNN_FLOAT_TYPE vnn::cost(data::dataset<VNN_FLOAT_TYPE>& data) {
+    return this->evaluate(data).cost;
+}
+
+vnn::evaluation vnn::evaluate(
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& input,
+                std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>& expected_output
+) {
     assert(input.size() == expected_output.size());
 
     size_t n = input.size();
@@ -199,207 +741,683 @@ VNN_FLOAT_TYPE vnn::cost(
         assert(expected_output[i].size() == output_sz);
     }
 
-    std::vector<VNN_FLOAT_TYPE> out(expected_output[0].size());
-    VNN_FLOAT_TYPE err = 0.0f;
+    auto load = [&](size_t position, cl_uint count) {
+        for(cl_uint b = 0; b < count; b++) {
+            this->load_sample(input[position + b], b);
+            this->load_target(expected_output[position + b], b);
+        }
+    };
 
-    for(size_t i = 0; i < n; i++) {
-        this->run(input[i], out);
+    return this->evaluate(n, load);
+}
+
+vnn::evaluation vnn::evaluate(data::dataset<VNN_FLOAT_TYPE>& data) {
+    assert(data.input_size() == _neurons_per_layer[0]);
+    assert(data.output_size() == _neurons_per_layer[_layers-1]);
+
+    auto load = [&](size_t position, cl_uint count) {
+        this->load_samples(data.input_slice(position, count));
+        this->load_targets(data.target_slice(position, count));
+    };
+
+    return this->evaluate(data.size(), load);
+}
+
+vnn::evaluation vnn::evaluate(size_t n, const std::function<void(size_t, cl_uint)>& load) {
+    assert(n > 0);
+
+    cl_uint chunk_size = static_cast<cl_uint>(std::min<size_t>(n, VNN_MAX_BATCH_CHUNK));
+    this->reserve_batch(chunk_size);
+
+    // Every work group of the cost kernel leaves one partial error sum and one
+    // partial count of correct samples, each chunk gets its own range of partials
+    cl_uint groups_per_chunk = (chunk_size + COST_GROUP_SIZE - 1) / COST_GROUP_SIZE;
+    cl_uint chunks = static_cast<cl_uint>((n + chunk_size - 1) / chunk_size);
+    cl_uint stride = chunks * groups_per_chunk;
+
+    // [2 x stride], row 0 holds the errors and row 1 the correct counts. Zeroed on the
+    // device by the constructor, the last chunk may not fill all of its partials.
+    clwrapper::memory<VNN_FLOAT_TYPE> partials(_context, false, 2 * stride, clwrapper::memory_mode::DEVICE);
+    // Read back with a map where the device shares host memory, handed to the device first
+    clwrapper::memory<VNN_FLOAT_TYPE> result(_context, false, 2, clwrapper::preferred_memory_mode(_context));
+    result.write_to_device(false);
+
+    cl_uint output_sz = _neurons_per_layer[_layers-1];
+    _cost_kernel.setArg(0, _activations_d[MAIN_CL_BUFFERS][_layers-1]);
+    _cost_kernel.setArg(1, _activations_d[GRADIENT_CL_BUFFERS][_layers-1]);
+    _cost_kernel.setArg(2, sizeof(cl_uint), &output_sz);
+    _cost_kernel.setArg(4, partials.get());
+    _cost_kernel.setArg(6, sizeof(cl_uint), &stride);
+    _cost_kernel.setArg(7, cl::Local(2 * COST_GROUP_SIZE * sizeof(VNN_FLOAT_TYPE)));
+
+    for(cl_uint c = 0; c < chunks; c++) {
+        size_t first = static_cast<size_t>(c) * chunk_size;
+        cl_uint chunk = static_cast<cl_uint>(std::min<size_t>(chunk_size, n - first));
+
+        load(first, chunk);
+        this->forward(chunk);
+
+        cl_uint offset = c * groups_per_chunk;
+        cl_uint groups = (chunk + COST_GROUP_SIZE - 1) / COST_GROUP_SIZE;
+        _cost_kernel.setArg(3, sizeof(cl_uint), &chunk);
+        _cost_kernel.setArg(5, sizeof(cl_uint), &offset);
+
+        _context.enqueue_kernel(
+            _cost_kernel, cl::NDRange(groups * COST_GROUP_SIZE), cl::NDRange(COST_GROUP_SIZE), "cost"
+        );
+    }
+
+    // Sum both rows of partials in a single launch
+    _reduce_sum_kernel.setArg(0, partials.get());
+    _reduce_sum_kernel.setArg(1, sizeof(cl_uint), &stride);
+    _reduce_sum_kernel.setArg(2, result.get());
+    _reduce_sum_kernel.setArg(3, cl::Local(REDUCE_GROUP_SIZE * sizeof(VNN_FLOAT_TYPE)));
+    _context.enqueue_kernel(
+        _reduce_sum_kernel, cl::NDRange(REDUCE_GROUP_SIZE, 2), cl::NDRange(REDUCE_GROUP_SIZE, 1), "reduce_sum"
+    );
+
+    result.read_from_device(true);
+    _context.report();
+
+    // The squared error is averaged per output, the cross entropy already sums over a sample's outputs
+    VNN_FLOAT_TYPE samples = static_cast<VNN_FLOAT_TYPE>(n);
+    VNN_FLOAT_TYPE outputs = _layer_activations.back() == activation::SOFTMAX ? 1 : static_cast<VNN_FLOAT_TYPE>(output_sz);
+    return {
+        result[0] / samples / outputs,
+        result[1] / samples
+    };
+}
+
+void vnn::load_samples(const data::slice& input) {
+    assert(input.count <= _batch_capacity);
+    assert(input.format == data::encoding::LABEL || input.stride == _neurons_per_layer[0]);
+
+    load_slice(input, _activations_d[MAIN_CL_BUFFERS][0], _neurons_per_layer[0], "copy_input");
+}
 
-        for(size_t j = 0; j < out.size(); j++) {
-            VNN_FLOAT_TYPE tmp = out[j] - expected_output[i][j];
-            err += tmp*tmp;
+void vnn::load_targets(const data::slice& output) {
+    assert(output.count <= _batch_capacity);
+    assert(output.format == data::encoding::LABEL || output.stride == _neurons_per_layer[_layers-1]);
+
+    load_slice(output, _activations_d[GRADIENT_CL_BUFFERS][_layers-1], _neurons_per_layer[_layers-1], "copy_target");
+}
+
+void vnn::load_slice(const data::slice& source, cl::Buffer& dest, cl_uint width, const std::string& name) {
+    cl_uint offset = static_cast<cl_uint>(source.offset);
+    cl_uint n = static_cast<cl_uint>(source.count) * width;
+
+    switch(source.format) {
+        case data::encoding::NATIVE:
+            copy_to_storage(source.buffer, source.offset, dest, 0, n, name);
+            break;
+
+        // The normalization of byte data happens as part of the copy, the
+        // device buffer stays a quarter of the size of a float one
+        case data::encoding::UINT8: {
+            VNN_FLOAT_TYPE scale = static_cast<VNN_FLOAT_TYPE>(source.scale);
+            _copy_u8_kernel.setArg(0, dest);
+            _copy_u8_kernel.setArg(1, source.buffer);
+            _copy_u8_kernel.setArg(2, sizeof(cl_uint), &offset);
+            _copy_u8_kernel.setArg(3, sizeof(cl_uint), &n);
+            _copy_u8_kernel.setArg(4, sizeof(VNN_FLOAT_TYPE), &scale);
+            enqueue_kernel(
+                _copy_u8_kernel, global_range(n, _local.copy_u8), local_range(_local.copy_u8), name, -1,
+                {{source.buffer()}, {dest()}}
+            );
+            break;
         }
+
+        case data::encoding::LABEL:
+            _one_hot_kernel.setArg(0, dest);
+            _one_hot_kernel.setArg(1, source.buffer);
+            _one_hot_kernel.setArg(2, sizeof(cl_uint), &offset);
+            _one_hot_kernel.setArg(3, sizeof(cl_uint), &width);
+            _one_hot_kernel.setArg(4, sizeof(cl_uint), &n);
+            enqueue_kernel(
+                _one_hot_kernel, global_range(n, _local.one_hot), local_range(_local.one_hot), name, -1,
+                {{source.buffer()}, {dest()}}
+            );
+            break;
     }
+}
 
-    return err / static_cast<VNN_FLOAT_TYPE>(n) / static_cast<VNN_FLOAT_TYPE>(_neurons_per_layer[_layers-1]);
+void vnn::load_sample(clwrapper::memory<VNN_FLOAT_TYPE>& input, cl_uint b) {
+    assert(b < _batch_capacity);
+    cl_uint row = _neurons_per_layer[0];
+
+    copy_to_storage(input.get(), 0, _activations_d[MAIN_CL_BUFFERS][0], b * row, row, "copy_input");
 }
 
-void vnn::forward(cl::Buffer &input) {
+void vnn::load_target(clwrapper::memory<VNN_FLOAT_TYPE>& output, cl_uint b) {
+    assert(b < _batch_capacity);
+    cl_uint row = _neurons_per_layer[_layers-1];
 
-    _copy_kernel.setArg(0, _activations_d[MAIN_CL_BUFFERS][0].get());
-    _copy_kernel.setArg(1, input);
-    _copy_kernel.setArg(2, sizeof(cl_uint), &_neurons_per_layer[0]);
+    // The target is stored in the gradient of the output layer, backprop_delta_init
+    // then turns it into the output deltas in place
+    copy_to_storage(output.get(), 0, _activations_d[GRADIENT_CL_BUFFERS][_layers-1], b * row, row, "copy_target");
+}
 
-    _context._queue.enqueueNDRangeKernel(_copy_kernel, cl::NullRange, _kernel_range);
+void vnn::copy_to_storage(
+    const cl::Buffer& src, size_t src_offset, cl::Buffer& dest, size_t dest_offset, size_t n,
+    const std::string& name, const std::vector<cl::Event>* wait, cl::Event* done
+) {
+    // On an out-of-order queue the copy also waits for the other commands using the two
+    // buffers. The caller's wait list is merged into those dependencies, not replaced.
+    clwrapper::buffer_access access = {{src()}, {dest()}};
+    std::vector<cl::Event> deps;
+    cl::Event copied;
+    if(_graph) {
+        deps = _graph->dependencies(access, wait);
+        wait = &deps;
+        if(!done) done = &copied;
+    }
 
-    for(size_t i = 0; i < _layers-1; i++) {
+    if constexpr(!converted_storage) {
+        _context.enqueue_copy(
+            src, dest, src_offset * sizeof(VNN_FLOAT_TYPE), dest_offset * sizeof(VNN_STORAGE_TYPE),
+            n * sizeof(VNN_FLOAT_TYPE), name, wait, done
+        );
+    } else {
+        cl_uint src_off = static_cast<cl_uint>(src_offset);
+        cl_uint dest_off = static_cast<cl_uint>(dest_offset);
+        cl_uint count = static_cast<cl_uint>(n);
+
+        _to_real_kernel.setArg(0, dest);
+        _to_real_kernel.setArg(1, sizeof(cl_uint), &dest_off);
+        _to_real_kernel.setArg(2, src);
+        _to_real_kernel.setArg(3, sizeof(cl_uint), &src_off);
+        _to_real_kernel.setArg(4, sizeof(cl_uint), &count);
+        _context.enqueue_kernel(
+            _to_real_kernel, global_range(n, _local.to_real), local_range(_local.to_real), name, -1, wait, done
+        );
+    }
 
-        // arg[0] = weight matrix
-        _forward_kernel.setArg(0, _weights_d[MAIN_CL_BUFFERS][i].get());
-        // arg[1] = bias matrix
-        _forward_kernel.setArg(1, _biases_d[MAIN_CL_BUFFERS][i].get());
-        // arg[2] = activation matrix
-        _forward_kernel.setArg(2, _activations_d[MAIN_CL_BUFFERS][i].get());
+    if(_graph) _graph->record(access, *done);
+}
 
-        // arg[3] = number of rows in weight matrix
-        cl_uint rows = static_cast<cl_uint>(_neurons_per_layer[i]);
-        _forward_kernel.setArg(3, sizeof(cl_uint), &rows);
-        // arg[4] = number of columns in weight matrix
-        cl_uint cols = static_cast<cl_uint>(_neurons_per_layer[i+1]);
-        _forward_kernel.setArg(4, sizeof(cl_uint), &cols);
+void vnn::read_output(cl_uint rows, VNN_FLOAT_TYPE* out) {
+    read_output(_activations_d[MAIN_CL_BUFFERS][_layers-1], rows, out);
+}
+
+void vnn::read_output(const cl::Buffer& buffer, size_t rows, VNN_FLOAT_TYPE* out) {
+    size_t n = rows * _neurons_per_layer[_layers-1];
+
+    if constexpr(!converted_storage) {
+        _context.enqueue_read(buffer, true, 0, sizeof(VNN_FLOAT_TYPE) * n, out, "read_output");
+    } else {
+        std::vector<VNN_STORAGE_TYPE> stored(n);
+        _context.enqueue_read(buffer, true, 0, sizeof(VNN_STORAGE_TYPE) * n, stored.data(), "read_output");
+        from_storage(stored.data(), out, n);
+    }
+}
 
+void vnn::forward(cl_uint batch) {
+    assert(batch <= _batch_capacity);
+    clwrapper::dispatch_timer timer(_context);
 
-        _forward_kernel.setArg(5, _activations_d[MAIN_CL_BUFFERS][i+1].get());
-        _context._queue.enqueueNDRangeKernel(_forward_kernel, cl::NullRange, _kernel_range);
+    if(!_use_plans || _graph) return record_forward(batch, direct_launcher());
 
+    plan(_forward_plans, batch, "forward", [&](const launcher &launch) { record_forward(batch, launch); }).replay();
+}
+
+void vnn::train_step(cl_uint batch) {
+    assert(!_inference && "Inference only models can't be trained");
+    assert(batch <= _batch_capacity);
+    clwrapper::dispatch_timer timer(_context);
+
+    // Plans replay their launches in order, on an out-of-order queue the event graph
+    // lets the gradients of a layer overlap with the deltas of the layer before instead
+    if(!_use_plans || _graph) {
+        record_forward(batch, direct_launcher());
+        record_backprop(batch, direct_launcher());
+        return;
     }
 
+    plan(_step_plans, batch, "train_step", [&](const launcher &launch) {
+        record_forward(batch, launch);
+        record_backprop(batch, launch);
+    }).replay();
 }
 
-void vnn::backprop(cl::Buffer &output) {
-    cl_uint n = _neurons_per_layer[_layers-1];
-    _copy_kernel.setArg(0, _activations_d[GRADIENT_CL_BUFFERS][_layers-1].get());
-    _copy_kernel.setArg(1, output);
-    _copy_kernel.setArg(2, sizeof(cl_uint), &n);
+vnn::launcher vnn::direct_launcher() {
+    // Arguments go to the shared kernel right before it is enqueued
+    return [this](
+        const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+        const std::string &name, int layer, const clwrapper::buffer_access &access,
+        const std::function<void(cl::Kernel&)> &bind
+    ) {
+        cl::Kernel k = kernel;
+        bind(k);
+        enqueue_kernel(k, global, local, name, layer, access);
+    };
+}
 
-    _context._queue.enqueueNDRangeKernel(_copy_kernel, cl::NullRange, _kernel_range);
+void vnn::enqueue_kernel(
+    const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+    const std::string &name, int layer, const clwrapper::buffer_access &access
+) {
+    if(_graph) _graph->enqueue_kernel(kernel, global, local, name, layer, access);
+    else _context.enqueue_kernel(kernel, global, local, name, layer);
+}
 
-    // Compute (aL - y)
-    _backprop_init_kernel.setArg(0, _activations_d[MAIN_CL_BUFFERS][_layers-1].get());
-    _backprop_init_kernel.setArg(1, _activations_d[GRADIENT_CL_BUFFERS][_layers-1].get());
-    _backprop_init_kernel.setArg(2, sizeof(cl_uint), &n);
-    _context._queue.enqueueNDRangeKernel(_backprop_init_kernel, cl::NullRange, _kernel_range);
+clwrapper::launch_plan& vnn::plan(
+    std::map<cl_uint, clwrapper::launch_plan> &plans, cl_uint batch, const std::string &name,
+    const std::function<void(const launcher&)> &record
+) {
+    auto it = plans.find(batch);
+    if(it != plans.end()) return it->second;
+
+    // Odd sized last chunks of run_batch could otherwise add a plan per call
+    if(plans.size() >= VNN_MAX_PLANS) plans.clear();
+
+    clwrapper::launch_plan &p = plans.emplace(batch, clwrapper::launch_plan(_context, name)).first->second;
+    // A plan runs its launches in order, the buffer access isn't needed
+    record([&p](
+        const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local,
+        const std::string &name, int layer, const clwrapper::buffer_access&,
+        const std::function<void(cl::Kernel&)> &bind
+    ) {
+        bind(p.add(kernel, global, local, name, layer));
+    });
+    p.finalize();
 
-    for(size_t l = _layers-1; l > 0; l--) {
-        // weights matrix and weights gradient
-        _backprop_step_kernel.setArg(0, _weights_d[MAIN_CL_BUFFERS][l-1].get());
-        _backprop_step_kernel.setArg(1, _weights_d[GRADIENT_CL_BUFFERS][l-1].get());
+    return p;
+}
+
+void vnn::use_launch_plans(bool enabled) {
+    _use_plans = enabled;
+}
+
+void vnn::record_forward(cl_uint batch, const launcher &launch) {
+    for(size_t i = 0; i < _layers-1; i++) {
+        cl_uint rows = static_cast<cl_uint>(_neurons_per_layer[i]);
+        cl_uint cols = static_cast<cl_uint>(_neurons_per_layer[i+1]);
 
-        // Bias column vector
-        _backprop_step_kernel.setArg(2, _biases_d[GRADIENT_CL_BUFFERS][l-1].get());
+        // out = activate(A * W + B) for the whole batch
+        clwrapper::buffer_access access = {
+            {_weights_d[i](), _biases_d[i](), _activations_d[MAIN_CL_BUFFERS][i]()}, {_activations_d[MAIN_CL_BUFFERS][i+1]()}
+        };
+        launch(_forward_kernels[i], gemm_global_range(_gemm, batch, cols), gemm_local_range(_gemm), "forward", static_cast<int>(i), access, [&](cl::Kernel &kernel) {
+            // arg[0] = weight matrix
+            kernel.setArg(0, _weights_d[i]);
+            // arg[1] = bias matrix
+            kernel.setArg(1, _biases_d[i]);
+            // arg[2] = activation matrix
+            kernel.setArg(2, _activations_d[MAIN_CL_BUFFERS][i]);
+
+            // arg[3] = number of rows in weight matrix
+            kernel.setArg(3, sizeof(cl_uint), &rows);
+            // arg[4] = number of columns in weight matrix
+            kernel.setArg(4, sizeof(cl_uint), &cols);
+
+            kernel.setArg(5, _activations_d[MAIN_CL_BUFFERS][i+1]);
+
+            // arg[6] = number of samples in the batch
+            kernel.setArg(6, sizeof(cl_uint), &batch);
+        });
+    }
 
-        // Activations matrix of current and previous layer
-        _backprop_step_kernel.setArg(3, _activations_d[MAIN_CL_BUFFERS][l].get());
-        _backprop_step_kernel.setArg(4, _activations_d[MAIN_CL_BUFFERS][l-1].get());
+    // The GEMM of a softmax layer leaves its outputs linear, normalize every sample's row
+    if(_layer_activations.back() == activation::SOFTMAX) {
+        cl_uint cols = _neurons_per_layer[_layers-1];
+        clwrapper::buffer_access access = {{}, {_activations_d[MAIN_CL_BUFFERS][_layers-1]()}};
+        launch(_softmax_kernel, global_range(batch, _local.softmax), local_range(_local.softmax), "softmax", static_cast<int>(_layers-2), access, [&](cl::Kernel &kernel) {
+            kernel.setArg(0, _activations_d[MAIN_CL_BUFFERS][_layers-1]);
+            kernel.setArg(1, sizeof(cl_uint), &cols);
+            kernel.setArg(2, sizeof(cl_uint), &batch);
+        });
+    }
 
-        // Buffers used for intermediary values
-        _backprop_step_kernel.setArg(5, _activations_d[GRADIENT_CL_BUFFERS][l].get());
-        _backprop_step_kernel.setArg(6, _activations_d[GRADIENT_CL_BUFFERS][l-1].get());
+}
+
+void vnn::record_backprop(cl_uint batch, const launcher &launch) {
+    // Turn the targets into the deltas of the output layer for every sample in the batch
+    cl_uint n = _neurons_per_layer[_layers-1] * batch;
+    clwrapper::buffer_access init_access = {
+        {_activations_d[MAIN_CL_BUFFERS][_layers-1]()}, {_activations_d[GRADIENT_CL_BUFFERS][_layers-1]()}
+    };
+    launch(_backprop_init_kernel, global_range(n, _local.backprop_init), local_range(_local.backprop_init), "backprop_delta_init", static_cast<int>(_layers-2), init_access, [&](cl::Kernel &kernel) {
+        kernel.setArg(0, _activations_d[MAIN_CL_BUFFERS][_layers-1]);
+        kernel.setArg(1, _activations_d[GRADIENT_CL_BUFFERS][_layers-1]);
+        kernel.setArg(2, sizeof(cl_uint), &n);
+    });
 
+    for(size_t l = _layers-1; l > 0; l--) {
         // Dimensions of weight matrix
         cl_uint cols = _neurons_per_layer[l];
         cl_uint rows = _neurons_per_layer[l-1];
-        _backprop_step_kernel.setArg(7, sizeof(cl_uint), &cols);
-        _backprop_step_kernel.setArg(8, sizeof(cl_uint), &rows);
 
-        _context._queue.enqueueNDRangeKernel(_backprop_step_kernel, cl::NullRange, _kernel_range);
+        // The weight gradient, bias gradient and deltas of the previous layer only share
+        // their inputs, an out-of-order queue can run them at the same time
+        clwrapper::buffer_access weight_access = {
+            {_activations_d[MAIN_CL_BUFFERS][l-1](), _activations_d[GRADIENT_CL_BUFFERS][l]()}, {_weight_gradients_d[l-1]()}
+        };
+        clwrapper::buffer_access bias_access = {{_activations_d[GRADIENT_CL_BUFFERS][l]()}, {_bias_gradients_d[l-1]()}};
+
+        // gW += prevA^T * delta
+        launch(_backprop_gradient_kernel, gemm_global_range(_gemm, rows, cols), gemm_local_range(_gemm), "weight_gradient", static_cast<int>(l-1), weight_access, [&](cl::Kernel &kernel) {
+            kernel.setArg(0, _weight_gradients_d[l-1]);
+            kernel.setArg(1, _activations_d[MAIN_CL_BUFFERS][l-1]);
+            kernel.setArg(2, _activations_d[GRADIENT_CL_BUFFERS][l]);
+            kernel.setArg(3, sizeof(cl_uint), &cols);
+            kernel.setArg(4, sizeof(cl_uint), &rows);
+            kernel.setArg(5, sizeof(cl_uint), &batch);
+        });
+
+        // gB += sum of the deltas over the batch
+        size_t bias_local = _local.bias_gradient[l-1];
+        launch(_bias_gradient_kernel, global_range(cols, bias_local), local_range(bias_local), "bias_gradient", static_cast<int>(l-1), bias_access, [&](cl::Kernel &kernel) {
+            kernel.setArg(0, _bias_gradients_d[l-1]);
+            kernel.setArg(1, _activations_d[GRADIENT_CL_BUFFERS][l]);
+            kernel.setArg(2, sizeof(cl_uint), &cols);
+            kernel.setArg(3, sizeof(cl_uint), &batch);
+        });
+
+        // The input layer has no use for its deltas
+        if(l == 1) break;
+
+        // prevDelta = (delta * W^T) (.) activate'(prevA), with the activation of the previous layer
+        clwrapper::buffer_access step_access = {
+            {_weights_d[l-1](), _activations_d[MAIN_CL_BUFFERS][l-1](), _activations_d[GRADIENT_CL_BUFFERS][l]()},
+            {_activations_d[GRADIENT_CL_BUFFERS][l-1]()}
+        };
+        launch(_backprop_step_kernels[l-2], gemm_global_range(_gemm, batch, rows), gemm_local_range(_gemm), "backprop_step", static_cast<int>(l-2), step_access, [&](cl::Kernel &kernel) {
+            kernel.setArg(0, _weights_d[l-1]);
+            kernel.setArg(1, _activations_d[MAIN_CL_BUFFERS][l-1]);
+            kernel.setArg(2, _activations_d[GRADIENT_CL_BUFFERS][l]);
+            kernel.setArg(3, _activations_d[GRADIENT_CL_BUFFERS][l-1]);
+            kernel.setArg(4, sizeof(cl_uint), &cols);
+            kernel.setArg(5, sizeof(cl_uint), &rows);
+            kernel.setArg(6, sizeof(cl_uint), &batch);
+        });
     }
 }
 
-// Applies gradient stored in GRADIENT_CL_BUFFERS to MAIN_CL_BUFFERS with
-// given learning rate.
+// Applies the accumulated gradients to the weights and biases with
+// given learning rate, using the update rule of the current optimizer.
+// n is the number of samples the gradient was summed over.
 void vnn::apply_gradient(cl_uint n, VNN_FLOAT_TYPE learning_rate) {
+    clwrapper::dispatch_timer timer(_context);
+    _step++;
+
+    // Scalars have the kernels' ACCUM type, which is VNN_FLOAT_TYPE
+    VNN_FLOAT_TYPE scale = static_cast<VNN_FLOAT_TYPE>(1) / static_cast<VNN_FLOAT_TYPE>(n);
+    VNN_FLOAT_TYPE lr = learning_rate;
+
+    cl::Kernel &kernel =
+        _optimizer.kind == optimizer_kind::ADAM ? _apply_adam_kernel :
+        _optimizer.kind == optimizer_kind::SGD ? _apply_gradient_kernel : _apply_momentum_kernel;
+
+    // Arguments after the parameter, gradient and state arenas
+    cl_uint arg = 2 + static_cast<cl_uint>(_optimizer.state_buffers());
+
+    kernel.setArg(0, _parameters_d->get());
+    kernel.setArg(1, _gradients_d->get());
+    for(cl_uint k = 0; k < _optimizer.state_buffers(); k++) kernel.setArg(2 + k, _state_d[k]->get());
+
+    cl_uint n_parameters = static_cast<cl_uint>(_parameter_count);
+    kernel.setArg(arg, sizeof(cl_uint), &n_parameters);
+    kernel.setArg(arg + 1, sizeof(VNN_FLOAT_TYPE), &scale);
+
+    switch(_optimizer.kind) {
+        case optimizer_kind::SGD:
+            kernel.setArg(arg + 2, sizeof(VNN_FLOAT_TYPE), &lr);
+            break;
+
+        case optimizer_kind::MOMENTUM:
+        case optimizer_kind::NESTEROV: {
+            cl_uint nesterov = _optimizer.kind == optimizer_kind::NESTEROV;
+            VNN_FLOAT_TYPE momentum = _optimizer.momentum;
+            kernel.setArg(arg + 2, sizeof(VNN_FLOAT_TYPE), &lr);
+            kernel.setArg(arg + 3, sizeof(VNN_FLOAT_TYPE), &momentum);
+            kernel.setArg(arg + 4, sizeof(cl_uint), &nesterov);
+            break;
+        }
 
-    _apply_gradient_kernel.setArg(6, sizeof(cl_uint), &n);
+        case optimizer_kind::ADAM: {
+            VNN_FLOAT_TYPE adam_lr = _optimizer.adam_learning_rate(static_cast<float>(lr), _step);
+            VNN_FLOAT_TYPE beta1 = _optimizer.beta1;
+            VNN_FLOAT_TYPE beta2 = _optimizer.beta2;
+            VNN_FLOAT_TYPE epsilon = _optimizer.epsilon;
+            kernel.setArg(arg + 2, sizeof(VNN_FLOAT_TYPE), &adam_lr);
+            kernel.setArg(arg + 3, sizeof(VNN_FLOAT_TYPE), &beta1);
+            kernel.setArg(arg + 4, sizeof(VNN_FLOAT_TYPE), &beta2);
+            kernel.setArg(arg + 5, sizeof(VNN_FLOAT_TYPE), &epsilon);
+            break;
+        }
+    }
 
-    for(size_t l = 0; l < _layers-1; l++) {
-        _apply_gradient_kernel.setArg(0, _weights_d[MAIN_CL_BUFFERS][l].get());
-        _apply_gradient_kernel.setArg(1, _weights_d[GRADIENT_CL_BUFFERS][l].get());
+    // A single launch over every layer's weights and biases
+    size_t local =
+        _optimizer.kind == optimizer_kind::ADAM ? _local.apply_adam :
+        _optimizer.kind == optimizer_kind::SGD ? _local.apply_gradient : _local.apply_momentum;
+    _context.enqueue_kernel(kernel, global_range(n_parameters, local), local_range(local), "apply_gradient");
+}
 
-        _apply_gradient_kernel.setArg(2, _biases_d[MAIN_CL_BUFFERS][l].get());
-        _apply_gradient_kernel.setArg(3, _biases_d[GRADIENT_CL_BUFFERS][l].get());
+void vnn::set_optimizer(const optimizer &opt) {
+    assert(!_inference && "Inference only models have no optimizer state");
+    _optimizer = opt;
+    _step = 0;
 
-        cl_uint rows = _neurons_per_layer[l];
-        cl_uint cols = _neurons_per_layer[l+1];
+    // Make sure no update is still using the old state
+    _context._queue.finish();
 
-        _apply_gradient_kernel.setArg(4, sizeof(cl_uint), &cols);
-        _apply_gradient_kernel.setArg(5, sizeof(cl_uint), &rows);
-        _apply_gradient_kernel.setArg(7, sizeof(cl_float), &learning_rate);
+    // State arenas have the layout of the parameter arena and start out at 0. They live
+    // on the device, only checkpoints give them a host copy for as long as they need it.
+    for(size_t k = 0; k < _state_d.size(); k++) {
+        _state_d[k].reset();
+        if(k >= opt.state_buffers()) continue;
 
-        _context._queue.enqueueNDRangeKernel(_apply_gradient_kernel, cl::NullRange, _kernel_range);
+        _state_d[k].emplace(_context, false, _parameter_count, clwrapper::memory_mode::DEVICE);
     }
 }
 
-void vnn::zero_gradient_activations() {
-    for(size_t l = 0; l < _layers; l++) {
-        cl_uint cols = _neurons_per_layer[l];
+void vnn::zero_gradient() {
+    assert(!_inference && "Inference only models can't be trained");
+    clwrapper::dispatch_timer timer(_context);
+
+    // The whole gradient arena, padding included, so the update leaves the padding alone
+    cl_uint n = static_cast<cl_uint>(_parameter_count);
+    _zero_kernel.setArg(0, _gradients_d->get());
+    _zero_kernel.setArg(1, sizeof(cl_uint), &n);
+
+    // Writes every layer's gradients, but on an out-of-order queue the forward
+    // passes of the batch don't have to wait for it
+    clwrapper::buffer_access access;
+    for(cl::Buffer &b : _weight_gradients_d) access.writes.push_back(b());
+    for(cl::Buffer &b : _bias_gradients_d) access.writes.push_back(b());
+    enqueue_kernel(_zero_kernel, global_range(n, _local.zero), local_range(_local.zero), "zero_gradient", -1, access);
+}
+
+void vnn::reserve_batch(cl_uint batch) {
+    if(batch <= _batch_capacity) return;
+
+    // Make sure nothing is still using the old buffers
+    _context._queue.finish();
 
-        _zero_kernel.setArg(0, _activations_d[GRADIENT_CL_BUFFERS][l].get());
-        _zero_kernel.setArg(1, sizeof(cl_uint), &cols);
-        _context._queue.enqueueNDRangeKernel(_zero_kernel, cl::NullRange, _kernel_range);
+    // Plans are bound to the old activations
+    _forward_plans.clear();
+    _step_plans.clear();
+
+    for(auto &activations : _activations_d) activations.clear();
+
+    if(_inference) {
+        // Layer l is read from pair[l % 2] and written to the other one, softmax works in place
+        size_t widest = static_cast<size_t>(*std::max_element(ALL(_neurons_per_layer))) * batch;
+        size_t targets = static_cast<size_t>(_neurons_per_layer[_layers-1]) * batch;
+
+        clwrapper::arena_layout layout(_context, sizeof(VNN_STORAGE_TYPE));
+        std::array<size_t, 2> pair_offsets = {layout.add(widest), layout.add(widest)};
+        size_t targets_offset = layout.add(targets);
+        _activation_arena_d.emplace(_context, false, layout.size(), clwrapper::memory_mode::DEVICE);
+
+        std::array<cl::Buffer, 2> pair = {
+            _activation_arena_d->sub_buffer(pair_offsets[0], widest), _activation_arena_d->sub_buffer(pair_offsets[1], widest)
+        };
+        for(size_t l = 0; l < _layers; l++) _activations_d[MAIN_CL_BUFFERS].push_back(pair[l % 2]);
+
+        _activations_d[GRADIENT_CL_BUFFERS].resize(_layers);
+        _activations_d[GRADIENT_CL_BUFFERS].back() = _activation_arena_d->sub_buffer(targets_offset, targets);
+
+        _batch_capacity = batch;
+        return;
     }
-}
 
-void vnn::zero_gradient() {
-    for(size_t l = 0; l < _layers-1; l++) {
-        cl_uint rows = _neurons_per_layer[l];
-        cl_uint cols = _neurons_per_layer[l+1];
-        cl_uint n = rows * cols;
+    // The activations and their gradients of every layer, [batch x neurons] each
+    clwrapper::arena_layout layout(_context, sizeof(VNN_STORAGE_TYPE));
+    std::array<std::vector<size_t>, 2> offsets;
+    for(auto &o : offsets) {
+        for(size_t l = 0; l < _layers; l++) o.push_back(layout.add(static_cast<size_t>(_neurons_per_layer[l]) * batch));
+    }
 
-        _zero_kernel.setArg(0, _weights_d[GRADIENT_CL_BUFFERS][l].get());
-        _zero_kernel.setArg(1, sizeof(cl_uint), &n);
-        _context._queue.enqueueNDRangeKernel(_zero_kernel, cl::NullRange, _kernel_range);
+    _activation_arena_d.emplace(_context, false, layout.size(), clwrapper::memory_mode::DEVICE);
 
-        _zero_kernel.setArg(0, _biases_d[GRADIENT_CL_BUFFERS][l].get());
-        _zero_kernel.setArg(1, sizeof(cl_uint), &cols);
-        _context._queue.enqueueNDRangeKernel(_zero_kernel, cl::NullRange, _kernel_range);
+    for(size_t k = 0; k < _activations_d.size(); k++) {
+        for(size_t l = 0; l < _layers; l++) {
+            size_t n = static_cast<size_t>(_neurons_per_layer[l]) * batch;
+            _activations_d[k].push_back(_activation_arena_d->sub_buffer(offsets[k][l], n));
+        }
     }
+
+    _batch_capacity = batch;
 }
 
-void vnn::add_matrix_pairs(
-    std::array<std::vector<clwrapper::memory<VNN_FLOAT_TYPE>>, 2> &out,
-    cl_uint n, bool shouldRandomize) {
+void vnn::lay_out() {
+    // Every layer's weight matrix is [rows x cols], followed by its bias with one entry per neuron
+    clwrapper::arena_layout layout(_context, sizeof(VNN_STORAGE_TYPE));
+    for(size_t l = 0; l < _layers-1; l++) {
+        _weight_offsets.push_back(layout.add(static_cast<size_t>(_neurons_per_layer[l]) * _neurons_per_layer[l+1]));
+        _bias_offsets.push_back(layout.add(_neurons_per_layer[l+1]));
+    }
+    _parameter_count = layout.size();
+}
 
-    out[MAIN_CL_BUFFERS].emplace_back(
-        clwrapper::memory<VNN_FLOAT_TYPE>(_context, shouldRandomize, static_cast<size_t>(n))
-    );
+void vnn::allocate(std::span<const VNN_STORAGE_TYPE> parameters) {
+    assert(parameters.size() == _parameter_count);
 
-    out[GRADIENT_CL_BUFFERS].emplace_back(
-        clwrapper::memory<VNN_FLOAT_TYPE>(_context, shouldRandomize, static_cast<size_t>(n))
-    );
+    // Training keeps a host copy for checkpoints, inference only models upload the parameters
+    // once. The gradients are zeroed on the device before every batch and never seen by the host.
+    _parameters_d.emplace(_context, parameters, _inference ? clwrapper::memory_mode::DEVICE : clwrapper::memory_mode::HOST_COPY);
+    if(!_inference) _gradients_d.emplace(_context, false, _parameter_count, clwrapper::memory_mode::DEVICE);
+
+    for(size_t l = 0; l < _layers-1; l++) {
+        size_t rows = _neurons_per_layer[l];
+        size_t cols = _neurons_per_layer[l+1];
 
+        _weights_d.push_back(_parameters_d->sub_buffer(_weight_offsets[l], rows * cols));
+        _biases_d.push_back(_parameters_d->sub_buffer(_bias_offsets[l], cols));
+        if(_inference) continue;
+
+        _weight_gradients_d.push_back(_gradients_d->sub_buffer(_weight_offsets[l], rows * cols));
+        _bias_gradients_d.push_back(_gradients_d->sub_buffer(_bias_offsets[l], cols));
+    }
+
+    this->reserve_batch(1);
 }
 
+// All parameters move in a single transfer. Inference only models have no host copy
+// and aren't given one, to_network reads them into a temporary instead.
 void vnn::read_from_device() {
-    bool shouldBlock = false;
-    std::for_each(ALL(_weights_d[MAIN_CL_BUFFERS]), [shouldBlock](clwrapper::memory<VNN_FLOAT_TYPE> &x) {
-        x.read_from_device(shouldBlock);
-    });
-
-    std::for_each(ALL(_biases_d[MAIN_CL_BUFFERS]), [shouldBlock](clwrapper::memory<VNN_FLOAT_TYPE> &x) {
-        x.read_from_device(shouldBlock);
-    });
+    if(_inference) return;
+    _parameters_d->read_from_device(false);
 }
 
 void vnn::write_to_device() {
-    bool shouldBlock = false;
-    std::for_each(ALL(_weights_d[MAIN_CL_BUFFERS]), [shouldBlock](clwrapper::memory<VNN_FLOAT_TYPE> &x) {
-        x.write_to_device(shouldBlock);
-    });
-
-    std::for_each(ALL(_biases_d[MAIN_CL_BUFFERS]), [shouldBlock](clwrapper::memory<VNN_FLOAT_TYPE> &x) {
-        x.write_to_device(shouldBlock);
-    });
+    _parameters_d->write_to_device(false);
 }
 
-void vnn::serialize(const std::string &filename) {
-    read_from_device();
-    _context._queue.finish();
+void vnn::set_parameters(const serialization::network<VNN_FLOAT_TYPE> &net) {
+    assert(net.neurons_per_layer == std::vector<uint32_t>(ALL(_neurons_per_layer)) && "Architecture doesn't match");
 
-    std::ofstream out(filename, std::ios::binary | std::ios::out);
+    // No update may still be reading the host copy or writing the parameters
+    _context._queue.finish();
 
-    uint16_t matrix_entry_size = sizeof(VNN_FLOAT_TYPE);
-    uint16_t number_of_layers = static_cast<uint16_t>(_layers);
+    // Without a host copy the parameters are staged and written in one go
+    std::vector<VNN_STORAGE_TYPE> staged;
+    if(_inference) staged.resize(_parameter_count, VNN_STORAGE_TYPE(0));
+    VNN_STORAGE_TYPE* parameters = _inference ? staged.data() : _parameters_d->host_data();
 
-    out.write(BYTE_PTR(matrix_entry_size), sizeof(uint16_t));
-    out.write(BYTE_PTR(number_of_layers), sizeof(uint16_t));
+    for(size_t l = 0; l < _layers-1; l++) {
+        to_storage(net.weights[l].data(), parameters + _weight_offsets[l], net.weights[l].size());
+        to_storage(net.biases[l].data(), parameters + _bias_offsets[l], net.biases[l].size());
+    }
 
-    for(uint i = 0; i < number_of_layers; i++) {
-        out.write(BYTE_PTR(_neurons_per_layer[i]), sizeof(cl_uint));
+    if(_inference) {
+        _context.enqueue_write(_parameters_d->get(), true, 0, sizeof(VNN_STORAGE_TYPE) * _parameter_count, parameters, "write_parameters");
+    } else {
+        write_to_device();
     }
+}
 
-    char *ptr;
-    size_t len;
-    for(uint16_t i = 0; i < number_of_layers-1; i++) {
-        ptr = (byte*)_weights_d[MAIN_CL_BUFFERS][i].host_data();
-        len = _weights_d[MAIN_CL_BUFFERS][i].size();
+bool vnn::serialize(const std::string &filename) {
+    return write_model(filename, false);
+}
 
-        out.write(ptr, sizeof(VNN_FLOAT_TYPE)*len);
+bool vnn::checkpoint(const std::string &filename) {
+    return write_model(filename, true);
+}
 
-        ptr = (byte*)_biases_d[MAIN_CL_BUFFERS][i].host_data();
-        len = _biases_d[MAIN_CL_BUFFERS][i].size();
+void vnn::checkpoint_every(uint epochs, const std::string &filename) {
+    _checkpoint_interval = epochs;
+    _checkpoint_file = filename;
+}
 
-        out.write(ptr, sizeof(VNN_FLOAT_TYPE)*len);
-    }
+bool vnn::write_model(const std::string &filename, bool with_state) {
+    return serialization::write(filename, this->to_network(with_state));
 }
 
+serialization::network<VNN_FLOAT_TYPE> vnn::to_network(bool with_state) {
+    read_from_device();
+    _context._queue.finish();
+
+    serialization::network<VNN_FLOAT_TYPE> net;
+    net.neurons_per_layer = std::vector<uint32_t>(ALL(_neurons_per_layer));
+    for(activation a : _layer_activations) net.activations.push_back(static_cast<uint32_t>(a));
+
+    // Inference only models have no host copy to read into
+    std::vector<VNN_STORAGE_TYPE> staged;
+    if(_inference) {
+        staged.resize(_parameter_count);
+        _context.enqueue_read(
+            _parameters_d->get(), true, 0, sizeof(VNN_STORAGE_TYPE) * _parameter_count, staged.data(), "read_parameters"
+        );
+    }
+    const VNN_STORAGE_TYPE* parameters = _inference ? staged.data() : _parameters_d->host_data();
+    for(size_t i = 0; i < _layers-1; i++) {
+        net.weights.emplace_back(static_cast<size_t>(_neurons_per_layer[i]) * _neurons_per_layer[i+1]);
+        net.biases.emplace_back(_neurons_per_layer[i+1]);
+        from_storage(parameters + _weight_offsets[i], net.weights.back().data(), net.weights.back().size());
+        from_storage(parameters + _bias_offsets[i], net.biases.back().data(), net.biases.back().size());
+    }
+
+    if(with_state) {
+        serialization::training_state<VNN_FLOAT_TYPE> state;
+        state.epoch = _epoch;
+
+        std::ostringstream rng;
+        rng << _rng;
+        state.rng = rng.str();
+
+        state.optimizer_config = _optimizer.to_string();
+        state.step = _step;
+        for(size_t k = 0; k < _optimizer.state_buffers(); k++) {
+            _state_d[k]->read_from_device(true);
+            const VNN_FLOAT_TYPE* arena = _state_d[k]->host_data();
+
+            for(size_t l = 0; l < _layers-1; l++) {
+                const VNN_FLOAT_TYPE* w = arena + _weight_offsets[l];
+                const VNN_FLOAT_TYPE* b = arena + _bias_offsets[l];
+                size_t nW = static_cast<size_t>(_neurons_per_layer[l]) * _neurons_per_layer[l+1];
+                size_t nB = _neurons_per_layer[l+1];
+
+                state.optimizer[serialization::optimizer_tensor(k, "weights", l)] = std::vector<VNN_FLOAT_TYPE>(w, w + nW);
+                state.optimizer[serialization::optimizer_tensor(k, "biases", l)] = std::vector<VNN_FLOAT_TYPE>(b, b + nB);
+            }
+            _state_d[k]->release_host();
+        }
+
+        net.state = state;
+    }
+
+    return net;
+}
@@ -0,0 +1,155 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+using namespace lazyml;
+using namespace lazyml::clwrapper;
+
+static const char* kind_name(command_kind kind) {
+    switch(kind) {
+        case command_kind::KERNEL: return "kernel";
+        case command_kind::WRITE: return "host->device";
+        case command_kind::READ: return "device->host";
+        case command_kind::COPY: return "device->device";
+        case command_kind::MAP: return "map";
+        case command_kind::UNMAP: return "unmap";
+        case command_kind::FILL: return "fill";
+    }
+    return "";
+}
+
+profiler::profiler() : _host_time(0), _dispatch_time(0), _report_out(&std::cout) {}
+
+cl::Event* profiler::record(command_kind kind, const std::string &name, int layer, size_t bytes) {
+    if(_pending.size() >= PROFILER_MAX_PENDING) resolve();
+
+    _pending.push_back({kind, name, layer, bytes, cl::Event()});
+    return &_pending.back().event;
+}
+
+void profiler::resolve() {
+    if(_pending.empty()) return;
+
+    // Events complete in order on an in-order queue, but waiting on all of them is always safe
+    std::vector<cl::Event> events;
+    events.reserve(_pending.size());
+    for(command &c : _pending) events.push_back(c.event);
+    cl::WaitForEvents(events);
+
+    for(command &c : _pending) {
+        uint64_t queued = c.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+        uint64_t submit = c.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+        uint64_t start = c.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        uint64_t end = c.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+        for(stats* s : {&_by_name[c.name], &_by_layer[{c.name, c.layer}]}) {
+            s->count++;
+            s->queued += submit - queued;
+            s->submit += start - submit;
+            s->execute += end - start;
+            s->bytes += c.bytes;
+        }
+
+        _bytes[c.kind] += c.bytes;
+
+        if(_trace_file) _traced.push_back({c.kind, c.name, c.layer, start, end});
+    }
+
+    _pending.clear();
+}
+
+void profiler::finish() {
+    resolve();
+    if(_report_out) report(*_report_out);
+}
+
+void profiler::reset() {
+    _pending.clear();
+    _traced.clear();
+    _by_name.clear();
+    _by_layer.clear();
+    _bytes.clear();
+    _host_time = std::chrono::nanoseconds(0);
+    _dispatch_time = std::chrono::nanoseconds(0);
+}
+
+void profiler::report(std::ostream &out) {
+    resolve();
+
+    auto ms = [](uint64_t ns) { return static_cast<double>(ns) / 1e6; };
+
+    // Most expensive commands first
+    std::vector<std::pair<std::string, stats>> names(_by_name.begin(), _by_name.end());
+    std::sort(names.begin(), names.end(), [](auto &a, auto &b) { return a.second.execute > b.second.execute; });
+
+    uint64_t total = 0;
+    for(auto &[name, s] : names) total += s.execute;
+
+    out << std::fixed << std::setprecision(3);
+    out << "---- profile ----\n";
+    out << std::left << std::setw(24) << "command" << std::right
+        << std::setw(10) << "count"
+        << std::setw(14) << "execute ms"
+        << std::setw(8) << "%"
+        << std::setw(14) << "queued ms"
+        << std::setw(14) << "submit ms"
+        << std::setw(14) << "MB" << "\n";
+
+    for(auto &[name, s] : names) {
+        out << std::left << std::setw(24) << name << std::right
+            << std::setw(10) << s.count
+            << std::setw(14) << ms(s.execute)
+            << std::setw(8) << (total ? 100.0 * s.execute / total : 0.0)
+            << std::setw(14) << ms(s.queued)
+            << std::setw(14) << ms(s.submit)
+            << std::setw(14) << s.bytes / 1e6 << "\n";
+    }
+
+    out << "-- per layer --\n";
+    for(auto &[key, s] : _by_layer) {
+        if(key.second < 0) continue;
+        out << std::left << std::setw(24) << (key.first + "[" + std::to_string(key.second) + "]") << std::right
+            << std::setw(10) << s.count
+            << std::setw(14) << ms(s.execute) << "\n";
+    }
+
+    out << "-- transfers --\n";
+    for(auto &[kind, bytes] : _bytes) {
+        if(kind == command_kind::KERNEL) continue;
+        out << std::left << std::setw(24) << kind_name(kind) << std::right << std::setw(14) << bytes / 1e6 << " MB\n";
+    }
+
+    out << "device time: " << ms(total) << " ms, host enqueue time: " << ms(_host_time.count())
+        << " ms, host dispatch time: " << ms(_dispatch_time.count()) << " ms\n";
+    out << std::defaultfloat;
+
+    if(_trace_file) write_trace(_trace_file.value());
+
+    reset();
+}
+
+void profiler::write_trace(const std::string &filename) {
+    std::ofstream out(filename, std::ios::out | std::ios::trunc);
+    if(!out.is_open()) return;
+
+    uint64_t origin = _traced.empty() ? 0 : _traced.front().start;
+    for(traced_command &c : _traced) origin = std::min(origin, c.start);
+
+    // Chrome trace event format, one row per command kind and layer
+    out << "{\"traceEvents\":[\n";
+    for(size_t i = 0; i < _traced.size(); i++) {
+        traced_command &c = _traced[i];
+
+        out << "{\"name\":\"" << c.name
+            << "\",\"cat\":\"" << kind_name(c.kind)
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":\"" << kind_name(c.kind);
+        if(c.layer >= 0) out << " layer " << c.layer;
+        out << "\",\"ts\":" << (c.start - origin) / 1000.0
+            << ",\"dur\":" << (c.end - c.start) / 1000.0 << "}"
+            << (i + 1 < _traced.size() ? ",\n" : "\n");
+    }
+    out << "]}\n";
+}
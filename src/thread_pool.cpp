@@ -0,0 +1,83 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+using namespace lazyml;
+using namespace lazyml::utils;
+
+thread_pool::thread_pool(size_t threads)
+: _job(nullptr), _n(0), _range(0), _next(0), _pending(0), _generation(0), _stop(false) {
+    if(threads == 0) threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+    // The thread calling parallel_for is the last worker
+    _workers.reserve(threads - 1);
+    for(size_t i = 0; i + 1 < threads; i++) {
+        _workers.emplace_back([this]() { this->worker(); });
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _work_ready.notify_all();
+
+    for(std::thread &t : _workers) t.join();
+}
+
+void thread_pool::parallel_for(size_t n, const std::function<void(size_t, size_t)>& fn, size_t min_range) {
+    if(n == 0) return;
+
+    size_t threads = this->size();
+    size_t range = std::max<size_t>(std::max<size_t>(min_range, 1), (n + threads - 1) / threads);
+
+    // Not worth waking anyone up
+    if(range >= n || _workers.empty()) {
+        fn(0, n);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _job = &fn;
+    _n = n;
+    _range = range;
+    _next = 0;
+    _pending = (n + range - 1) / range;
+    _generation++;
+    _work_ready.notify_all();
+
+    run_ranges(lock);
+
+    _work_done.wait(lock, [this]() { return _pending == 0; });
+    _job = nullptr;
+}
+
+void thread_pool::run_ranges(std::unique_lock<std::mutex>& lock) {
+    while(_job != nullptr && _next < _n) {
+        size_t begin = _next;
+        size_t end = std::min(_n, begin + _range);
+        _next = end;
+
+        const std::function<void(size_t, size_t)>& fn = *_job;
+
+        lock.unlock();
+        fn(begin, end);
+        lock.lock();
+
+        if(--_pending == 0) _work_done.notify_all();
+    }
+}
+
+void thread_pool::worker() {
+    size_t seen = 0;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(true) {
+        _work_ready.wait(lock, [&]() { return _stop || _generation != seen; });
+        if(_stop) return;
+
+        seen = _generation;
+        run_ranges(lock);
+    }
+}
@@ -4,6 +4,14 @@
 #include<vector>
 #include<fstream>
 #include<iostream>
+#include<filesystem>
+#include<cstdlib>
+#include<cstdio>
+
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
 
 using namespace lazyml;
 
@@ -33,3 +41,84 @@ bool utils::file_exists(const std::string &filepath) {
     std::ifstream fi(filepath);
     return fi.good();
 }
+
+bool utils::write_file(const std::string &filepath, const std::vector<unsigned char> &bytes) {
+    const std::string tmp = filepath + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::out | std::ios::trunc);
+        if(!out.is_open()) return false;
+
+        // Closed before checking, the last buffered bytes are only written then
+        out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        out.close();
+        if(out.fail()) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+
+    return std::rename(tmp.c_str(), filepath.c_str()) == 0;
+}
+
+uint64_t utils::hash(const std::string &str, uint64_t seed) {
+    uint64_t h = seed;
+    for(unsigned char c : str) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::string utils::to_hex(uint64_t x) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out(16, '0');
+    for(int i = 15; i >= 0; i--) {
+        out[i] = digits[x & 0xf];
+        x >>= 4;
+    }
+    return out;
+}
+
+std::optional<std::string> utils::cache_directory(const std::string &subdirectory) {
+    std::filesystem::path base;
+
+    if(const char* dir = std::getenv("LAZYML_CACHE_DIR")) base = dir;
+    else if(const char* xdg = std::getenv("XDG_CACHE_HOME")) base = std::filesystem::path(xdg) / "lazyml";
+    else if(const char* home = std::getenv("HOME")) base = std::filesystem::path(home) / ".cache" / "lazyml";
+    else return std::nullopt;
+
+    std::filesystem::path dir = base / subdirectory;
+
+    std::error_code err;
+    std::filesystem::create_directories(dir, err);
+    if(err) return std::nullopt;
+
+    return dir.string();
+}
+
+std::shared_ptr<const utils::mapped_file> utils::mapped_file::open(const std::string &filepath) {
+    int fd = ::open(filepath.c_str(), O_RDONLY);
+    if(fd < 0) return nullptr;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if(data == MAP_FAILED) return nullptr;
+
+    // Data is typically read front to back once, when it's uploaded to the device
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    return std::shared_ptr<const mapped_file>(new mapped_file(static_cast<const uint8_t*>(data), size));
+}
+
+utils::mapped_file::~mapped_file() {
+    munmap(const_cast<uint8_t*>(_data), _size);
+}